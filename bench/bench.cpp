@@ -0,0 +1,257 @@
+// Native micro-benchmarks for the parser, CNF conversion and serialization
+// Build and run through `rake bench:native`
+
+#include "../ext/post_query/parser.h"
+
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <numeric>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+/* Allocation counting */
+static std::atomic<size_t> allocations = 0;
+
+void* operator new(std::size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* ptr = std::malloc(size)) {
+        return ptr;
+    }
+
+    throw std::bad_alloc{};
+}
+
+// Kept out of line, GCC otherwise sees free() on memory from operator new once both are inlined and warns
+[[gnu::noinline]] void operator delete(void* ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept {
+    operator delete(ptr);
+}
+
+namespace {
+    using clock = std::chrono::steady_clock;
+
+    struct category {
+        std::string name;
+        std::vector<std::string> queries;
+    };
+
+    struct result {
+        std::string category;
+        std::string phase;
+        size_t ops;
+        double ns_per_op;
+        double allocs_per_op;
+        double p50;
+        double p90;
+        double p99;
+    };
+
+    struct options {
+        std::string corpus = "bench/corpus.txt";
+        std::string metatags = "bench/metatags.txt";
+        std::string output;
+        size_t iterations = 200;
+        size_t warmup = 10;
+    };
+
+    std::vector<std::string> read_lines(const std::string& path) {
+        std::ifstream file { path };
+        if (!file) {
+            std::cerr << "failed to open " << path << '\n';
+            std::exit(1);
+        }
+
+        std::vector<std::string> res;
+        for (std::string line; std::getline(file, line);) {
+            res.emplace_back(std::move(line));
+        }
+
+        return res;
+    }
+
+    std::vector<category> read_corpus(const std::string& path) {
+        std::vector<category> res;
+        for (std::string& line : read_lines(path)) {
+            if (line.starts_with("## ")) {
+                res.emplace_back(category { .name = line.substr(3), .queries = {} });
+            } else if (!line.empty() && !line.starts_with('#') && !res.empty()) {
+                res.back().queries.emplace_back(std::move(line));
+            }
+        }
+
+        return res;
+    }
+
+    double percentile(std::vector<double>& samples, double p) {
+        if (samples.empty()) {
+            return 0;
+        }
+
+        size_t index = std::min(samples.size() - 1, size_t(p * double(samples.size())));
+        std::ranges::nth_element(samples, samples.begin() + index);
+        return samples[index];
+    }
+
+    // Setup runs untimed before every op, the op itself is timed and its allocations counted
+    template <typename Setup, typename Op>
+    result measure(const options& opts, const category& cat, std::string_view phase, Setup setup, Op op) {
+        std::vector<double> samples;
+        samples.reserve(cat.queries.size() * opts.iterations);
+
+        size_t total_allocations = 0;
+        for (const std::string& query : cat.queries) {
+            for (size_t i = 0; i < opts.warmup + opts.iterations; ++i) {
+                auto state = setup(query);
+
+                size_t allocs_before = allocations.load(std::memory_order_relaxed);
+                auto start = clock::now();
+                op(state);
+                auto end = clock::now();
+                size_t allocs_after = allocations.load(std::memory_order_relaxed);
+
+                if (i >= opts.warmup) {
+                    samples.push_back(std::chrono::duration<double, std::nano>(end - start).count());
+                    total_allocations += allocs_after - allocs_before;
+                }
+            }
+        }
+
+        double total = std::accumulate(samples.begin(), samples.end(), 0.0);
+        size_t ops = samples.size();
+
+        return result {
+            .category = cat.name,
+            .phase = std::string { phase },
+            .ops = ops,
+            .ns_per_op = ops ? total / double(ops) : 0,
+            .allocs_per_op = ops ? double(total_allocations) / double(ops) : 0,
+            .p50 = percentile(samples, 0.50),
+            .p90 = percentile(samples, 0.90),
+            .p99 = percentile(samples, 0.99),
+        };
+    }
+
+    std::string json_escape(std::string_view sv) {
+        std::string res;
+        for (char ch : sv) {
+            if (ch == '"' || ch == '\\') {
+                res.push_back('\\');
+            }
+            res.push_back(ch);
+        }
+        return res;
+    }
+
+    void write_json(const std::string& path, const options& opts, const std::vector<result>& results) {
+        std::ofstream out { path };
+        out << "{\n  \"version\": 1,\n";
+        out << "  \"timestamp\": " << std::chrono::duration_cast<std::chrono::seconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count() << ",\n";
+        out << "  \"compiler\": \"" << json_escape(__VERSION__) << "\",\n";
+        out << "  \"iterations\": " << opts.iterations << ",\n";
+        out << "  \"results\": [\n";
+        for (size_t i = 0; i < results.size(); ++i) {
+            const result& r = results[i];
+            out << "    { \"category\": \"" << json_escape(r.category) << "\", \"phase\": \"" << r.phase << "\""
+                << ", \"ops\": " << r.ops
+                << ", \"ns_per_op\": " << r.ns_per_op
+                << ", \"allocs_per_op\": " << r.allocs_per_op
+                << ", \"p50\": " << r.p50
+                << ", \"p90\": " << r.p90
+                << ", \"p99\": " << r.p99
+                << " }" << (i + 1 < results.size() ? ",\n" : "\n");
+        }
+        out << "  ]\n}\n";
+    }
+
+    options parse_options(int argc, char** argv) {
+        options res;
+        for (int i = 1; i < argc; ++i) {
+            std::string_view arg = argv[i];
+            auto next = [&]() -> std::string {
+                if (i + 1 >= argc) {
+                    std::cerr << "missing value for " << arg << '\n';
+                    std::exit(1);
+                }
+                return argv[++i];
+            };
+
+            if (arg == "--corpus") {
+                res.corpus = next();
+            } else if (arg == "--metatags") {
+                res.metatags = next();
+            } else if (arg == "--output") {
+                res.output = next();
+            } else if (arg == "--iterations") {
+                res.iterations = std::stoul(next());
+            } else if (arg == "--warmup") {
+                res.warmup = std::stoul(next());
+            } else {
+                std::cerr << "usage: " << argv[0]
+                    << " [--corpus FILE] [--metatags FILE] [--output FILE.json] [--iterations N] [--warmup N]\n";
+                std::exit(arg == "--help" ? 0 : 1);
+            }
+        }
+
+        return res;
+    }
+}
+
+int main(int argc, char** argv) {
+    options opts = parse_options(argc, argv);
+    std::vector<category> corpus = read_corpus(opts.corpus);
+    std::vector<std::string> metatags = read_lines(opts.metatags);
+
+    post_query::parser parser { metatags };
+
+    std::vector<result> results;
+    for (const category& cat : corpus) {
+        results.emplace_back(measure(opts, cat, "parse",
+            [](const std::string& query) { return std::string_view { query }; },
+            [&](std::string_view query) { post_query::ast_ptr res = parser.parse(query).value(); }));
+
+        results.emplace_back(measure(opts, cat, "to_cnf",
+            [&](const std::string& query) { return parser.parse(query).value(); },
+            [](post_query::ast_ptr& ast) { ast->to_cnf(); }));
+
+        auto parse_cnf = [&](const std::string& query) {
+            post_query::ast_ptr res = parser.parse(query).value();
+            res->to_cnf();
+            return res;
+        };
+
+        results.emplace_back(measure(opts, cat, "to_sexp", parse_cnf,
+            [](post_query::ast_ptr& ast) { std::string res = ast->to_sexp(); }));
+
+        results.emplace_back(measure(opts, cat, "to_infix", parse_cnf,
+            [](post_query::ast_ptr& ast) { std::string res = ast->to_infix(); }));
+    }
+
+    std::cout << std::left << std::setw(14) << "category" << std::setw(10) << "phase"
+        << std::right << std::setw(12) << "ns/op" << std::setw(12) << "allocs/op"
+        << std::setw(12) << "p50" << std::setw(12) << "p90" << std::setw(12) << "p99" << '\n';
+
+    for (const result& r : results) {
+        std::cout << std::left << std::setw(14) << r.category << std::setw(10) << r.phase
+            << std::right << std::fixed << std::setprecision(1)
+            << std::setw(12) << r.ns_per_op << std::setw(12) << r.allocs_per_op
+            << std::setw(12) << r.p50 << std::setw(12) << r.p90 << std::setw(12) << r.p99 << '\n';
+    }
+
+    if (!opts.output.empty()) {
+        write_json(opts.output, opts, results);
+        std::cout << "results written to " << opts.output << '\n';
+    }
+
+    return 0;
+}
@@ -0,0 +1,95 @@
+# frozen_string_literal: true
+
+# Ruby-level benchmarks over the same corpus as the native harness
+# Usage: ruby -Ilib bench/bench.rb [--output FILE.json] [--iterations N]
+
+require "json"
+require "optparse"
+require "post_query"
+
+options = { corpus: "bench/corpus.txt", metatags: "bench/metatags.txt", iterations: 200, warmup: 10 }
+OptionParser.new do |opts|
+  opts.on("--corpus FILE") { |v| options[:corpus] = v }
+  opts.on("--metatags FILE") { |v| options[:metatags] = v }
+  opts.on("--output FILE") { |v| options[:output] = v }
+  opts.on("--iterations N", Integer) { |v| options[:iterations] = v }
+  opts.on("--warmup N", Integer) { |v| options[:warmup] = v }
+end.parse!
+
+metatags = File.readlines(options[:metatags], chomp: true).reject(&:empty?)
+
+corpus = {}
+File.readlines(options[:corpus], chomp: true).each do |line|
+  if line.start_with?("## ")
+    corpus[line.delete_prefix("## ")] = []
+  elsif !line.empty? && !line.start_with?("#") && !corpus.empty?
+    corpus.values.last << line
+  end
+end
+
+def percentile(sorted, p)
+  sorted.empty? ? 0 : sorted[[(p * sorted.size).to_i, sorted.size - 1].min]
+end
+
+# The setup block runs untimed, the op is timed and its Ruby allocations counted
+def measure(options, category, phase, queries, setup, op)
+  samples = []
+  allocations = 0
+
+  queries.each do |query|
+    (options[:warmup] + options[:iterations]).times do |i|
+      state = setup.call(query)
+
+      allocs_before = GC.stat(:total_allocated_objects)
+      start = Process.clock_gettime(Process::CLOCK_MONOTONIC, :nanosecond)
+      op.call(state)
+      finish = Process.clock_gettime(Process::CLOCK_MONOTONIC, :nanosecond)
+      allocs_after = GC.stat(:total_allocated_objects)
+
+      next if i < options[:warmup]
+
+      samples << (finish - start)
+      allocations += allocs_after - allocs_before
+    end
+  end
+
+  sorted = samples.sort
+  {
+    category: category,
+    phase: phase,
+    ops: samples.size,
+    ns_per_op: samples.sum.fdiv([samples.size, 1].max),
+    allocs_per_op: allocations.fdiv([samples.size, 1].max),
+    p50: percentile(sorted, 0.50),
+    p90: percentile(sorted, 0.90),
+    p99: percentile(sorted, 0.99),
+  }
+end
+
+parse = ->(query) { PostQuery.parse(query, metatags: metatags) }
+parse_cnf = ->(query) { parse.call(query).to_cnf }
+
+results = corpus.flat_map do |category, queries|
+  [
+    measure(options, category, "parse", queries, ->(query) { query }, parse),
+    measure(options, category, "to_cnf", queries, parse, ->(ast) { ast.to_cnf }),
+    measure(options, category, "to_sexp", queries, parse_cnf, ->(ast) { ast.to_sexp }),
+    measure(options, category, "to_infix", queries, parse_cnf, ->(ast) { ast.to_infix }),
+  ]
+end
+
+puts format("%-14s%-10s%12s%12s%12s%12s%12s", "category", "phase", "ns/op", "allocs/op", "p50", "p90", "p99")
+results.each do |r|
+  puts format("%-14s%-10s%12.1f%12.1f%12d%12d%12d", r[:category], r[:phase], r[:ns_per_op], r[:allocs_per_op], r[:p50], r[:p90], r[:p99])
+end
+
+if options[:output]
+  File.write(options[:output], JSON.pretty_generate({
+    version: 1,
+    timestamp: Time.now.to_i,
+    ruby: RUBY_DESCRIPTION,
+    iterations: options[:iterations],
+    results: results,
+  }))
+  puts "results written to #{options[:output]}"
+end
@@ -0,0 +1,24 @@
+# frozen_string_literal: true
+
+# Compare two benchmark result files written by bench.rb or the native harness
+# Usage: ruby bench/compare.rb BASELINE.json CURRENT.json
+
+require "json"
+
+abort "usage: #{$0} BASELINE.json CURRENT.json" unless ARGV.size == 2
+
+baseline, current = ARGV.map do |path|
+  JSON.parse(File.read(path))["results"].to_h { |r| [[r["category"], r["phase"]], r] }
+end
+
+def change(old, new)
+  old.zero? ? 0.0 : (new - old) * 100.0 / old
+end
+
+puts format("%-14s%-10s%12s%12s%9s%12s%12s%9s", "category", "phase", "ns/op", "was", "change", "allocs/op", "was", "change")
+current.each do |key, r|
+  base = baseline[key] or next
+  puts format("%-14s%-10s%12.1f%12.1f%+8.1f%%%12.1f%12.1f%+8.1f%%", *key,
+    r["ns_per_op"], base["ns_per_op"], change(base["ns_per_op"], r["ns_per_op"]),
+    r["allocs_per_op"], base["allocs_per_op"], change(base["allocs_per_op"], r["allocs_per_op"]))
+end
@@ -0,0 +1,413 @@
+// Load replay: runs parse + to_cnf + to_sexp over a query corpus on 1..N pinned threads at once
+// Build and run through `rake bench:replay`, or run tmp/bench/replay directly
+//
+// Allocators are compared by running the same binary with each of them and comparing the outputs:
+//   tmp/bench/replay --label glibc --output glibc.json
+//   LD_PRELOAD=libjemalloc.so.2 tmp/bench/replay --label jemalloc --output jemalloc.json
+//   tmp/bench/replay --arena --label arena --output arena.json
+//   ruby bench/compare.rb glibc.json jemalloc.json
+
+#include "../ext/post_query/parser.h"
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <algorithm>
+#include <atomic>
+#include <barrier>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <numeric>
+#include <string>
+#include <thread>
+#include <vector>
+
+/* Allocation counting and the arena */
+
+// Per thread, so counting doesn't add contention of its own
+static thread_local size_t allocations = 0;
+
+// Bump allocator that is reset after every query, frees within it are no-ops
+struct arena {
+    char* base = nullptr;
+    size_t size = 0;
+    size_t used = 0;
+
+    bool contains(void* ptr) const {
+        return ptr >= base && ptr < base + size;
+    }
+};
+
+static thread_local arena query_arena;
+
+void* operator new(std::size_t size) {
+    allocations += 1;
+
+    arena& a = query_arena;
+    if (a.base) {
+        size_t offset = (a.used + alignof(std::max_align_t) - 1) & ~(alignof(std::max_align_t) - 1);
+        if (offset + size <= a.size) {
+            a.used = offset + size;
+            return a.base + offset;
+        }
+    }
+
+    // Queries that don't fit fall back to malloc
+    if (void* ptr = std::malloc(size)) {
+        return ptr;
+    }
+
+    throw std::bad_alloc{};
+}
+
+void operator delete(void* ptr) noexcept {
+    if (!query_arena.contains(ptr)) {
+        std::free(ptr);
+    }
+}
+
+void operator delete(void* ptr, std::size_t) noexcept {
+    operator delete(ptr);
+}
+
+namespace {
+    using clock = std::chrono::steady_clock;
+
+    struct options {
+        std::string corpus = "bench/corpus.txt";
+        std::string metatags = "bench/metatags.txt";
+        std::string output;
+        std::string label = "default";
+        std::vector<size_t> threads;
+        size_t iterations = 2000;
+        size_t warmup = 50;
+        size_t arena_size = 0;
+        bool pin = true;
+    };
+
+    struct result {
+        size_t threads;
+        size_t ops;
+        double seconds;
+        double ops_per_second;
+        double ns_per_op;
+        double allocs_per_op;
+        double p50;
+        double p99;
+        double p999;
+    };
+
+    std::vector<std::string> read_lines(const std::string& path) {
+        std::ifstream file { path };
+        if (!file) {
+            std::cerr << "failed to open " << path << '\n';
+            std::exit(1);
+        }
+
+        std::vector<std::string> res;
+        for (std::string line; std::getline(file, line);) {
+            res.emplace_back(std::move(line));
+        }
+
+        return res;
+    }
+
+    // Either the categorized benchmark corpus or a plain query log, comments and categories are skipped
+    std::vector<std::string> read_queries(const std::string& path) {
+        std::vector<std::string> res;
+        for (std::string& line : read_lines(path)) {
+            if (!line.empty() && !line.starts_with('#')) {
+                res.emplace_back(std::move(line));
+            }
+        }
+
+        if (res.empty()) {
+            std::cerr << path << " contains no queries\n";
+            std::exit(1);
+        }
+
+        return res;
+    }
+
+    // CPUs this process may run on, threads are pinned to them in order
+    std::vector<int> available_cpus() {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+
+        std::vector<int> res;
+        if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+            for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+                if (CPU_ISSET(cpu, &set)) {
+                    res.push_back(cpu);
+                }
+            }
+        }
+
+        return res;
+    }
+
+    void pin(std::thread& thread, int cpu) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+
+        if (int err = pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set); err != 0) {
+            std::cerr << "failed to pin thread to cpu " << cpu << ": " << std::strerror(err) << '\n';
+        }
+    }
+
+    // Powers of two up to the number of CPUs, and that number itself
+    std::vector<size_t> default_threads(size_t cpus) {
+        std::vector<size_t> res;
+        for (size_t n = 1; n < cpus; n *= 2) {
+            res.push_back(n);
+        }
+
+        res.push_back(std::max<size_t>(cpus, 1));
+        return res;
+    }
+
+    double percentile(std::vector<double>& samples, double p) {
+        if (samples.empty()) {
+            return 0;
+        }
+
+        size_t index = std::min(samples.size() - 1, size_t(p * double(samples.size())));
+        std::ranges::nth_element(samples, samples.begin() + index);
+        return samples[index];
+    }
+
+    struct worker_result {
+        std::vector<double> samples;
+        size_t allocations = 0;
+    };
+
+    // Every thread replays the whole corpus, starting at a different offset so they don't run the same query in lockstep
+    void replay(const options& opts, const post_query::parser& parser, const std::vector<std::string>& queries,
+                size_t offset, std::barrier<>& start, worker_result& res) {
+        std::vector<char> buffer(opts.arena_size);
+        res.samples.reserve(queries.size() * opts.iterations);
+
+        auto run = [&](const std::string& query) {
+            post_query::ast_ptr root = parser.parse(query).value();
+            root->to_cnf();
+            std::string sexp = root->to_sexp();
+        };
+
+        if (opts.arena_size > 0) {
+            query_arena = arena { .base = buffer.data(), .size = buffer.size(), .used = 0 };
+        }
+
+        for (size_t i = 0; i < opts.warmup; ++i) {
+            run(queries[(offset + i) % queries.size()]);
+            query_arena.used = 0;
+        }
+
+        start.arrive_and_wait();
+
+        size_t allocations_before = allocations;
+        for (size_t i = 0; i < queries.size() * opts.iterations; ++i) {
+            const std::string& query = queries[(offset + i) % queries.size()];
+
+            auto begin = clock::now();
+            run(query);
+            auto end = clock::now();
+
+            query_arena.used = 0;
+            res.samples.push_back(std::chrono::duration<double, std::nano>(end - begin).count());
+        }
+
+        res.allocations = allocations - allocations_before;
+        query_arena = arena {};
+    }
+
+    result measure(const options& opts, const post_query::parser& parser, const std::vector<std::string>& queries,
+                   const std::vector<int>& cpus, size_t threads) {
+        std::vector<worker_result> results(threads);
+
+        // The main thread takes part so it can take the time as soon as every worker is warmed up
+        std::barrier start { std::ptrdiff_t(threads + 1) };
+
+        std::vector<std::thread> workers;
+        for (size_t i = 0; i < threads; ++i) {
+            workers.emplace_back(replay, std::cref(opts), std::cref(parser), std::cref(queries),
+                i * queries.size() / threads, std::ref(start), std::ref(results[i]));
+
+            if (opts.pin && !cpus.empty()) {
+                pin(workers.back(), cpus[i % cpus.size()]);
+            }
+        }
+
+        start.arrive_and_wait();
+        auto begin = clock::now();
+
+        for (std::thread& worker : workers) {
+            worker.join();
+        }
+
+        double seconds = std::chrono::duration<double>(clock::now() - begin).count();
+
+        std::vector<double> samples;
+        size_t total_allocations = 0;
+        for (worker_result& r : results) {
+            samples.insert(samples.end(), r.samples.begin(), r.samples.end());
+            total_allocations += r.allocations;
+        }
+
+        double ops = double(samples.size());
+        return result {
+            .threads = threads,
+            .ops = samples.size(),
+            .seconds = seconds,
+            .ops_per_second = ops / seconds,
+            .ns_per_op = std::accumulate(samples.begin(), samples.end(), 0.0) / ops,
+            .allocs_per_op = double(total_allocations) / ops,
+            .p50 = percentile(samples, 0.50),
+            .p99 = percentile(samples, 0.99),
+            .p999 = percentile(samples, 0.999),
+        };
+    }
+
+    std::string json_escape(std::string_view sv) {
+        std::string res;
+        for (char ch : sv) {
+            if (ch == '"' || ch == '\\') {
+                res.push_back('\\');
+            }
+            res.push_back(ch);
+        }
+        return res;
+    }
+
+    // Same layout as the results of bench.cpp, so bench/compare.rb can compare two runs
+    void write_json(const std::string& path, const options& opts, const std::vector<result>& results) {
+        std::ofstream out { path };
+        out << "{\n  \"version\": 1,\n";
+        out << "  \"timestamp\": " << std::chrono::duration_cast<std::chrono::seconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count() << ",\n";
+        out << "  \"compiler\": \"" << json_escape(__VERSION__) << "\",\n";
+        out << "  \"label\": \"" << json_escape(opts.label) << "\",\n";
+        out << "  \"arena_size\": " << opts.arena_size << ",\n";
+        out << "  \"pinned\": " << (opts.pin ? "true" : "false") << ",\n";
+        out << "  \"iterations\": " << opts.iterations << ",\n";
+        out << "  \"results\": [\n";
+        for (size_t i = 0; i < results.size(); ++i) {
+            const result& r = results[i];
+            out << "    { \"category\": \"threads=" << r.threads << "\", \"phase\": \"replay\""
+                << ", \"threads\": " << r.threads
+                << ", \"ops\": " << r.ops
+                << ", \"seconds\": " << r.seconds
+                << ", \"ops_per_second\": " << r.ops_per_second
+                << ", \"ns_per_op\": " << r.ns_per_op
+                << ", \"allocs_per_op\": " << r.allocs_per_op
+                << ", \"p50\": " << r.p50
+                << ", \"p99\": " << r.p99
+                << ", \"p999\": " << r.p999
+                << " }" << (i + 1 < results.size() ? ",\n" : "\n");
+        }
+        out << "  ]\n}\n";
+    }
+
+    std::vector<size_t> parse_list(const std::string& str) {
+        std::vector<size_t> res;
+        for (size_t begin = 0; begin < str.size();) {
+            size_t end = std::min(str.find(',', begin), str.size());
+            res.push_back(std::max(1ul, std::stoul(str.substr(begin, end - begin))));
+            begin = end + 1;
+        }
+
+        return res;
+    }
+
+    options parse_options(int argc, char** argv) {
+        options res;
+        for (int i = 1; i < argc; ++i) {
+            std::string_view arg = argv[i];
+            auto next = [&]() -> std::string {
+                if (i + 1 >= argc) {
+                    std::cerr << "missing value for " << arg << '\n';
+                    std::exit(1);
+                }
+                return argv[++i];
+            };
+
+            if (arg == "--corpus") {
+                res.corpus = next();
+            } else if (arg == "--metatags") {
+                res.metatags = next();
+            } else if (arg == "--output") {
+                res.output = next();
+            } else if (arg == "--label") {
+                res.label = next();
+            } else if (arg == "--threads") {
+                res.threads = parse_list(next());
+            } else if (arg == "--iterations") {
+                res.iterations = std::stoul(next());
+            } else if (arg == "--warmup") {
+                res.warmup = std::stoul(next());
+            } else if (arg == "--arena") {
+                res.arena_size = size_t(1) << 20;
+            } else if (arg == "--arena-size") {
+                res.arena_size = std::stoul(next());
+            } else if (arg == "--no-pin") {
+                res.pin = false;
+            } else {
+                std::cerr << "usage: " << argv[0]
+                    << " [--corpus FILE] [--metatags FILE] [--output FILE.json] [--label NAME] [--threads 1,2,4]"
+                    << " [--iterations N] [--warmup N] [--arena] [--arena-size BYTES] [--no-pin]\n";
+                std::exit(arg == "--help" ? 0 : 1);
+            }
+        }
+
+        return res;
+    }
+}
+
+int main(int argc, char** argv) {
+    options opts = parse_options(argc, argv);
+    std::vector<std::string> queries = read_queries(opts.corpus);
+    std::vector<int> cpus = available_cpus();
+
+    if (opts.threads.empty()) {
+        opts.threads = default_threads(cpus.size());
+    }
+
+    post_query::parser parser { read_lines(opts.metatags) };
+
+    // Anything the parser creates lazily has to be allocated outside of an arena, which is reused after every query
+    for (const std::string& query : queries) {
+        parser.parse(query).value()->to_cnf();
+    }
+
+    std::cout << queries.size() << " queries, " << cpus.size() << " cpus, "
+        << (opts.arena_size > 0 ? "arena" : "malloc") << (opts.pin ? ", pinned" : "") << '\n';
+    std::cout << std::left << std::setw(10) << "threads" << std::right
+        << std::setw(14) << "queries/s" << std::setw(10) << "speedup" << std::setw(12) << "allocs/op"
+        << std::setw(12) << "p50 ns" << std::setw(12) << "p99 ns" << std::setw(12) << "p999 ns" << '\n';
+
+    std::vector<result> results;
+    for (size_t threads : opts.threads) {
+        const result& r = results.emplace_back(measure(opts, parser, queries, cpus, threads));
+
+        // Relative to the first thread count, normally a single thread
+        double speedup = r.ops_per_second / results.front().ops_per_second;
+
+        std::cout << std::left << std::setw(10) << r.threads << std::right << std::fixed
+            << std::setprecision(0) << std::setw(14) << r.ops_per_second
+            << std::setprecision(2) << std::setw(10) << speedup
+            << std::setprecision(1) << std::setw(12) << r.allocs_per_op
+            << std::setprecision(0) << std::setw(12) << r.p50 << std::setw(12) << r.p99 << std::setw(12) << r.p999 << '\n';
+    }
+
+    if (!opts.output.empty()) {
+        write_json(opts.output, opts, results);
+        std::cout << "results written to " << opts.output << '\n';
+    }
+
+    return 0;
+}
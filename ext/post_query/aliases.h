@@ -0,0 +1,151 @@
+#ifndef ALIASES_H
+#define ALIASES_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <optional>
+#include <utility>
+#include <span>
+#include <bit>
+#include <cstdint>
+#include <algorithm>
+
+namespace post_query {
+    // Immutable antecedent -> consequent mapping
+    // All strings are interned into a single buffer, lookups go through an open-addressing table
+    class alias_table {
+        private:
+        struct interned {
+            uint32_t offset;
+            uint32_t size;
+        };
+
+        struct slot {
+            uint64_t hash;
+            interned antecedent;
+            interned consequent;
+        };
+
+        static constexpr uint64_t empty_hash = 0;
+
+        std::string _strings;
+        std::vector<slot> _slots;
+        size_t _size = 0;
+
+        static constexpr uint64_t hash(std::string_view sv) {
+            // FNV-1a, 0 is reserved for empty slots
+            uint64_t res = 0xcbf29ce484222325;
+            for (char ch : sv) {
+                res ^= uint8_t(ch);
+                res *= 0x100000001b3;
+            }
+
+            return res == empty_hash ? 1 : res;
+        }
+
+        std::string_view get(interned str) const {
+            return std::string_view { _strings }.substr(str.offset, str.size);
+        }
+
+        size_t mask() const {
+            return _slots.size() - 1;
+        }
+
+        // Returns the slot for the string, which is either empty or has a matching key
+        const slot& probe(std::string_view key, uint64_t key_hash) const {
+            for (size_t i = key_hash & mask();; i = (i + 1) & mask()) {
+                const slot& s = _slots[i];
+                if (s.hash == empty_hash || (s.hash == key_hash && get(s.antecedent) == key)) {
+                    return s;
+                }
+            }
+        }
+
+        interned intern(std::string_view str, std::vector<std::pair<uint64_t, interned>>& seen) {
+            // Consequents are shared by many antecedents, only store them once
+            uint64_t str_hash = hash(str);
+            size_t seen_mask = seen.size() - 1;
+            for (size_t i = str_hash & seen_mask;; i = (i + 1) & seen_mask) {
+                auto& [h, existing] = seen[i];
+                if (h == empty_hash) {
+                    interned res { uint32_t(_strings.size()), uint32_t(str.size()) };
+                    _strings.append(str);
+                    seen[i] = { str_hash, res };
+                    return res;
+                } else if (h == str_hash && get(existing) == str) {
+                    return existing;
+                }
+            }
+        }
+
+        public:
+        alias_table() : _slots(1) { }
+
+        // Antecedents are expected to be normalized (lowercase), duplicates keep the last consequent
+        explicit alias_table(std::span<const std::pair<std::string, std::string>> aliases) {
+            // Keep the load factor at or below 50%
+            size_t capacity = std::bit_ceil(std::max<size_t>(2 * aliases.size(), 1));
+            _slots.resize(capacity);
+
+            size_t total_size = 0;
+            for (const auto& [antecedent, consequent] : aliases) {
+                total_size += antecedent.size() + consequent.size();
+            }
+            _strings.reserve(total_size);
+
+            std::vector<std::pair<uint64_t, interned>> seen(std::bit_ceil(std::max<size_t>(4 * aliases.size(), 1)));
+
+            for (const auto& [antecedent, consequent] : aliases) {
+                uint64_t key_hash = hash(antecedent);
+                slot& s = const_cast<slot&>(probe(antecedent, key_hash));
+
+                if (s.hash == empty_hash) {
+                    s.hash = key_hash;
+                    s.antecedent = intern(antecedent, seen);
+                    _size += 1;
+                }
+
+                s.consequent = intern(consequent, seen);
+            }
+        }
+
+        std::optional<std::string_view> find(std::string_view antecedent) const {
+            const slot& s = probe(antecedent, hash(antecedent));
+            if (s.hash == empty_hash) {
+                return std::nullopt;
+            }
+
+            return get(s.consequent);
+        }
+
+        size_t size() const {
+            return _size;
+        }
+    };
+
+    // Holds the currently active alias table
+    // Readers take a snapshot and keep using it even if a new table is stored concurrently
+    class alias_registry {
+        private:
+        std::atomic<std::shared_ptr<const alias_table>> _current { std::make_shared<const alias_table>() };
+
+        public:
+        std::shared_ptr<const alias_table> load() const {
+            return _current.load(std::memory_order_acquire);
+        }
+
+        void store(std::shared_ptr<const alias_table> table) {
+            _current.store(std::move(table), std::memory_order_release);
+        }
+
+        static alias_registry& global() {
+            static alias_registry registry;
+            return registry;
+        }
+    };
+}
+
+#endif /* ALIASES_H */
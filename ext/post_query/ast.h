@@ -2,6 +2,14 @@
 #define AST_H
 
 #include "encoding.h"
+#include "aliases.h"
+#include "values.h"
+#include "metatags.h"
+#include "stats.h"
+#include "fingerprint.h"
+#include "facts.h"
+#include "parallel.h"
+#include "json.h"
 
 #include <iostream>
 #include <sstream>
@@ -12,6 +20,9 @@
 #include <variant>
 #include <array>
 #include <ranges>
+#include <map>
+#include <optional>
+#include <limits>
 
 namespace post_query {
     // Sorted alphabetically so we can just compare the integer value for sorting
@@ -34,6 +45,29 @@ namespace post_query {
     static constexpr std::string_view node_type_name(node_type type) {
         return node_type_names[static_cast<int>(type)];
     }
+
+    // Negation normal form only pushes `not` down to the terms,
+    // conjunctive and disjunctive normal form also distribute `or` over `and` and the other way around
+    enum class normal_form {
+        Negation,
+        Conjunctive,
+        Disjunctive,
+    };
+
+    static constexpr std::array<std::string_view, 3> normal_form_names {
+        "nnf", "cnf", "dnf",
+    };
+
+    static constexpr std::string_view normal_form_name(normal_form form) {
+        return normal_form_names[static_cast<int>(form)];
+    }
+
+    // Estimated node counts of every normal form of a query, see ast::estimate_forms
+    struct form_sizes {
+        double nnf;
+        double cnf;
+        double dnf;
+    };
 }
 
 template <>
@@ -43,7 +77,7 @@ struct std::formatter<post_query::node_type> : std::formatter<std::string_view>
     }
 };
 
-std::ostream& operator<<(std::ostream& os, post_query::node_type type) {
+inline std::ostream& operator<<(std::ostream& os, post_query::node_type type) {
     return os << post_query::node_type_name(type);
 }
 
@@ -70,9 +104,12 @@ namespace post_query {
         std::string name;
         std::string value;
         bool quoted;
+
+        // Only present if typed parsing was requested and the metatag has a known value type
+        std::optional<typed_value_result> typed = std::nullopt;
     };
 
-    std::string format_metatag(const metatag_data& data) {
+    inline std::string format_metatag(const metatag_data& data) {
         std::stringstream ss;
         ss << data.name << ':';
 
@@ -93,159 +130,343 @@ namespace post_query {
         std::vector<ast_ptr> // and, or
     >;
 
-    static constexpr std::array<std::pair<std::string_view, std::string_view>, 18> metatag_synonyms {{
-        {"comment_count", "comments"},
-        {"deleted_comment_count", "deleted_comments"},
-        {"active_comment_count", "active_comments"},
-        {"note_count", "notes"},
-        {"deleted_note_count", "deleted_notes"},
-        {"active_note_count", "active_notes"},
-        {"flag_count", "flags"},
-        {"child_count", "children"},
-        {"deleted_child_count", "deleted_children"},
-        {"active_child_count", "active_children"},
-        {"pool_count", "pools"},
-        {"deleted_pool_count", "deleted_pools"},
-        {"active_pool_count", "active_pools"},
-        {"series_pool_count", "series_pools"},
-        {"collection_pool_count", "collection_pools"},
-        {"appeal_count", "appeals"},
-        {"approval_count", "approvals"},
-        {"replacement_count", "replacements"},
-    }};
-
-    static constexpr void normalize_metatag(std::string& name) {
-        for (auto [normalized, synonym] : metatag_synonyms) {
-            if (name == normalized) {
-                return;
-            } else if (name == synonym) {
-                name = normalized;
-                return;
-            }
-        }
-    }
-    
     class ast {
         private:
         node_type _type;
         ast_data _data;
 
-        std::string _join_children(std::string(ast::* method)() const, std::string_view with, bool disable_parens = false) const {
-            std::span<const ast_ptr> children = this->children();
-            if (children.size() == 0) {
-                return "";
-            } else if (children.size() == 1) {
-                const ast_ptr& child = children.front();
-
-                if (disable_parens || child->child_count() > 1) {
-                    return (child.get()->*method)();
-                } else {
-                    return '(' + (child.get()->*method)() + ')';
+        // Move all direct children into `out`, leaving this node without any
+        void detach_children(std::vector<ast_ptr>& out) {
+            if (ast_ptr* child = std::get_if<ast_ptr>(&_data); child && *child) {
+                out.emplace_back(std::move(*child));
+            } else if (std::vector<ast_ptr>* children = std::get_if<std::vector<ast_ptr>>(&_data)) {
+                for (ast_ptr& child : *children) {
+                    if (child) {
+                        out.emplace_back(std::move(child));
+                    }
                 }
-            } else {
-                std::string res;
 
-                for (const ast_ptr& child : children) {
-                    std::string str = (child.get()->*method)();
+                children->clear();
+            }
+        }
+
+        // Copy of only this node, compound nodes get no children
+        ast_ptr shallow_copy() const {
+            switch (_type) {
+                case node_type::Not:
+                case node_type::Opt:
+                    return std::make_unique<ast>(_type, ast_ptr{});
+
+                case node_type::And:
+                case node_type::Or:
+                    return std::make_unique<ast>(_type, std::vector<ast_ptr>{});
+
+                case node_type::Tag:
+                case node_type::Wildcard:
+                    return std::make_unique<ast>(_type, std::get<std::string>(_data));
+
+                case node_type::Metatag:
+                    return std::make_unique<ast>(_type, std::get<metatag_data>(_data));
+
+                default:
+                    return std::make_unique<ast>(_type, std::monostate{});
+            }
+        }
+
+        // Compare only the node itself, compound nodes compare equal so their children decide
+        std::strong_ordering shallow_compare(const ast& other) const {
+            if (_type != other._type) {
+                return _type <=> other._type;
+            }
+
+            switch (_type) {
+                // Just compare the string
+                case node_type::Tag:
+                case node_type::Wildcard:
+                    return std::get<std::string>(_data) <=> std::get<std::string>(other._data);
+
+                // First compare name, then value, ignore quotes
+                case node_type::Metatag: {
+                    const metatag_data& lhs = std::get<metatag_data>(_data);
+                    const metatag_data& rhs = std::get<metatag_data>(other._data);
 
-                    if (!disable_parens && child->child_count() > 1) {
-                        res += '(' + str + ')';
+                    if (auto comp = lhs.name <=> rhs.name; comp != std::strong_ordering::equal) {
+                        return comp;
                     } else {
-                        res += str;
+                        return lhs.value <=> rhs.value;
                     }
-
-                    std::ranges::copy(with, std::back_inserter(res));
                 }
 
-                return res.substr(0, res.size() - with.size());
+                // Single state nodes are equivalent
+                default:
+                    return std::strong_ordering::equal;
             }
         }
 
-        public:
-        ast(node_type t, ast_data data) : _type { t }, _data { std::move(data) } { }
+        // Serialize using an explicit stack of pending nodes and literal pieces
+        template <bool sexp>
+        void write(std::string& out) const {
+            using item = std::variant<const ast*, std::string_view>;
+            std::vector<item> pending { this };
 
-        ~ast() { }
+            while (!pending.empty()) {
+                item next = pending.back();
+                pending.pop_back();
 
-        std::strong_ordering operator<=>(const ast& other) const {
-            if (_type == other._type) {
-                // Mimic Ruby's array comparison
+                if (const std::string_view* piece = std::get_if<std::string_view>(&next)) {
+                    out.append(*piece);
+                    continue;
+                }
 
-                switch (_type) {
-                    // Single state nodes are equivalent
+                const ast& node = *std::get<const ast*>(next);
+                switch (node._type) {
                     case node_type::All:
+                        if constexpr (sexp) {
+                            out.append(node_type_name(node._type));
+                        }
+                        break;
+
                     case node_type::None:
-                        return std::strong_ordering::equal;
+                        out.append(node_type_name(node._type));
+                        break;
 
-                    // Just compare the string
                     case node_type::Tag:
-                    case node_type::Wildcard:
-                        return std::get<std::string>(_data) <=> std::get<std::string>(other._data);
+                        out.append(std::get<std::string>(node._data));
+                        break;
 
-                    // First compare name, then value, ignore quotes
-                    case node_type::Metatag: {
-                        const metatag_data& lhs = std::get<metatag_data>(_data);
-                        const metatag_data& rhs = std::get<metatag_data>(other._data);
-                        
-                        if (auto comp = lhs.name <=> rhs.name; comp != std::strong_ordering::equal) {
-                            return comp;
+                    case node_type::Wildcard:
+                        if constexpr (sexp) {
+                            out.append("(wildcard ");
+                            out.append(std::get<std::string>(node._data));
+                            out.push_back(')');
                         } else {
-                            return lhs.value <=> rhs.value;
+                            out.append(std::get<std::string>(node._data));
                         }
-                    }
+                        break;
+
+                    case node_type::Metatag:
+                        out.append(format_metatag(std::get<metatag_data>(node._data)));
+                        break;
 
-                    // Compare subnode
                     case node_type::Not:
                     case node_type::Opt:
-                        return *std::get<ast_ptr>(_data) <=> *std::get<ast_ptr>(other._data);
-
                     case node_type::And:
                     case node_type::Or: {
-                        // First compare all common elements
-                        auto lhs = this->children();
-                        auto rhs = other.children();
-                        for (size_t i = 0; i < std::min(lhs.size(), rhs.size()); ++i) {
-                            if (std::strong_ordering comp = (*lhs[i] <=> *rhs[i]); comp != std::strong_ordering::equal) {
-                                return comp;
+                        std::span<const ast_ptr> children = node.children();
+
+                        if constexpr (sexp) {
+                            // (type child child ...)
+                            out.push_back('(');
+                            out.append(node_type_name(node._type));
+                            out.push_back(' ');
+
+                            pending.emplace_back(")"sv);
+                            for (size_t i = children.size(); i-- > 0;) {
+                                pending.emplace_back(children[i].get());
+                                if (i != 0) {
+                                    pending.emplace_back(" "sv);
+                                }
                             }
-                        }
+                        } else if (node._type == node_type::Not || node._type == node_type::Opt) {
+                            // -child, ~child or -(child)
+                            const ast_ptr& child = children.front();
+                            out.push_back(node._type == node_type::Not ? '-' : '~');
 
-                        // If common elements are the same, compare sizes
-                        return lhs.size() <=> rhs.size();
+                            if (child->is_term()) {
+                                pending.emplace_back(child.get());
+                            } else {
+                                out.push_back('(');
+                                pending.emplace_back(")"sv);
+                                pending.emplace_back(child.get());
+                            }
+                        } else if (children.size() == 1) {
+                            const ast_ptr& child = children.front();
+
+                            if (child->child_count() > 1) {
+                                pending.emplace_back(child.get());
+                            } else {
+                                out.push_back('(');
+                                pending.emplace_back(")"sv);
+                                pending.emplace_back(child.get());
+                            }
+                        } else {
+                            std::string_view with = (node._type == node_type::And) ? " "sv : " or "sv;
+
+                            for (size_t i = children.size(); i-- > 0;) {
+                                const ast_ptr& child = children[i];
+                                if (child->child_count() > 1) {
+                                    pending.emplace_back(")"sv);
+                                    pending.emplace_back(child.get());
+                                    pending.emplace_back("("sv);
+                                } else {
+                                    pending.emplace_back(child.get());
+                                }
+
+                                if (i != 0) {
+                                    pending.emplace_back(with);
+                                }
+                            }
+                        }
+                        break;
                     }
+                }
+            }
+        }
 
-                    default:
-                        return std::strong_ordering::equal;
+        // Every node in pre-order, parents before their descendants
+        std::vector<ast*> preorder() {
+            std::vector<ast*> res;
+            std::vector<ast*> pending { this };
+
+            while (!pending.empty()) {
+                ast* node = pending.back();
+                pending.pop_back();
+                res.push_back(node);
+
+                std::span<const ast_ptr> children = node->children();
+                for (auto it = children.rbegin(); it != children.rend(); ++it) {
+                    pending.push_back(it->get());
                 }
-            } else {
-                return _type <=> other._type;
             }
+
+            return res;
         }
 
-        ast_ptr copy() const {
-            switch (_type) {
-                case node_type::All:
-                case node_type::None:
-                    return std::make_unique<ast>(_type, std::monostate{});
+        // Bytes to_json writes for this node, excluding what its children write themselves
+        static size_t json_node_size(const ast& node) {
+            size_t res = R"({"type":""})"sv.size() + node_type_name(node._type).size();
 
+            switch (node._type) {
                 case node_type::Tag:
                 case node_type::Wildcard:
-                    return std::make_unique<ast>(_type, std::get<std::string>(_data));
+                    return res + R"(,"name":)"sv.size() + json::string_size(std::get<std::string>(node._data));
 
-                case node_type::Metatag:
-                    return std::make_unique<ast>(_type, std::get<metatag_data>(_data));
+                case node_type::Metatag: {
+                    const metatag_data& data = std::get<metatag_data>(node._data);
+                    return res + R"(,"name":,"value":,"quoted":)"sv.size() + json::string_size(data.name)
+                        + json::string_size(data.value) + (data.quoted ? "true"sv : "false"sv).size();
+                }
 
                 case node_type::Not:
                 case node_type::Opt:
-                    return std::make_unique<ast>(_type, std::get<ast_ptr>(_data)->copy());
-
                 case node_type::And:
-                case node_type::Or: {
-                    return std::make_unique<ast>(_type, ast::copy(std::get<std::vector<ast_ptr>>(_data)));
-                }
+                case node_type::Or:
+                    // Separating commas
+                    return res + R"(,"children":[])"sv.size() + std::max<size_t>(node.child_count(), 1) - 1;
 
                 default:
-                    return nullptr;
+                    return res;
+            }
+        }
+
+        public:
+        ast(node_type t, ast_data data) : _type { t }, _data { std::move(data) } { }
+
+        ast(const ast&) = delete;
+        ast& operator=(const ast&) = delete;
+
+        // Free deep trees without recursing: detach all descendants first, then free them one by one
+        ~ast() {
+            std::vector<ast_ptr> pending;
+            detach_children(pending);
+
+            while (!pending.empty()) {
+                ast_ptr node = std::move(pending.back());
+                pending.pop_back();
+                node->detach_children(pending);
+            }
+        }
+
+        std::strong_ordering operator<=>(const ast& other) const {
+            // Mimic Ruby's array comparison: compare common children in order, then the number of children
+            struct frame {
+                const ast* lhs;
+                const ast* rhs;
+                size_t index;
+            };
+
+            if (auto comp = shallow_compare(other); comp != std::strong_ordering::equal) {
+                return comp;
+            } else if (children().empty() && other.children().empty()) {
+                return std::strong_ordering::equal;
+            }
+
+            // Most trees are shallow, so the first frames live on the stack and only deeper ones spill to the heap
+            std::array<frame, 16> local;
+            std::vector<frame> spilled;
+            size_t depth = 0;
+
+            auto top = [&]() -> frame& {
+                return (depth <= local.size()) ? local[depth - 1] : spilled.back();
+            };
+            auto push = [&](frame f) {
+                if (depth < local.size()) {
+                    local[depth] = f;
+                } else {
+                    spilled.push_back(f);
+                }
+                depth += 1;
+            };
+            auto pop = [&]() {
+                if (depth > local.size()) {
+                    spilled.pop_back();
+                }
+                depth -= 1;
+            };
+
+            push({ this, &other, 0 });
+            while (depth > 0) {
+                frame& current = top();
+                std::span<const ast_ptr> lhs = current.lhs->children();
+                std::span<const ast_ptr> rhs = current.rhs->children();
+
+                if (current.index < std::min(lhs.size(), rhs.size())) {
+                    const ast& lhs_child = *lhs[current.index];
+                    const ast& rhs_child = *rhs[current.index];
+                    current.index += 1;
+
+                    if (auto comp = lhs_child.shallow_compare(rhs_child); comp != std::strong_ordering::equal) {
+                        return comp;
+                    }
+
+                    // Equal terms have nothing left to compare
+                    if (!lhs_child.children().empty() || !rhs_child.children().empty()) {
+                        push({ &lhs_child, &rhs_child, 0 });
+                    }
+                } else if (auto comp = lhs.size() <=> rhs.size(); comp != std::strong_ordering::equal) {
+                    return comp;
+                } else {
+                    pop();
+                }
             }
+
+            return std::strong_ordering::equal;
+        }
+
+        ast_ptr copy() const {
+            ast_ptr res = shallow_copy();
+
+            std::vector<std::pair<const ast*, ast*>> pending { { this, res.get() } };
+            while (!pending.empty()) {
+                auto [src, dst] = pending.back();
+                pending.pop_back();
+
+                if (const ast_ptr* child = std::get_if<ast_ptr>(&src->_data)) {
+                    ast_ptr& dst_child = std::get<ast_ptr>(dst->_data);
+                    dst_child = (*child)->shallow_copy();
+                    pending.emplace_back(child->get(), dst_child.get());
+                } else if (const std::vector<ast_ptr>* children = std::get_if<std::vector<ast_ptr>>(&src->_data)) {
+                    std::vector<ast_ptr>& dst_children = std::get<std::vector<ast_ptr>>(dst->_data);
+                    dst_children.reserve(children->size());
+
+                    for (const ast_ptr& child : *children) {
+                        dst_children.emplace_back(child->shallow_copy());
+                        pending.emplace_back(child.get(), dst_children.back().get());
+                    }
+                }
+            }
+
+            return res;
         }
 
         static std::vector<ast_ptr> copy(std::span<const ast_ptr> src) {
@@ -256,6 +477,17 @@ namespace post_query {
 
         node_type type() const { return _type; }
 
+        // Turn this node into `other`, which must not be part of this tree
+        void replace_with(ast_ptr other) {
+            _type = other->_type;
+            _data = std::move(other->_data);
+        }
+
+        // Name of a tag or wildcard
+        const std::string& name() const { return std::get<std::string>(_data); }
+
+        const metatag_data& metatag() const { return std::get<metatag_data>(_data); }
+
         bool is_term() const {
             switch (_type) {
                 case node_type::All:
@@ -271,65 +503,204 @@ namespace post_query {
         }
 
         std::string to_sexp() const {
-            switch (_type) {
-                case node_type::All:
-                case node_type::None:
-                    return std::string { node_type_name(_type) };
+            phase_timer timer { phase::Serialize };
 
-                case node_type::Tag:
-                    return std::get<std::string>(_data);
+            std::string res;
+            write<true>(res);
+            return res;
+        }
 
-                case node_type::Wildcard:
-                    return std::format("(wildcard {})", std::get<std::string>(_data));
+        std::string to_infix() const {
+            phase_timer timer { phase::Serialize };
 
-                case node_type::Metatag:
-                    return format_metatag(std::get<metatag_data>(_data));
+            std::string res;
+            write<false>(res);
+            return res;
+        }
 
-                case node_type::Not:
-                case node_type::Opt:
-                case node_type::And:
-                case node_type::Or:
-                    return std::format("({} {})", _type, _join_children(&ast::to_sexp, " ", true));
+        // One object per node, e.g. {"type":"and","children":[{"type":"tag","name":"1girl"}]}
+        // Tags and wildcards add "name", metatags "name", "value" and "quoted", compound nodes "children"
+        // The exact length is computed first, then `allocate(length)` returns the buffer the document is written into
+        template <typename Allocate>
+        char* to_json(Allocate&& allocate) const {
+            phase_timer timer { phase::Serialize };
+
+            size_t size = 0;
+            std::vector<const ast*> nodes { this };
+            while (!nodes.empty()) {
+                const ast& node = *nodes.back();
+                nodes.pop_back();
+
+                size += json_node_size(node);
+                for (const ast_ptr& child : node.children()) {
+                    nodes.push_back(child.get());
+                }
+            }
 
-                default:
-                    return "unknown";
+            char* begin = allocate(size);
+            char* out = begin;
+
+            using item = std::variant<const ast*, std::string_view>;
+            std::vector<item> pending { this };
+            while (!pending.empty()) {
+                item next = pending.back();
+                pending.pop_back();
+
+                if (const std::string_view* piece = std::get_if<std::string_view>(&next)) {
+                    out = json::write_raw(out, *piece);
+                    continue;
+                }
+
+                const ast& node = *std::get<const ast*>(next);
+                out = json::write_raw(out, R"({"type":")"sv);
+                out = json::write_raw(out, node_type_name(node._type));
+                out = json::write_raw(out, "\""sv);
+
+                switch (node._type) {
+                    case node_type::Tag:
+                    case node_type::Wildcard:
+                        out = json::write_raw(out, R"(,"name":)"sv);
+                        out = json::write_string(out, std::get<std::string>(node._data));
+                        out = json::write_raw(out, "}"sv);
+                        break;
+
+                    case node_type::Metatag: {
+                        const metatag_data& data = std::get<metatag_data>(node._data);
+                        out = json::write_raw(out, R"(,"name":)"sv);
+                        out = json::write_string(out, data.name);
+                        out = json::write_raw(out, R"(,"value":)"sv);
+                        out = json::write_string(out, data.value);
+                        out = json::write_raw(out, data.quoted ? R"(,"quoted":true})"sv : R"(,"quoted":false})"sv);
+                        break;
+                    }
+
+                    case node_type::Not:
+                    case node_type::Opt:
+                    case node_type::And:
+                    case node_type::Or: {
+                        std::span<const ast_ptr> children = node.children();
+                        out = json::write_raw(out, R"(,"children":[)"sv);
+
+                        pending.emplace_back("]}"sv);
+                        for (size_t i = children.size(); i-- > 0;) {
+                            pending.emplace_back(children[i].get());
+                            if (i != 0) {
+                                pending.emplace_back(","sv);
+                            }
+                        }
+                        break;
+                    }
+
+                    default:
+                        out = json::write_raw(out, "}"sv);
+                        break;
+                }
             }
+
+            return out;
         }
 
-        std::string to_infix() const {
-            switch (_type) {
-                case node_type::All:
-                    return "";
+        std::string to_json() const {
+            std::string res;
+            to_json([&res](size_t size) {
+                res.resize(size);
+                return res.data();
+            });
 
-                case node_type::None:
-                    return "none";
+            return res;
+        }
 
-                case node_type::Tag:
-                case node_type::Wildcard:
-                    return std::get<std::string>(_data);
+        // Number of nodes in this tree, including this one
+        size_t node_count() const {
+            size_t res = 0;
+            std::vector<const ast*> pending { this };
+            while (!pending.empty()) {
+                const ast* node = pending.back();
+                pending.pop_back();
+                res += 1;
+
+                for (const ast_ptr& child : node->children()) {
+                    pending.push_back(child.get());
+                }
+            }
 
-                case node_type::Metatag:
-                    return format_metatag(std::get<metatag_data>(_data));
+            return res;
+        }
 
-                case node_type::Not: {
-                    const ast_ptr& child = std::get<ast_ptr>(_data);
-                    return '-' + (child->is_term() ? child->to_infix() : '(' + child->to_infix() + ')');
+        // Heap bytes owned by this tree, including the allocation of this node
+        size_t memsize() const {
+            auto string_size = [](const std::string& str) -> size_t {
+                // Short strings are stored inline
+                return (str.capacity() > std::string{}.capacity()) ? str.capacity() + 1 : 0;
+            };
+
+            size_t res = 0;
+            std::vector<const ast*> pending { this };
+            while (!pending.empty()) {
+                const ast* node = pending.back();
+                pending.pop_back();
+
+                res += sizeof(ast);
+
+                if (const std::string* name = std::get_if<std::string>(&node->_data)) {
+                    res += string_size(*name);
+                } else if (const metatag_data* metatag = std::get_if<metatag_data>(&node->_data)) {
+                    res += string_size(metatag->name) + string_size(metatag->value);
+
+                    if (metatag->typed && metatag->typed->has_value()) {
+                        res += (*metatag->typed)->ranges.capacity() * sizeof(value_range);
+                    } else if (metatag->typed) {
+                        res += string_size(metatag->typed->error());
+                    }
+                } else if (const std::vector<ast_ptr>* children = std::get_if<std::vector<ast_ptr>>(&node->_data)) {
+                    res += children->capacity() * sizeof(ast_ptr);
                 }
 
-                case node_type::Opt: {
-                    const ast_ptr& child = std::get<ast_ptr>(_data);
-                    return '~' + (child->is_term() ? child->to_infix() : '(' + child->to_infix() + ')');
+                for (const ast_ptr& child : node->children()) {
+                    pending.push_back(child.get());
                 }
+            }
 
-                case node_type::And:
-                    return _join_children(&ast::to_infix, " ");
+            return res;
+        }
 
-                case node_type::Or:
-                    return _join_children(&ast::to_infix, " or ");
+        // Hash of the canonical CNF, equal for queries that only differ in spacing, synonyms, clause order or
+        // the case of tag and metatag names, metatag values keep their case since the registry doesn't say which ignore it
+        // Nodes are fed to the hasher in pre-order as their type followed by their strings or child count,
+        // the quotes of a metatag value don't change its meaning and are left out
+        query_fingerprint fingerprint() const {
+            ast_ptr cnf = copy();
+            cnf->to_cnf();
 
-                default:
-                    return "unknown";
+            return cnf->cnf_fingerprint();
+        }
+
+        // Same as fingerprint, for a tree that was already converted with to_cnf
+        query_fingerprint cnf_fingerprint() const {
+            fingerprint_hasher hasher { fingerprint_version };
+            std::vector<const ast*> pending { this };
+            while (!pending.empty()) {
+                const ast* node = pending.back();
+                pending.pop_back();
+
+                hasher.update(uint8_t(node->_type));
+
+                if (const std::string* name = std::get_if<std::string>(&node->_data)) {
+                    hasher.update_string(*name);
+                } else if (const metatag_data* metatag = std::get_if<metatag_data>(&node->_data)) {
+                    hasher.update_string(metatag->name);
+                    hasher.update_string(metatag->value);
+                } else if (std::get_if<std::vector<ast_ptr>>(&node->_data)) {
+                    hasher.update(uint32_t(node->child_count()));
+                }
+
+                std::span<const ast_ptr> children = node->children();
+                for (auto it = children.rbegin(); it != children.rend(); ++it) {
+                    pending.push_back(it->get());
+                }
             }
+
+            return hasher.finish();
         }
 
         size_t child_count() const {
@@ -362,13 +733,434 @@ namespace post_query {
             }
         }
 
+        // Replace every tag that has an alias by its consequent, mutates the AST
+        void normalize_aliases(const alias_table& aliases) {
+            rewrite([&aliases](ast& node) {
+                if (node.type() == node_type::Tag) {
+                    std::string& name = std::get<std::string>(node._data);
+                    if (auto consequent = aliases.find(name)) {
+                        name = *consequent;
+                    }
+                }
+            });
+        }
+
+        // Single range constraint of an ordered numeric metatag, if this is one
+        std::optional<value_range> range() const {
+            if (_type != node_type::Metatag) {
+                return std::nullopt;
+            }
+
+            const metatag_data& data = std::get<metatag_data>(_data);
+            if (!is_range_metatag(data.name)) {
+                return std::nullopt;
+            }
+
+            typed_value_result typed = data.typed ? *data.typed : parse_typed_value(*metatag_value_type(data.name), data.value);
+            if (!typed || typed->ranges.size() != 1) {
+                return std::nullopt;
+            }
+
+            return typed->ranges.front();
+        }
+
+        // Intersect range metatags within every `and`, mutates the AST
+        // Redundant bounds are removed, empty intersections turn the whole conjunction into `none`
+        void prune_ranges() {
+            rewrite([](ast& node) {
+                if (node._type != node_type::And) {
+                    return;
+                }
+
+                std::vector<ast_ptr>& children = std::get<std::vector<ast_ptr>>(node._data);
+
+                std::vector<std::optional<value_range>> ranges;
+                ranges.reserve(children.size());
+
+                std::map<std::string_view, std::vector<size_t>> groups;
+                for (size_t i = 0; i < children.size(); ++i) {
+                    ranges.emplace_back(children[i]->range());
+                    if (ranges.back()) {
+                        groups[std::get<metatag_data>(children[i]->_data).name].push_back(i);
+                    }
+                }
+
+                std::vector<bool> keep(children.size(), true);
+                for (const auto& [name, group] : groups) {
+                    value_range total = *ranges[group.front()];
+                    for (size_t i : group) {
+                        total = total.intersect(*ranges[i]);
+                    }
+
+                    if (total.empty()) {
+                        node._type = node_type::None;
+                        node._data = std::monostate{};
+                        return;
+                    }
+
+                    // Keep the fewest constraints that still produce the intersection
+                    auto supplies_min = [&](size_t i) { return ranges[i]->same_min(total); };
+                    auto supplies_max = [&](size_t i) { return ranges[i]->same_max(total); };
+
+                    std::vector<size_t> kept;
+                    if (auto both = std::ranges::find_if(group, [&](size_t i) { return supplies_min(i) && supplies_max(i); }); both != group.end()) {
+                        kept.push_back(*both);
+                    } else {
+                        // Bounds that compare unequal to themselves never supply the intersection, keep the whole group then
+                        auto min = std::ranges::find_if(group, supplies_min);
+                        auto max = std::ranges::find_if(group, supplies_max);
+                        if (min == group.end() || max == group.end()) {
+                            continue;
+                        }
+
+                        kept.push_back(*min);
+                        kept.push_back(*max);
+                    }
+
+                    for (size_t i : group) {
+                        keep[i] = std::ranges::contains(kept, i);
+                    }
+                }
+
+                size_t i = 0;
+                std::erase_if(children, [&](const ast_ptr&) { return !keep[i++]; });
+            });
+
+            fold_constants();
+        }
+
+        // Replace terms with a known value by `all` or `none` and fold them away, mutates the AST
+        void specialize(const fact_set& facts) {
+            rewrite([&facts](ast& node) {
+                std::optional<bool> truth;
+                if (node._type == node_type::Tag) {
+                    truth = facts.tag(std::get<std::string>(node._data));
+                } else if (node._type == node_type::Metatag) {
+                    const metatag_data& data = std::get<metatag_data>(node._data);
+                    truth = facts.metatag(data.name, data.value);
+                }
+
+                if (truth) {
+                    node._type = *truth ? node_type::All : node_type::None;
+                    node._data = std::monostate{};
+                }
+            });
+
+            fold_constants();
+        }
+
+        // The reverse of distribution, pulls terms and subexpressions that several children share out of them, mutates the AST
+        // `(a b) or (a c) or (a d)` becomes `a (b or c or d)` and `(a or b) (a or c)` becomes `a or (b c)`
+        // The most frequent ones are tried first and a step is only taken if it makes the tree smaller
+        void factor() {
+            flatten();
+            rewrite([](ast& node) {
+                while (node.factor_node()) { }
+            });
+
+            flatten();
+            sort();
+        }
+
+        // Propagate `all` and `none` upwards through the tree, mutates the AST
+        void fold_constants() {
+            // Reverse pre-order folds all children before their parent
+            std::vector<ast*> nodes = preorder();
+            for (auto it = nodes.rbegin(); it != nodes.rend(); ++it) {
+                (*it)->fold_node();
+            }
+
+            // Outside of an `and` or `or`, an optional term is just the term itself
+            if (std::optional<node_type> constant = opt_constant(); constant) {
+                _type = *constant;
+                _data = std::monostate{};
+            }
+        }
+
+        // `all` or `none` if this is an optional constant
+        std::optional<node_type> opt_constant() const {
+            if (_type != node_type::Opt) {
+                return std::nullopt;
+            }
+
+            node_type child = std::get<ast_ptr>(_data)->_type;
+            if (child == node_type::All || child == node_type::None) {
+                return child;
+            }
+
+            return std::nullopt;
+        }
+
+        void fold_node() {
+            switch (_type) {
+                case node_type::Not: {
+                    ast_ptr& child = std::get<ast_ptr>(_data);
+                    node_type child_type = child->opt_constant().value_or(child->_type);
+
+                    if (child_type == node_type::All || child_type == node_type::None) {
+                        _type = (child_type == node_type::All) ? node_type::None : node_type::All;
+                        _data = std::monostate{};
+                    }
+                    break;
+                }
+
+                case node_type::And:
+                case node_type::Or: {
+                    // `none` absorbs an `and`, `all` absorbs an `or`, the other one is the identity
+                    node_type absorbing = (_type == node_type::And) ? node_type::None : node_type::All;
+                    node_type identity = (_type == node_type::And) ? node_type::All : node_type::None;
+
+                    std::vector<ast_ptr>& children = std::get<std::vector<ast_ptr>>(_data);
+
+                    auto is_opt = [](const ast_ptr& child) { return child->_type == node_type::Opt; };
+                    auto is_opt_of = [](node_type type) {
+                        return [type](const ast_ptr& child) { return child->opt_constant() == type; };
+                    };
+
+                    // Optional terms form a single `or` among their siblings, see rewrite_opts
+                    // Within an `or` that's the same as the term itself
+                    bool absorbed = std::ranges::any_of(children, [absorbing](const ast_ptr& child) { return child->_type == absorbing; });
+                    if (_type == node_type::Or) {
+                        absorbed = absorbed || std::ranges::any_of(children, is_opt_of(node_type::All));
+                        std::erase_if(children, is_opt_of(node_type::None));
+                    } else if (std::ranges::any_of(children, is_opt_of(node_type::All))) {
+                        std::erase_if(children, is_opt);
+                    } else if (std::ranges::any_of(children, is_opt)) {
+                        absorbed = absorbed || std::ranges::all_of(children | std::views::filter(is_opt), is_opt_of(node_type::None));
+                        std::erase_if(children, is_opt_of(node_type::None));
+                    }
+
+                    if (absorbed) {
+                        _type = absorbing;
+                        _data = std::monostate{};
+                        break;
+                    }
+
+                    std::erase_if(children, [identity](const ast_ptr& child) { return child->_type == identity; });
+
+                    if (children.empty()) {
+                        _type = identity;
+                        _data = std::monostate{};
+                    } else if (children.size() == 1) {
+                        ast_ptr child = std::move(children.front());
+
+                        // An optional term alone in its group is required, lifting it into the parent's group would make it optional again
+                        if (child->_type == node_type::Opt) {
+                            child = std::move(std::get<ast_ptr>(child->_data));
+                        }
+
+                        _type = child->_type;
+                        _data = std::move(child->_data);
+                    }
+                    break;
+                }
+
+                default:
+                    break;
+            }
+        }
+
         // This operation mutates the AST
         void to_cnf() {
-            rewrite_opts();
-            
-            while (simplify()) { }
+            to_normal_form(normal_form::Conjunctive);
+        }
 
-            sort();
+        void to_dnf() {
+            to_normal_form(normal_form::Disjunctive);
+        }
+
+        void to_nnf() {
+            to_normal_form(normal_form::Negation);
+        }
+
+        // Converts to the smaller of CNF and DNF, or to NNF if neither fits in `max_nodes` nodes
+        // NNF never grows beyond twice the size of the query, the other two can grow exponentially
+        normal_form to_best_form(size_t max_nodes) {
+            form_sizes sizes = estimate_forms();
+
+            normal_form res = (sizes.dnf < sizes.cnf) ? normal_form::Disjunctive : normal_form::Conjunctive;
+            if (std::min(sizes.cnf, sizes.dnf) > double(max_nodes)) {
+                res = normal_form::Negation;
+            }
+
+            to_normal_form(res);
+            return res;
+        }
+
+        // Node counts of each normal form, computed bottom-up without building any of them
+        // Every form is a set of clauses, distributing multiplies their counts:
+        // (a b) or (c d e) has 2 * 3 clauses in CNF, each with one literal from either side
+        // Duplicates that simplification would remove are counted, so these are upper bounds
+        form_sizes estimate_forms() const {
+            // Clauses of CNF or conjunctions of DNF, the nodes of all their literals, and the clauses with a single literal
+            struct clause_size {
+                double clauses;
+                double literals;
+                double units;
+            };
+
+            // Joining forms of the same kind just appends their clauses, the other kind needs every combination
+            auto sum = [](clause_size lhs, clause_size rhs) {
+                return clause_size { .clauses = lhs.clauses + rhs.clauses, .literals = lhs.literals + rhs.literals, .units = lhs.units + rhs.units };
+            };
+
+            auto product = [](clause_size lhs, clause_size rhs) {
+                return clause_size {
+                    .clauses = lhs.clauses * rhs.clauses,
+                    .literals = lhs.literals * rhs.clauses + rhs.literals * lhs.clauses,
+                    .units = 0,
+                };
+            };
+
+            // Operators are flattened into a parent of the same type, so only the topmost one counts
+            struct polarity {
+                double nnf;
+                node_type top;
+                clause_size cnf;
+                clause_size dnf;
+            };
+
+            // Every subtree as itself and negated, a `not` swaps the two
+            struct estimate {
+                polarity pos;
+                polarity neg;
+            };
+
+            auto combine = [&](const polarity& lhs, const polarity& rhs, node_type type) {
+                auto nnf = [type](const polarity& operand) { return operand.nnf - (operand.top == type ? 1 : 0); };
+                bool is_or = (type == node_type::Or);
+
+                return polarity {
+                    .nnf = 1 + nnf(lhs) + nnf(rhs),
+                    .top = type,
+                    .cnf = is_or ? product(lhs.cnf, rhs.cnf) : sum(lhs.cnf, rhs.cnf),
+                    .dnf = is_or ? sum(lhs.dnf, rhs.dnf) : product(lhs.dnf, rhs.dnf),
+                };
+            };
+
+            // Operands of an `and` or `or`, negated it's the other one, a single operand replaces its parent
+            auto conjunction = [&](std::span<const estimate> operands, node_type type) {
+                node_type dual = (type == node_type::And) ? node_type::Or : node_type::And;
+
+                estimate res = operands.front();
+                for (const estimate& operand : operands.subspan(1)) {
+                    res.pos = combine(res.pos, operand.pos, type);
+                    res.neg = combine(res.neg, operand.neg, dual);
+                }
+
+                return res;
+            };
+
+            std::vector<const ast*> nodes;
+            std::vector<const ast*> pending { this };
+            while (!pending.empty()) {
+                const ast* node = pending.back();
+                pending.pop_back();
+                nodes.push_back(node);
+
+                std::span<const ast_ptr> children = node->children();
+                for (auto it = children.rbegin(); it != children.rend(); ++it) {
+                    pending.push_back(it->get());
+                }
+            }
+
+            polarity term { .nnf = 1, .top = node_type::Tag, .cnf = { 1, 1, 1 }, .dnf = { 1, 1, 1 } };
+            polarity negated { .nnf = 2, .top = node_type::Not, .cnf = { 1, 2, 1 }, .dnf = { 1, 2, 1 } };
+
+            // In reverse pre-order the estimates of a node's children are on top of the stack, first child on top
+            std::vector<estimate> stack;
+            for (auto it = nodes.rbegin(); it != nodes.rend(); ++it) {
+                const ast* node = *it;
+
+                switch (node->type()) {
+                    case node_type::Not: {
+                        std::swap(stack.back().pos, stack.back().neg);
+                        break;
+                    }
+
+                    // Same as its child, the parent `and` or `or` groups it with its other opts
+                    case node_type::Opt:
+                        break;
+
+                    case node_type::And:
+                    case node_type::Or: {
+                        std::vector<estimate> operands;
+                        std::vector<estimate> opts;
+                        for (const ast_ptr& child : node->children()) {
+                            (child->type() == node_type::Opt ? opts : operands).push_back(stack.back());
+                            stack.pop_back();
+                        }
+
+                        // See rewrite_opts
+                        if (!opts.empty()) {
+                            operands.push_back(conjunction(opts, node_type::Or));
+                        }
+
+                        if (operands.empty()) {
+                            stack.push_back(estimate { .pos = term, .neg = term });
+                        } else {
+                            stack.push_back(conjunction(operands, node->type()));
+                        }
+                        break;
+                    }
+
+                    default:
+                        stack.push_back(estimate { .pos = term, .neg = negated });
+                        break;
+                }
+            }
+
+            // A single clause is the root itself, and a clause with a single literal is just that literal
+            auto clause_nodes = [](clause_size size) {
+                if (size.clauses == 1) {
+                    return size.literals + (size.units == 1 ? 0 : 1);
+                }
+
+                return 1 + (size.clauses - size.units) + size.literals;
+            };
+
+            const polarity& root = stack.back().pos;
+            return form_sizes {
+                .nnf = root.nnf,
+                .cnf = clause_nodes(root.cnf),
+                .dnf = clause_nodes(root.dnf),
+            };
+        }
+
+        void to_normal_form(normal_form form) {
+            query_stats& stats = query_stats::global();
+            bool record = stats.enabled();
+            if (record) {
+                stats.add(counter::Conversions);
+                stats.add(counter::NodesBefore, node_count());
+            }
+
+            {
+                phase_timer timer { phase::RewriteOpts };
+                rewrite_opts();
+            }
+
+            {
+                phase_timer timer { phase::Simplify };
+
+                size_t iterations = 1;
+                while (simplify(form)) {
+                    iterations += 1;
+                }
+
+                if (record) {
+                    stats.add(counter::SimplifyIterations, iterations);
+                }
+            }
+
+            {
+                phase_timer timer { phase::Sort };
+                sort();
+            }
+
+            if (record) {
+                stats.add(counter::NodesAfter, node_count());
+            }
         }
 
         void rewrite_opts() {
@@ -415,8 +1207,56 @@ namespace post_query {
         }
 
         // Return whether anything changed
-        bool simplify() {
-            // Simplify recursively
+        bool simplify(normal_form form) {
+            // Nodes that changed are not descended into, they are revisited in the next pass
+            bool changed = false;
+
+            std::vector<ast*> pending { this };
+            while (!pending.empty()) {
+                ast* node = pending.back();
+                pending.pop_back();
+
+                if (node->simplify_node(form)) {
+                    changed = true;
+                    continue;
+                }
+
+                std::span<const ast_ptr> children = node->children();
+                for (auto it = children.rbegin(); it != children.rend(); ++it) {
+                    pending.push_back(it->get());
+                }
+            }
+
+            return changed;
+        }
+
+        // Distributions producing fewer clauses stay on the calling thread, the pool only pays off for large products
+        static constexpr size_t parallel_distribution_clauses = 4096;
+
+        // Clauses a single task of a parallel distribution builds before others can steal the rest of its range
+        static constexpr size_t parallel_distribution_grain = 256;
+
+        // Clause `index` of distributing this node over `inners`, the same one the serial loop in simplify_node produces there:
+        // the subchild taken from the first inner node changes fastest
+        ast_ptr distributed_clause(std::span<const ast_ptr> rest, std::span<const ast_ptr> inners, size_t index) const {
+            std::vector<ast_ptr> children;
+            children.reserve(rest.size() + inners.size());
+
+            for (const ast_ptr& child : rest) {
+                children.emplace_back(child->copy());
+            }
+
+            for (const ast_ptr& inner : inners) {
+                std::span<const ast_ptr> choices = inner->children();
+                children.emplace_back(choices[index % choices.size()]->copy());
+                index /= choices.size();
+            }
+
+            return ast_ptr { new ast { _type, std::move(children) } };
+        }
+
+        // Apply a single rewrite step to this node only, return whether anything changed
+        bool simplify_node(normal_form form) {
             switch (_type) {
                 case node_type::All:
                 case node_type::None:
@@ -462,7 +1302,13 @@ namespace post_query {
                 case node_type::Or: {
                     std::vector<ast_ptr>& children = std::get<std::vector<ast_ptr>>(_data);
 
-                    auto is_and = [](const ast_ptr& child) { return child->type() == node_type::And; };
+                    // CNF distributes `or` over `and`, DNF `and` over `or`
+                    node_type inner = (_type == node_type::And) ? node_type::Or : node_type::And;
+                    auto is_inner = [inner](const ast_ptr& child) { return child->type() == inner; };
+                    auto distributes = [this](normal_form form) {
+                        return (form == normal_form::Conjunctive && _type == node_type::Or)
+                            || (form == normal_form::Disjunctive && _type == node_type::And);
+                    };
 
                     // Single child -> replace by child
                     if (children.size() == 1) {
@@ -473,12 +1319,21 @@ namespace post_query {
                         return true;
                     } else if (std::ranges::any_of(children, [this](const ast_ptr& child) { return child->_type == this->_type; })) {
                         // Apply associative law on children of same type, move children to parent
+                        // Whole chains of same-type descendants are flattened at once, in order
                         std::vector<ast_ptr> new_children;
                         new_children.reserve(children.size());
 
-                        for (ast_ptr& child : children) {
+                        std::vector<std::pair<std::vector<ast_ptr>*, size_t>> pending { { &children, 0 } };
+                        while (!pending.empty()) {
+                            auto& [level, index] = pending.back();
+                            if (index == level->size()) {
+                                pending.pop_back();
+                                continue;
+                            }
+
+                            ast_ptr& child = (*level)[index++];
                             if (child->_type == this->_type) {
-                                std::ranges::move(std::get<std::vector<ast_ptr>>(child->_data), std::back_inserter(new_children));
+                                pending.emplace_back(&std::get<std::vector<ast_ptr>>(child->_data), 0);
                             } else {
                                 new_children.emplace_back(std::move(child));
                             }
@@ -486,34 +1341,70 @@ namespace post_query {
 
                         _data = std::move(new_children);
                         return true;
-                    } else if (_type == node_type::Or && std::ranges::any_of(children, is_and)) {
+                    } else if (auto is_single = [](const ast_ptr& child) {
+                        return (child->_type == node_type::And || child->_type == node_type::Or) && child->child_count() == 1;
+                    }; std::ranges::any_of(children, is_single)) {
+                        // Unwrap single-child children first so they don't take part in a distribution
+                        for (ast_ptr& child : children) {
+                            while (is_single(child)) {
+                                ast_ptr subchild = std::move(std::get<std::vector<ast_ptr>>(child->_data).front());
+                                child = std::move(subchild);
+                            }
+                        }
+
+                        return true;
+                    } else if (distributes(form) && std::ranges::any_of(children, is_inner)) {
                         // XXX: This is probably easier if all `and` and `or` nodes were binary, but that may require iteration
+                        // Described for CNF, DNF is the same with `and` and `or` swapped
                         // * Partition out all `and` nodes
                         // * For every `and` child:
                         // ** Create an `or` node for every subchild
                         // ** Set all non-and children as its children, plus one of the subchildren
-                        auto rest = std::ranges::partition(children, is_and);
+                        auto rest = std::ranges::partition(children, is_inner);
                         std::span<ast_ptr> ands { children.begin(), rest.begin() };
 
+                        // Saturates, anything that large fails to allocate either way
+                        size_t clauses = 1;
+                        for (const ast_ptr& child : ands) {
+                            size_t count = child->child_count();
+                            clauses = (count != 0 && clauses > std::numeric_limits<size_t>::max() / count) ? std::numeric_limits<size_t>::max() : clauses * count;
+                        }
+
                         std::vector<ast_ptr> res;
-                        res.emplace_back(ast::make_or(ast::copy(rest)));
+                        if (clauses >= parallel_distribution_clauses && work_pool::global().threads() > 0) {
+                            // Every clause only depends on its index, so ranges of them are built independently in the same order
+                            res.resize(clauses);
+                            work_pool::global().parallel_for(clauses, parallel_distribution_grain, [&](size_t begin, size_t end) {
+                                for (size_t i = begin; i < end; ++i) {
+                                    res[i] = distributed_clause(rest, ands, i);
+                                }
+                            });
 
-                        for (const ast_ptr& child : ands) {
-                            std::vector<ast_ptr> next;
-                            next.reserve(res.size() * child->child_count());
-
-                            for (const ast_ptr& subchild : child->children()) {
-                                for (const ast_ptr& or_node : res) {
-                                    auto copy = or_node->copy();
-                                    std::get<std::vector<ast_ptr>>(copy->_data).emplace_back(subchild->copy());
-                                    next.emplace_back(std::move(copy));
+                        } else {
+                            res.emplace_back(ast_ptr { new ast { _type, ast::copy(rest) } });
+
+                            for (const ast_ptr& child : ands) {
+                                std::vector<ast_ptr> next;
+                                next.reserve(res.size() * child->child_count());
+
+                                for (const ast_ptr& subchild : child->children()) {
+                                    for (const ast_ptr& or_node : res) {
+                                        auto copy = or_node->copy();
+                                        std::get<std::vector<ast_ptr>>(copy->_data).emplace_back(subchild->copy());
+                                        next.emplace_back(std::move(copy));
+                                    }
                                 }
+
+                                res = std::move(next);
                             }
+                        }
 
-                            res = std::move(next);
+                        if (query_stats& stats = query_stats::global(); stats.enabled()) {
+                            stats.add(counter::Distributions);
+                            stats.add(counter::DistributedClauses, res.size());
                         }
 
-                        _type = node_type::And;
+                        _type = inner;
                         _data = std::move(res);
 
                         return true;
@@ -522,36 +1413,199 @@ namespace post_query {
                 }
             }
 
-            bool changed = false;
-            for (const ast_ptr& child : children()) {
-                changed = child->simplify() || changed;
+            return false;
+        }
+
+        // A single factoring step on the children of this `and` or `or`, returns whether it changed anything
+        bool factor_node() {
+            if (_type != node_type::And && _type != node_type::Or) {
+                return false;
             }
-            return changed;
+
+            node_type inner = (_type == node_type::And) ? node_type::Or : node_type::And;
+            std::vector<ast_ptr>& children = std::get<std::vector<ast_ptr>>(_data);
+
+            // A child that isn't an `inner` is its own only part, so it absorbs every other child containing it
+            auto less = [](const ast* lhs, const ast* rhs) { return *lhs < *rhs; };
+            auto equal = [](const ast& lhs, const ast& rhs) { return (lhs <=> rhs) == 0; };
+            auto parts = [inner](const ast_ptr& child) {
+                std::span<const ast_ptr> res = (child->_type == inner) ? child->children() : std::span<const ast_ptr> { &child, 1 };
+
+                // Optional terms depend on their siblings, moving them to another parent would change what they mean
+                if (std::ranges::any_of(res, [](const ast_ptr& part) { return part->_type == node_type::Opt; })) {
+                    return std::span<const ast_ptr> {};
+                }
+
+                return res;
+            };
+
+            // Number of children each subexpression is a part of
+            std::map<const ast*, size_t, decltype(less)> counts;
+            for (const ast_ptr& child : children) {
+                std::map<const ast*, bool, decltype(less)> seen;
+                for (const ast_ptr& part : parts(child)) {
+                    if (seen.emplace(part.get(), true).second) {
+                        counts[part.get()] += 1;
+                    }
+                }
+            }
+
+            std::vector<std::pair<const ast*, size_t>> candidates;
+            std::ranges::copy_if(counts, std::back_inserter(candidates), [](const auto& entry) { return entry.second > 1; });
+            std::ranges::stable_sort(candidates, std::greater{}, &std::pair<const ast*, size_t>::second);
+
+            auto contains = [&](const ast_ptr& child, const ast& part) {
+                return std::ranges::any_of(parts(child), [&](const ast_ptr& other) { return equal(*other, part); });
+            };
+
+            for (const auto& [candidate, count] : candidates) {
+                // Children containing the candidate and every part all of them share
+                std::vector<const ast_ptr*> group;
+                for (const ast_ptr& child : children) {
+                    if (contains(child, *candidate)) {
+                        group.push_back(&child);
+                    }
+                }
+
+                std::vector<const ast*> common;
+                for (const ast_ptr& part : parts(*group.front())) {
+                    if (std::ranges::none_of(common, [&](const ast* other) { return equal(*other, *part); })
+                        && std::ranges::all_of(group, [&](const ast_ptr* child) { return contains(*child, *part); })) {
+                        common.push_back(part.get());
+                    }
+                }
+
+                // `inner(common..., type(rests...))`, a rest only keeps its own node if more than one part is left
+                // A child without any other parts absorbs all the others, which leaves just `inner(common...)`
+                size_t common_nodes = (common.size() > 1) ? 1 : 0;
+                for (const ast* part : common) {
+                    common_nodes += part->node_count();
+                }
+
+                size_t before = 0;
+                size_t after = common_nodes + (common.size() > 1 ? 0 : 1) + 1;
+                bool absorbed = false;
+                for (const ast_ptr* child : group) {
+                    size_t rest = 0;
+                    for (const ast_ptr& part : parts(*child)) {
+                        if (std::ranges::none_of(common, [&](const ast* other) { return equal(*other, *part); })) {
+                            rest += 1;
+                            after += part->node_count();
+                        }
+                    }
+
+                    before += (*child)->node_count();
+                    after += (rest > 1) ? 1 : 0;
+                    absorbed = absorbed || rest == 0;
+                }
+
+                if (absorbed) {
+                    after = common_nodes;
+                }
+
+                if (after >= before) {
+                    continue;
+                }
+
+                // The common parts are copied first, they point into the children that are about to be taken apart
+                std::vector<ast_ptr> factored;
+                for (const ast* part : common) {
+                    factored.emplace_back(part->copy());
+                }
+
+                std::vector<ast_ptr> rests;
+                std::vector<ast_ptr> others;
+                for (ast_ptr& child : children) {
+                    if (!std::ranges::contains(group, &child)) {
+                        others.emplace_back(std::move(child));
+                        continue;
+                    } else if (absorbed || child->_type != inner) {
+                        continue;
+                    }
+
+                    std::vector<ast_ptr>& rest = std::get<std::vector<ast_ptr>>(child->_data);
+                    std::erase_if(rest, [&](const ast_ptr& part) {
+                        return std::ranges::any_of(factored, [&](const ast_ptr& other) { return equal(*other, *part); });
+                    });
+
+                    if (rest.size() == 1) {
+                        rests.emplace_back(std::move(rest.front()));
+                    } else {
+                        rests.emplace_back(std::move(child));
+                    }
+                }
+
+                if (!absorbed) {
+                    factored.emplace_back(std::make_unique<ast>(_type, std::move(rests)));
+                }
+
+                others.emplace_back(factored.size() == 1 ? std::move(factored.front()) : std::make_unique<ast>(inner, std::move(factored)));
+
+                if (others.size() == 1) {
+                    replace_with(std::move(others.front()));
+                } else {
+                    children = std::move(others);
+                }
+
+                return true;
+            }
+
+            return false;
         }
 
-        void sort() {
-            switch (_type) {
-                case node_type::Opt:
-                case node_type::Not:
-                    // Sort subnodes
-                    std::get<ast_ptr>(_data)->sort();
-                    break;
+        // Merge `and` and `or` nodes into parents of the same type and replace those with a single child by it,
+        // e.g. `(or a (or b c))` left behind by factoring or `(and (and a))` of a query that was never normalized
+        void flatten() {
+            // Optional terms form a single `or` with their siblings, so nodes with any of them have to stay as they are
+            auto is_compound = [](const ast& node) {
+                return (node._type == node_type::And || node._type == node_type::Or)
+                    && std::ranges::none_of(node.children(), [](const ast_ptr& child) { return child->_type == node_type::Opt; });
+            };
+
+            rewrite([&is_compound](ast& node) {
+                auto mergeable = [&](const ast_ptr& child) {
+                    return is_compound(*child) && (child->_type == node._type || child->child_count() == 1);
+                };
+
+                while (node._type == node_type::And || node._type == node_type::Or) {
+                    std::vector<ast_ptr>& children = std::get<std::vector<ast_ptr>>(node._data);
+                    if (children.size() == 1 && is_compound(node)) {
+                        ast_ptr child = std::move(children.front());
+                        node.replace_with(std::move(child));
+                        continue;
+                    }
 
-                case node_type::And:
-                case node_type::Or: {
-                    // First sort subnodes, then sort ourselves
-                    std::vector<ast_ptr>& children = std::get<std::vector<ast_ptr>>(_data);
-                    for (ast_ptr& child : children) {
-                        child->sort();
+                    if (std::ranges::none_of(children, mergeable)) {
+                        break;
                     }
 
-                    std::ranges::sort(children, [](const ast_ptr& lhs, const ast_ptr& rhs) { return *lhs < *rhs; });
+                    std::vector<ast_ptr> res;
+                    std::vector<ast_ptr> pending;
+                    std::ranges::move(children | std::views::reverse, std::back_inserter(pending));
 
-                    break;
+                    while (!pending.empty()) {
+                        ast_ptr child = std::move(pending.back());
+                        pending.pop_back();
+
+                        if (mergeable(child)) {
+                            std::ranges::move(std::get<std::vector<ast_ptr>>(child->_data) | std::views::reverse, std::back_inserter(pending));
+                        } else {
+                            res.emplace_back(std::move(child));
+                        }
+                    }
+
+                    children = std::move(res);
                 }
+            });
+        }
 
-                default:
-                    break;
+        void sort() {
+            // Reverse pre-order visits children before their parents
+            std::vector<ast*> nodes = preorder();
+            for (auto it = nodes.rbegin(); it != nodes.rend(); ++it) {
+                if (std::vector<ast_ptr>* children = std::get_if<std::vector<ast_ptr>>(&(*it)->_data)) {
+                    std::ranges::sort(*children, [](const ast_ptr& lhs, const ast_ptr& rhs) { return *lhs < *rhs; });
+                }
             }
         }
 
@@ -559,12 +1613,19 @@ namespace post_query {
             func(ast);
         }
         void rewrite(Func func) {
-            // First rewrite self
-            func(*this);
-
-            // Then all children, which may have been updated
-            for (const ast_ptr& child : children()) {
-                child->rewrite(func);
+            std::vector<ast*> pending { this };
+            while (!pending.empty()) {
+                ast* node = pending.back();
+                pending.pop_back();
+
+                // First rewrite the node itself
+                func(*node);
+
+                // Then all children, which may have been updated
+                std::span<const ast_ptr> children = node->children();
+                for (auto it = children.rbegin(); it != children.rend(); ++it) {
+                    pending.push_back(it->get());
+                }
             }
         }
 
@@ -592,7 +1653,7 @@ namespace post_query {
             return ast_ptr{ new ast{ node_type::Wildcard, std::move(_name) } };
         }
 
-        static ast_ptr make_metatag(std::string_view name, std::string value, bool quoted) {
+        static ast_ptr make_metatag(std::string_view name, std::string value, bool quoted, bool typed = false) {
             if (!quoted) {
                 // Check if it should be quoted regardless of input
                 for (auto it = value.begin(); it != value.end(); ++it) {
@@ -621,12 +1682,20 @@ namespace post_query {
                 }
             }
 
+            std::optional<typed_value_result> typed_value;
+            if (typed) {
+                if (auto type = metatag_value_type(_name)) {
+                    typed_value = parse_typed_value(*type, value);
+                }
+            }
+
             return ast_ptr{ new ast{
                 node_type::Metatag,
                 metatag_data {
                     .name = std::move(_name),
                     .value = std::move(value),
-                    .quoted = quoted
+                    .quoted = quoted,
+                    .typed = std::move(typed_value),
                 }
             }};
         }
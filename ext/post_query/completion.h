@@ -0,0 +1,153 @@
+#ifndef COMPLETION_H
+#define COMPLETION_H
+
+// Finds the token under the cursor for search box autocomplete
+// The tokens of the previous query are kept, so while typing only the changed part up to the cursor is lexed again
+
+#include "lexer.h"
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <optional>
+#include <algorithm>
+
+namespace post_query {
+    struct cursor_token {
+        // Text views are valid until the next lookup
+        token tok;
+
+        // Parens that are open in front of the token
+        ssize_t depth;
+
+        // `not` or `opt` directly in front of the token
+        std::optional<token_kind> prefix;
+
+        // Operand of an `or`, otherwise it's part of an implicit `and`
+        bool in_or;
+    };
+
+    class completion_lexer {
+        private:
+        struct entry {
+            token tok;
+            ssize_t depth;
+        };
+
+        std::optional<std::vector<std::string>> _metatags;
+        std::string _query;
+        std::vector<entry> _tokens;
+        size_t _reused = 0;
+
+        static ssize_t depth_after(const entry& e) {
+            switch (e.tok.kind) {
+                case token_kind::LParen: return e.depth + 1;
+                case token_kind::RParen: return std::max<ssize_t>(e.depth - 1, 0);
+                default: return e.depth;
+            }
+        }
+
+        static bool is_word(token_kind kind) {
+            return kind == token_kind::Tag || kind == token_kind::Wildcard || kind == token_kind::Metatag || kind == token_kind::Invalid;
+        }
+
+        // Tokens can only change if the word they're part of changed, so everything up to the last unchanged space is kept
+        size_t stable_prefix(std::string_view query) const {
+            size_t common = std::ranges::mismatch(_query, query).in1 - _query.begin();
+            for (size_t i = common; i-- > 0;) {
+                if (int size = encoding::unicode_space(query.begin() + i); size > 0 && i + size <= common) {
+                    return i;
+                }
+            }
+
+            return 0;
+        }
+
+        std::optional<std::span<const std::string>> metatags() const {
+            if (!_metatags) {
+                return std::nullopt;
+            }
+
+            return *_metatags;
+        }
+
+        public:
+        explicit completion_lexer(std::optional<std::vector<std::string>> metatags = std::nullopt)
+            : _metatags { std::move(metatags) } {
+
+        }
+
+        // Tokens of the last lookup that were kept from the one before
+        size_t reused() const {
+            return _reused;
+        }
+
+        // Token under the cursor, a word wins over an operator or paren it touches
+        // Byte offsets past the end are clamped
+        std::optional<cursor_token> token_at(std::string_view query, size_t offset) {
+            offset = std::min(offset, query.size());
+
+            if (query != _query) {
+                size_t stable = stable_prefix(query);
+                while (!_tokens.empty() && (_tokens.back().tok.kind == token_kind::Eof || _tokens.back().tok.end > stable)) {
+                    _tokens.pop_back();
+                }
+
+                _query.assign(query);
+
+                // Kept tags still point into the previous query
+                for (entry& e : _tokens) {
+                    if (e.tok.kind == token_kind::Tag || e.tok.kind == token_kind::Wildcard) {
+                        e.tok.text = std::string_view { _query }.substr(e.tok.begin, e.tok.end - e.tok.begin);
+                    }
+                }
+            }
+
+            _reused = _tokens.size();
+
+            // Lex up to the first token behind the cursor, which tells if the token is followed by an `or`
+            lexer lex { _query, metatags() };
+            ssize_t depth = _tokens.empty() ? 0 : depth_after(_tokens.back());
+            lex.seek(_tokens.empty() ? 0 : _tokens.back().tok.end);
+
+            while (_tokens.empty() || (_tokens.back().tok.kind != token_kind::Eof && _tokens.back().tok.begin <= offset)) {
+                _tokens.push_back({ .tok = lex.next(depth), .depth = depth });
+                depth = depth_after(_tokens.back());
+            }
+
+            // Last token that starts at or before the cursor
+            size_t index = _tokens.size();
+            while (index > 0 && (_tokens[index - 1].tok.kind == token_kind::Eof || _tokens[index - 1].tok.begin > offset)) {
+                index -= 1;
+            }
+
+            if (index == 0 || offset > _tokens[index - 1].tok.end) {
+                return std::nullopt;
+            }
+
+            index -= 1;
+            if (!is_word(_tokens[index].tok.kind) && index > 0 && _tokens[index - 1].tok.end == offset && is_word(_tokens[index - 1].tok.kind)) {
+                index -= 1;
+            }
+
+            const entry& e = _tokens[index];
+            cursor_token res { .tok = e.tok, .depth = e.depth, .prefix = std::nullopt, .in_or = false };
+
+            size_t operand = index;
+            if (index > 0) {
+                const token& before = _tokens[index - 1].tok;
+                if ((before.kind == token_kind::Not || before.kind == token_kind::Opt) && before.end == e.tok.begin) {
+                    res.prefix = before.kind;
+                    operand -= 1;
+                }
+            }
+
+            res.in_or = (operand > 0 && _tokens[operand - 1].tok.kind == token_kind::Or)
+                || (index + 1 < _tokens.size() && _tokens[index + 1].tok.kind == token_kind::Or);
+
+            return res;
+        }
+    };
+}
+
+#endif /* COMPLETION_H */
@@ -0,0 +1,133 @@
+#ifndef CONTAINMENT_H
+#define CONTAINMENT_H
+
+// Sound but incomplete implication checks between queries in CNF
+// `true` guarantees that every post matching one query matches the other, `false` only means it couldn't be shown
+
+#include "ast.h"
+
+#include <vector>
+#include <span>
+#include <optional>
+#include <algorithm>
+#include <cmath>
+
+namespace post_query {
+    class containment {
+        private:
+        // A clause is a disjunction of literals, an empty clause never matches
+        using clause = std::span<const ast_ptr>;
+
+        static std::vector<clause> clauses(const ast_ptr& cnf) {
+            switch (cnf->type()) {
+                case node_type::All:
+                    return {};
+
+                case node_type::None:
+                    return { clause {} };
+
+                case node_type::And: {
+                    std::vector<clause> res;
+                    res.reserve(cnf->child_count());
+
+                    for (const ast_ptr& child : cnf->children()) {
+                        res.emplace_back(child->type() == node_type::Or ? child->children() : clause { &child, 1 });
+                    }
+
+                    return res;
+                }
+
+                case node_type::Or:
+                    return { cnf->children() };
+
+                default:
+                    return { clause { &cnf, 1 } };
+            }
+        }
+
+        // Every range of a typed metatag, comma-separated values are the union of their ranges
+        static std::optional<std::vector<value_range>> ranges(const ast& node) {
+            if (node.type() != node_type::Metatag || !is_range_metatag(node.metatag().name)) {
+                return std::nullopt;
+            }
+
+            const metatag_data& data = node.metatag();
+            typed_value_result typed = data.typed ? *data.typed : parse_typed_value(*metatag_value_type(data.name), data.value);
+            if (!typed || typed->ranges.empty()) {
+                return std::nullopt;
+            }
+
+            return std::move(typed->ranges);
+        }
+
+        // Whether every range of `inner` lies within a single range of `outer`
+        static bool covers(const ast& outer, const ast& inner) {
+            if (outer.metatag().name != inner.metatag().name) {
+                return false;
+            }
+
+            auto outer_ranges = ranges(outer);
+            auto inner_ranges = ranges(inner);
+            if (!outer_ranges || !inner_ranges) {
+                return false;
+            }
+
+            // NaN bounds make every comparison false and empty ranges compare oddly, neither is relied on
+            auto ordered = [](const value_range& range) {
+                return !range.empty() && !(range.min && std::isnan(*range.min)) && !(range.max && std::isnan(*range.max));
+            };
+
+            if (!std::ranges::all_of(*outer_ranges, ordered) || !std::ranges::all_of(*inner_ranges, ordered)) {
+                return false;
+            }
+
+            return std::ranges::all_of(*inner_ranges, [&](const value_range& range) {
+                return std::ranges::any_of(*outer_ranges, [&](const value_range& other) { return other.contains(range); });
+            });
+        }
+
+        // Whether every post matching literal `lhs` also matches literal `rhs`
+        static bool implies(const ast& lhs, const ast& rhs) {
+            if (lhs.type() == node_type::None || rhs.type() == node_type::All || (lhs <=> rhs) == 0) {
+                return true;
+            }
+
+            if (lhs.type() == node_type::Metatag && rhs.type() == node_type::Metatag) {
+                return covers(rhs, lhs);
+            }
+
+            // Contrapositive: -a implies -b if b implies a
+            if (lhs.type() == node_type::Not && rhs.type() == node_type::Not) {
+                const ast& lhs_child = *lhs.children().front();
+                const ast& rhs_child = *rhs.children().front();
+
+                return lhs_child.type() == node_type::Metatag && rhs_child.type() == node_type::Metatag && covers(lhs_child, rhs_child);
+            }
+
+            return false;
+        }
+
+        static bool implies(clause lhs, clause rhs) {
+            return std::ranges::all_of(lhs, [rhs](const ast_ptr& literal) {
+                return std::ranges::any_of(rhs, [&literal](const ast_ptr& other) { return implies(*literal, *other); });
+            });
+        }
+
+        public:
+        // Both arguments must be in CNF, every clause of `rhs` has to follow from a single clause of `lhs`
+        static bool subsumed_by(const ast_ptr& lhs, const ast_ptr& rhs) {
+            std::vector<clause> lhs_clauses = clauses(lhs);
+            std::vector<clause> rhs_clauses = clauses(rhs);
+
+            return std::ranges::all_of(rhs_clauses, [&lhs_clauses](clause rhs_clause) {
+                return std::ranges::any_of(lhs_clauses, [rhs_clause](clause lhs_clause) { return implies(lhs_clause, rhs_clause); });
+            });
+        }
+
+        static bool equivalent(const ast_ptr& lhs, const ast_ptr& rhs) {
+            return subsumed_by(lhs, rhs) && subsumed_by(rhs, lhs);
+        }
+    };
+}
+
+#endif /* CONTAINMENT_H */
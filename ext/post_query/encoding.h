@@ -1,25 +1,23 @@
 #ifndef ENCODING_H
 #define ENCODING_H
 
-// Some utilities to deal with Ruby strings and encodings
-
-#include <ruby.h>
+// Self-contained conversions between the Unicode encodings, independent of the C locale
+// Narrow strings are always treated as UTF-8
 
 #include <string>
 #include <string_view>
+#include <array>
 #include <algorithm>
 #include <iostream>
 #include <format>
 #include <iterator>
+#include <expected>
+#include <cstring>
+#include <cstdint>
+#include <bit>
 
-#include <cuchar>
-
-#ifndef __STDC_UTF_16__
-#   error "__STDC_UTF_16__ not defined, can't convert UTF-16"
-#endif
-
-#ifndef __STDC_UTF_32__
-#   error "__STDC_UTF_32__ not defined, can't convert UTF-32"
+#if defined(__SSE2__)
+#include <emmintrin.h>
 #endif
 
 enum class enc {
@@ -31,37 +29,10 @@ enum class enc {
 
 template <enc type> struct enc_char { };
 
-template<> struct enc_char<enc::narrow> {
-    using type = char;
-
-    static constexpr std::size_t(*from_func)(char*, char, std::mbstate_t*)
-        = [](char* s, char c8, std::mbstate_t* ps) -> std::size_t {
-            return std::c8rtomb(s, char8_t(c8), ps);
-        };
-
-    static constexpr std::size_t(*to_func)(char*, const char*, std::size_t, std::mbstate_t*)
-        = [](char* pc8, const char* s, std::size_t n, std::mbstate_t* ps) -> std::size_t {
-            return std::mbrtoc8(static_cast<char8_t*>(static_cast<void*>(pc8)), s, n, ps);
-        };
-};
-
-template<> struct enc_char<enc::utf8> {
-    using type = char8_t;
-    static constexpr std::size_t(*from_func)(char*, char8_t, std::mbstate_t*) = std::c8rtomb;
-    static constexpr std::size_t(*to_func)(char8_t*, const char*, std::size_t, std::mbstate_t*) = std::mbrtoc8;
-};
-
-template<> struct enc_char<enc::utf16> {
-    using type = char16_t;
-    static constexpr std::size_t(*from_func)(char*, char16_t, std::mbstate_t*) = std::c16rtomb;
-    static constexpr std::size_t(*to_func)(char16_t*, const char*, std::size_t, std::mbstate_t*) = std::mbrtoc16;
-};
-
-template<> struct enc_char<enc::utf32> {
-    using type = char32_t;
-    static constexpr std::size_t(*from_func)(char*, char32_t, std::mbstate_t*) = std::c32rtomb;
-    static constexpr std::size_t(*to_func)(char32_t*, const char*, std::size_t, std::mbstate_t*) = std::mbrtoc32;
-};
+template<> struct enc_char<enc::narrow> { using type = char; };
+template<> struct enc_char<enc::utf8> { using type = char8_t; };
+template<> struct enc_char<enc::utf16> { using type = char16_t; };
+template<> struct enc_char<enc::utf32> { using type = char32_t; };
 
 template <typename CharT> struct char_enc { };
 
@@ -77,62 +48,304 @@ template <enc type>
 using enc_char_t = typename enc_char<type>::type;
 
 namespace encoding {
-    template <enc from, enc to>
-    std::basic_string<enc_char_t<to>> convert(std::basic_string_view<enc_char_t<from>> sv) {
-        if constexpr (from == to) {
-            return std::basic_string<enc_char_t<to>>{ sv };
-        } else if constexpr ((from == enc::narrow || from == enc::utf8) && (to == enc::narrow || to == enc::utf8)) {
-            /* Direct conversion */
-            return std::basic_string<enc_char_t<to>>(reinterpret_cast<const enc_char_t<to>*>(sv.data()), sv.size());
-        } else {
-            if (sv.size() == 0) {
-                return {};
+    enum class error {
+        // Malformed UTF-8: a bad lead or continuation byte, an overlong form or an encoded surrogate
+        InvalidSequence,
+
+        // The input ends in the middle of a UTF-8 sequence
+        Truncated,
+
+        // A UTF-16 surrogate without its other half
+        UnpairedSurrogate,
+
+        // A UTF-32 value that is a surrogate or above U+10FFFF
+        InvalidCodePoint,
+    };
+
+    static constexpr std::array<std::string_view, 4> error_messages {
+        "invalid UTF-8 sequence",
+        "truncated UTF-8 sequence",
+        "unpaired UTF-16 surrogate",
+        "invalid code point",
+    };
+
+    static constexpr std::string_view error_message(error err) {
+        return error_messages[static_cast<int>(err)];
+    }
+
+    template <enc to>
+    using result = std::expected<std::basic_string<enc_char_t<to>>, error>;
+
+    namespace detail {
+        static constexpr char32_t replacement_character = 0xFFFD;
+
+        // Number of leading code units below 0x80
+        template <typename CharT>
+        size_t ascii_prefix(const CharT* data, size_t size) {
+            size_t i = 0;
+
+#if defined(__SSE2__)
+            constexpr size_t lanes = 16 / sizeof(CharT);
+            for (; i + lanes <= size; i += lanes) {
+                __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+
+                int mask;
+                if constexpr (sizeof(CharT) == 1) {
+                    // Only the high bit of every byte matters
+                    mask = _mm_movemask_epi8(block);
+                } else if constexpr (sizeof(CharT) == 2) {
+                    mask = ~_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(block, _mm_set1_epi16(int16_t(0xFF80))), _mm_setzero_si128())) & 0xFFFF;
+                } else {
+                    mask = ~_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(block, _mm_set1_epi32(int32_t(0xFFFFFF80))), _mm_setzero_si128())) & 0xFFFF;
+                }
+
+                if (mask != 0) {
+                    return i + std::countr_zero(unsigned(mask)) / sizeof(CharT);
+                }
+            }
+#endif
+
+            for (; i < size; ++i) {
+                if (std::make_unsigned_t<CharT>(data[i]) >= 0x80) {
+                    break;
+                }
+            }
+
+            return i;
+        }
+
+        // Copy code units that are known to be ASCII into a possibly wider or narrower encoding
+        template <typename From, typename To>
+        void copy_ascii(const From* src, size_t size, To* dst) {
+            if constexpr (sizeof(From) == sizeof(To)) {
+                std::memcpy(dst, src, size * sizeof(From));
+                return;
+            } else {
+                size_t i = 0;
+
+#if defined(__SSE2__)
+                if constexpr (sizeof(From) == 1 && sizeof(To) == 2) {
+                    for (; i + 16 <= size; i += 16) {
+                        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+                        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_unpacklo_epi8(block, _mm_setzero_si128()));
+                        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i + 8), _mm_unpackhi_epi8(block, _mm_setzero_si128()));
+                    }
+                } else if constexpr (sizeof(From) == 2 && sizeof(To) == 1) {
+                    for (; i + 16 <= size; i += 16) {
+                        __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+                        __m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i + 8));
+                        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_packus_epi16(lo, hi));
+                    }
+                }
+#endif
+
+                // Anything left, and the remaining width combinations, which compilers vectorize on their own
+                for (; i < size; ++i) {
+                    dst[i] = To(src[i]);
+                }
             }
+        }
+
+        // Decode the code point starting at data[i] and advance past it
+        // On error i is advanced by at least one code unit, so decoding can resume
+        template <typename CharT>
+        std::expected<char32_t, error> decode(const CharT* data, size_t size, size_t& i) {
+            if constexpr (sizeof(CharT) == 1) {
+                uint8_t lead = uint8_t(data[i++]);
+                if (lead < 0x80) {
+                    return lead;
+                }
+
+                // Number of continuation bytes and the allowed range of the first one
+                size_t count;
+                uint8_t lower = 0x80, upper = 0xBF;
+                char32_t cp;
+
+                if (lead >= 0xC2 && lead <= 0xDF) {
+                    count = 1;
+                    cp = lead & 0x1F;
+                } else if (lead >= 0xE0 && lead <= 0xEF) {
+                    count = 2;
+                    cp = lead & 0x0F;
+                    lower = (lead == 0xE0) ? 0xA0 : 0x80;
+                    upper = (lead == 0xED) ? 0x9F : 0xBF;
+                } else if (lead >= 0xF0 && lead <= 0xF4) {
+                    count = 3;
+                    cp = lead & 0x07;
+                    lower = (lead == 0xF0) ? 0x90 : 0x80;
+                    upper = (lead == 0xF4) ? 0x8F : 0xBF;
+                } else {
+                    return std::unexpected(error::InvalidSequence);
+                }
 
-            std::mbstate_t from_state{};
+                for (size_t n = 0; n < count; ++n) {
+                    if (i == size) {
+                        return std::unexpected(error::Truncated);
+                    }
 
-            // Actually MB_CUR_MAX
-            char from_buf[8];
-            std::string buf;
-            for (auto c : sv) {
-                size_t bytes = enc_char<from>::from_func(from_buf, c, &from_state);
+                    uint8_t next = uint8_t(data[i]);
+                    if (next < lower || next > upper) {
+                        return std::unexpected(error::InvalidSequence);
+                    }
 
-                if (bytes == size_t(-1)) {
-                    rb_raise(rb_eEncodingError, "failed to convert to multibyte");
+                    cp = (cp << 6) | (next & 0x3F);
+                    lower = 0x80;
+                    upper = 0xBF;
+                    ++i;
                 }
 
-                for (size_t i = 0; i < bytes; ++i) {
-                    buf.push_back(from_buf[i]);
+                return cp;
+            } else if constexpr (sizeof(CharT) == 2) {
+                char16_t unit = data[i++];
+                if (unit < 0xD800 || unit > 0xDFFF) {
+                    return unit;
+                } else if (unit > 0xDBFF || i == size || data[i] < 0xDC00 || data[i] > 0xDFFF) {
+                    return std::unexpected(error::UnpairedSurrogate);
                 }
+
+                char16_t low = data[i++];
+                return 0x10000 + ((char32_t(unit) - 0xD800) << 10) + (char32_t(low) - 0xDC00);
+            } else {
+                char32_t cp = data[i++];
+                if (cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF)) {
+                    return std::unexpected(error::InvalidCodePoint);
+                }
+
+                return cp;
             }
+        }
 
-            std::basic_string<enc_char_t<to>> res;
-            std::mbstate_t to_state{};
-            enc_char_t<to> next_char;
+        template <typename CharT>
+        constexpr size_t encoded_size(char32_t cp) {
+            if constexpr (sizeof(CharT) == 1) {
+                return (cp < 0x80) ? 1 : (cp < 0x800) ? 2 : (cp < 0x10000) ? 3 : 4;
+            } else if constexpr (sizeof(CharT) == 2) {
+                return (cp < 0x10000) ? 1 : 2;
+            } else {
+                return 1;
+            }
+        }
+
+        template <typename CharT>
+        void encode(char32_t cp, CharT*& out) {
+            if constexpr (sizeof(CharT) == 1) {
+                if (cp < 0x80) {
+                    *out++ = CharT(cp);
+                } else if (cp < 0x800) {
+                    *out++ = CharT(0xC0 | (cp >> 6));
+                    *out++ = CharT(0x80 | (cp & 0x3F));
+                } else if (cp < 0x10000) {
+                    *out++ = CharT(0xE0 | (cp >> 12));
+                    *out++ = CharT(0x80 | ((cp >> 6) & 0x3F));
+                    *out++ = CharT(0x80 | (cp & 0x3F));
+                } else {
+                    *out++ = CharT(0xF0 | (cp >> 18));
+                    *out++ = CharT(0x80 | ((cp >> 12) & 0x3F));
+                    *out++ = CharT(0x80 | ((cp >> 6) & 0x3F));
+                    *out++ = CharT(0x80 | (cp & 0x3F));
+                }
+            } else if constexpr (sizeof(CharT) == 2) {
+                if (cp < 0x10000) {
+                    *out++ = CharT(cp);
+                } else {
+                    *out++ = CharT(0xD800 + ((cp - 0x10000) >> 10));
+                    *out++ = CharT(0xDC00 + ((cp - 0x10000) & 0x3FF));
+                }
+            } else {
+                *out++ = CharT(cp);
+            }
+        }
+
+        // Invalid input either fails the conversion or is replaced by U+FFFD
+        template <enc from, enc to, bool replace>
+        result<to> transcode(std::basic_string_view<enc_char_t<from>> sv) {
+            using from_t = enc_char_t<from>;
+            using to_t = enc_char_t<to>;
+
+            const from_t* data = sv.data();
+            size_t size = sv.size();
+
+            size_t ascii = ascii_prefix(data, size);
+            if (ascii == size) {
+                std::basic_string<to_t> res;
+                res.resize_and_overwrite(size, [&](to_t* out, size_t) {
+                    copy_ascii(data, size, out);
+                    return size;
+                });
+                return res;
+            }
 
-            auto cur = buf.data();
-            auto end = cur + buf.size() + 1;
-            for (;;) {
-                size_t bytes = enc_char<to>::to_func(&next_char, cur, end - cur, &to_state);
+            // First pass validates and sizes the output, so the second one never reallocates
+            size_t out_size = ascii;
+            for (size_t i = ascii; i < size;) {
+                size_t run = ascii_prefix(data + i, size - i);
+                out_size += run;
+                i += run;
 
-                if (bytes == 0) {
+                if (i == size) {
                     break;
-                } else if (bytes == size_t(-1)) {
-                    rb_raise(rb_eEncodingError, "failed to convert from multibyte");
-                } else if (bytes == size_t(-2)) {
-                    rb_raise(rb_eEncodingError, "unfinished multi-byte character");
-                } else if (bytes == size_t(-3)) {
-                    res.push_back(next_char);
-                } else  {
-                    cur += bytes;
-                    res.push_back(next_char);
-                } 
+                }
+
+                auto cp = decode(data, size, i);
+                if (!cp && !replace) {
+                    return std::unexpected(cp.error());
+                }
+
+                out_size += encoded_size<to_t>(cp.value_or(replacement_character));
             }
 
+            std::basic_string<to_t> res;
+            res.resize_and_overwrite(out_size, [&](to_t* out, size_t) {
+                for (size_t i = 0; i < size;) {
+                    size_t run = ascii_prefix(data + i, size - i);
+                    copy_ascii(data + i, run, out);
+                    out += run;
+                    i += run;
+
+                    if (i < size) {
+                        encode(decode(data, size, i).value_or(replacement_character), out);
+                    }
+                }
+
+                return out_size;
+            });
+
             return res;
         }
     }
 
+    // Validating conversion, errors are returned rather than raised
+    template <enc from, enc to>
+    result<to> transcode(std::basic_string_view<enc_char_t<from>> sv) {
+        return detail::transcode<from, to, false>(sv);
+    }
+
+    // Checks that a narrow string is valid UTF-8 without converting it
+    inline std::expected<void, error> validate(std::string_view sv) {
+        for (size_t i = detail::ascii_prefix(sv.data(), sv.size()); i < sv.size();) {
+            if (auto cp = detail::decode(sv.data(), sv.size(), i); !cp) {
+                return std::unexpected(cp.error());
+            }
+
+            i += detail::ascii_prefix(sv.data() + i, sv.size() - i);
+        }
+
+        return {};
+    }
+
+    // Lossy conversion for display, invalid input is replaced by U+FFFD
+    template <enc from, enc to>
+    std::basic_string<enc_char_t<to>> convert(std::basic_string_view<enc_char_t<from>> sv) {
+        if constexpr (from == to) {
+            return std::basic_string<enc_char_t<to>>{ sv };
+        } else if constexpr (sizeof(enc_char_t<from>) == 1 && sizeof(enc_char_t<to>) == 1) {
+            /* Direct conversion */
+            return std::basic_string<enc_char_t<to>>(reinterpret_cast<const enc_char_t<to>*>(sv.data()), sv.size());
+        } else {
+            return *detail::transcode<from, to, true>(sv);
+        }
+    }
+
     template <enc to> std::basic_string<enc_char_t<to>> convert(std::string_view sv) { return convert<enc::narrow, to>(sv); }
     template <enc to> std::basic_string<enc_char_t<to>> convert(std::u8string_view sv) { return convert<enc::utf8, to>(sv); }
     template <enc to> std::basic_string<enc_char_t<to>> convert(std::u16string_view sv) { return convert<enc::utf16, to>(sv); }
@@ -186,27 +399,27 @@ struct std::formatter<std::u32string> : std::formatter<std::string> {
     }
 };
 
-std::ostream& operator<<(std::ostream& os, std::u8string_view sv) {
+inline std::ostream& operator<<(std::ostream& os, std::u8string_view sv) {
     return os << encoding::convert<enc::narrow>(sv);
 }
 
-std::ostream& operator<<(std::ostream& os, char8_t ch) {
+inline std::ostream& operator<<(std::ostream& os, char8_t ch) {
     return os << std::u8string(1, ch);
 }
 
-std::ostream& operator<<(std::ostream& os, std::u16string_view sv) {
+inline std::ostream& operator<<(std::ostream& os, std::u16string_view sv) {
     return os << encoding::convert<enc::narrow>(sv);
 }
 
-std::ostream& operator<<(std::ostream& os, char16_t ch) {
+inline std::ostream& operator<<(std::ostream& os, char16_t ch) {
     return os << std::u16string(1, ch);
 }
 
-std::ostream& operator<<(std::ostream& os, std::u32string_view sv) {
+inline std::ostream& operator<<(std::ostream& os, std::u32string_view sv) {
     return os << encoding::convert<enc::narrow>(sv);
 }
 
-std::ostream& operator<<(std::ostream& os, char32_t ch) {
+inline std::ostream& operator<<(std::ostream& os, char32_t ch) {
     return os << std::u32string(1, ch);
 }
 
@@ -4,4 +4,10 @@ require "mkmf"
 
 $CXXFLAGS += "-Wall -std=c++23 -ggdb3"
 
+# Ruby 3.0+, lets the extension be used from non-main Ractors
+have_func("rb_ext_ractor_safe", "ruby.h")
+
+# libpost_query.cpp is the C interface, built separately through `rake lib`
+$srcs = ["post_query.cpp"]
+
 create_makefile "post_query/post_query"
@@ -0,0 +1,102 @@
+#ifndef FACTS_H
+#define FACTS_H
+
+// Terms whose value is known before a search runs, e.g. the forced rating of safe mode
+
+#include "values.h"
+#include "metatags.h"
+
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <variant>
+#include <optional>
+#include <functional>
+#include <algorithm>
+#include <ranges>
+#include <cctype>
+
+namespace post_query {
+    class fact_set {
+        private:
+        struct string_hash {
+            using is_transparent = void;
+
+            size_t operator()(std::string_view sv) const {
+                return std::hash<std::string_view>{}(sv);
+            }
+        };
+
+        template <typename T>
+        using string_map = std::unordered_map<std::string, T, string_hash, std::equal_to<>>;
+
+        // Truth of every metatag with a name, the attribute's only value, or a number for typed metatags
+        using metatag_fact = std::variant<bool, std::string, double>;
+
+        string_map<bool> _tags;
+        string_map<metatag_fact> _metatags;
+
+        static bool equal_ignoring_case(std::string_view lhs, std::string_view rhs) {
+            return std::ranges::equal(lhs, rhs, [](unsigned char c1, unsigned char c2) { return std::tolower(c1) == std::tolower(c2); });
+        }
+
+        public:
+        // Tags are stored lowercase, see ast::make_tag
+        void set_tag(std::string name, bool truth) {
+            _tags.insert_or_assign(std::move(name), truth);
+        }
+
+        // Metatag names have to be canonical, see normalize_metatag
+        void set_metatag(std::string name, metatag_fact fact) {
+            _metatags.insert_or_assign(std::move(name), std::move(fact));
+        }
+
+        bool empty() const {
+            return _tags.empty() && _metatags.empty();
+        }
+
+        const string_map<bool>& tags() const {
+            return _tags;
+        }
+
+        std::optional<bool> tag(std::string_view name) const {
+            if (auto it = _tags.find(name); it != _tags.end()) {
+                return it->second;
+            }
+
+            return std::nullopt;
+        }
+
+        // A metatag is true if any of its comma-separated values matches the known value
+        std::optional<bool> metatag(std::string_view name, std::string_view value) const {
+            auto it = _metatags.find(name);
+            if (it == _metatags.end()) {
+                return std::nullopt;
+            }
+
+            if (const bool* truth = std::get_if<bool>(&it->second)) {
+                return *truth;
+            } else if (const std::string* known = std::get_if<std::string>(&it->second)) {
+                return std::ranges::any_of(value | std::views::split(','), [known](auto item) {
+                    return equal_ignoring_case(std::string_view { item.begin(), item.end() }, *known);
+                });
+            }
+
+            // Numbers can only be checked against values that parse
+            auto type = metatag_value_type(name);
+            if (!type) {
+                return std::nullopt;
+            }
+
+            typed_value_result typed = parse_typed_value(*type, value);
+            if (!typed) {
+                return std::nullopt;
+            }
+
+            value_range point { .min = std::get<double>(it->second), .max = std::get<double>(it->second) };
+            return std::ranges::any_of(typed->ranges, [&point](const value_range& range) { return range.contains(point); });
+        }
+    };
+}
+
+#endif /* FACTS_H */
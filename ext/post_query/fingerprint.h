@@ -0,0 +1,156 @@
+#ifndef FINGERPRINT_H
+#define FINGERPRINT_H
+
+// Stable 128-bit hashing for persistent cache keys
+// The output must never depend on the host, so all input is read as little-endian bytes
+
+#include <array>
+#include <string>
+#include <string_view>
+#include <format>
+#include <cstdint>
+#include <cstring>
+#include <bit>
+#include <algorithm>
+
+namespace post_query {
+    // Bump whenever the hash or the node encoding changes, old cache keys then simply miss
+    static constexpr uint32_t fingerprint_version = 1;
+
+    struct query_fingerprint {
+        uint64_t high;
+        uint64_t low;
+
+        auto operator<=>(const query_fingerprint&) const = default;
+
+        // Versioned hex form, e.g. `v1:0123456789abcdef0123456789abcdef`
+        std::string to_string() const {
+            return std::format("v{}:{:016x}{:016x}", fingerprint_version, high, low);
+        }
+    };
+
+    // Incremental MurmurHash3 x64_128, gives the same result as hashing all input at once
+    class fingerprint_hasher {
+        private:
+        static constexpr uint64_t c1 = 0x87c37b91114253d5;
+        static constexpr uint64_t c2 = 0x4cf5ad432745937f;
+
+        uint64_t _h1;
+        uint64_t _h2;
+        uint64_t _length = 0;
+
+        std::array<uint8_t, 16> _buffer {};
+        size_t _buffered = 0;
+
+        static uint64_t load(const uint8_t* bytes, size_t size) {
+            uint64_t res = 0;
+            for (size_t i = 0; i < size; ++i) {
+                res |= uint64_t(bytes[i]) << (8 * i);
+            }
+
+            return res;
+        }
+
+        static uint64_t mix_k1(uint64_t k1) {
+            return std::rotl(k1 * c1, 31) * c2;
+        }
+
+        static uint64_t mix_k2(uint64_t k2) {
+            return std::rotl(k2 * c2, 33) * c1;
+        }
+
+        static uint64_t fmix(uint64_t k) {
+            k ^= k >> 33;
+            k *= 0xff51afd7ed558ccd;
+            k ^= k >> 33;
+            k *= 0xc4ceb9fe1a85ec53;
+            k ^= k >> 33;
+            return k;
+        }
+
+        void block(const uint8_t* bytes) {
+            _h1 ^= mix_k1(load(bytes, 8));
+            _h1 = std::rotl(_h1, 27) + _h2;
+            _h1 = _h1 * 5 + 0x52dce729;
+
+            _h2 ^= mix_k2(load(bytes + 8, 8));
+            _h2 = std::rotl(_h2, 31) + _h1;
+            _h2 = _h2 * 5 + 0x38495ab5;
+        }
+
+        public:
+        explicit fingerprint_hasher(uint32_t seed = 0) : _h1 { seed }, _h2 { seed } { }
+
+        void update(std::string_view bytes) {
+            auto data = reinterpret_cast<const uint8_t*>(bytes.data());
+            size_t size = bytes.size();
+            _length += size;
+
+            if (_buffered > 0) {
+                size_t n = std::min(size, _buffer.size() - _buffered);
+                std::memcpy(_buffer.data() + _buffered, data, n);
+                _buffered += n;
+                data += n;
+                size -= n;
+
+                if (_buffered < _buffer.size()) {
+                    return;
+                }
+
+                block(_buffer.data());
+                _buffered = 0;
+            }
+
+            for (; size >= _buffer.size(); data += _buffer.size(), size -= _buffer.size()) {
+                block(data);
+            }
+
+            std::memcpy(_buffer.data(), data, size);
+            _buffered = size;
+        }
+
+        void update(uint8_t value) {
+            update(std::string_view { reinterpret_cast<const char*>(&value), 1 });
+        }
+
+        void update(uint32_t value) {
+            std::array<char, 4> bytes;
+            for (size_t i = 0; i < bytes.size(); ++i) {
+                bytes[i] = char(value >> (8 * i));
+            }
+
+            update(std::string_view { bytes.data(), bytes.size() });
+        }
+
+        // Strings are length-prefixed so that neighbouring ones can't run into each other
+        void update_string(std::string_view str) {
+            update(uint32_t(str.size()));
+            update(str);
+        }
+
+        query_fingerprint finish() const {
+            uint64_t h1 = _h1;
+            uint64_t h2 = _h2;
+
+            if (_buffered > 8) {
+                h2 ^= mix_k2(load(_buffer.data() + 8, _buffered - 8));
+            }
+            if (_buffered > 0) {
+                h1 ^= mix_k1(load(_buffer.data(), std::min<size_t>(_buffered, 8)));
+            }
+
+            h1 ^= _length;
+            h2 ^= _length;
+            h1 += h2;
+            h2 += h1;
+            h1 = fmix(h1);
+            h2 = fmix(h2);
+            h1 += h2;
+            h2 += h1;
+
+            return { .high = h2, .low = h1 };
+        }
+    };
+}
+
+#endif /* FINGERPRINT_H */
@@ -0,0 +1,86 @@
+#ifndef JSON_H
+#define JSON_H
+
+// Minimal JSON string writing into preallocated buffers
+// Sizes are computed exactly up front, so a whole document can be written without ever growing its buffer
+// Input is assumed to be valid UTF-8 and is copied as is, only quotes, backslashes and control characters are escaped
+
+#include <string_view>
+#include <array>
+#include <cstring>
+#include <cstdint>
+
+namespace post_query::json {
+    // Escape sequence length of every byte, 1 for those copied unchanged
+    static constexpr std::array<uint8_t, 256> escape_lengths = [] {
+        std::array<uint8_t, 256> res {};
+        res.fill(1);
+
+        for (size_t ch = 0; ch < 0x20; ++ch) {
+            res[ch] = 6;
+        }
+
+        for (char ch : { '\b', '\f', '\n', '\r', '\t', '"', '\\' }) {
+            res[static_cast<uint8_t>(ch)] = 2;
+        }
+
+        return res;
+    }();
+
+    inline char* write_raw(char* out, std::string_view str) {
+        std::memcpy(out, str.data(), str.size());
+        return out + str.size();
+    }
+
+    // Length of the quoted and escaped string
+    inline size_t string_size(std::string_view str) {
+        size_t res = 2;
+        for (char ch : str) {
+            res += escape_lengths[static_cast<uint8_t>(ch)];
+        }
+
+        return res;
+    }
+
+    // Writes exactly string_size(str) bytes
+    inline char* write_string(char* out, std::string_view str) {
+        static constexpr std::string_view hex = "0123456789abcdef";
+
+        *out++ = '"';
+
+        size_t start = 0;
+        for (size_t i = 0; i < str.size(); ++i) {
+            uint8_t ch = static_cast<uint8_t>(str[i]);
+            if (escape_lengths[ch] == 1) {
+                continue;
+            }
+
+            // Copy the unescaped run before it in one go
+            out = write_raw(out, str.substr(start, i - start));
+            start = i + 1;
+
+            *out++ = '\\';
+            switch (ch) {
+                case '\b': *out++ = 'b'; break;
+                case '\f': *out++ = 'f'; break;
+                case '\n': *out++ = 'n'; break;
+                case '\r': *out++ = 'r'; break;
+                case '\t': *out++ = 't'; break;
+                case '"': *out++ = '"'; break;
+                case '\\': *out++ = '\\'; break;
+
+                default:
+                    out = write_raw(out, "u00");
+                    *out++ = hex[ch >> 4];
+                    *out++ = hex[ch & 0xf];
+                    break;
+            }
+        }
+
+        out = write_raw(out, str.substr(start));
+        *out++ = '"';
+        return out;
+    }
+}
+
+#endif /* JSON_H */
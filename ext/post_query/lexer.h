@@ -0,0 +1,345 @@
+#ifndef LEXER_H
+#define LEXER_H
+
+// Single forward pass tokenizer for search queries, every byte is classified once
+
+#include "encoding.h"
+#include "metatags.h"
+
+#include <string>
+#include <string_view>
+#include <span>
+#include <array>
+#include <optional>
+#include <utility>
+#include <algorithm>
+#include <cctype>
+
+namespace post_query {
+    using namespace std::literals;
+
+    enum class token_kind {
+        Eof,
+        LParen,
+        RParen,
+        Not,
+        Opt,
+        And,
+        Or,
+        Tag,
+        Wildcard,
+        Metatag,
+
+        // Something no rule can start with: a reserved word or a broken quoted value
+        Invalid,
+    };
+
+    static constexpr std::array<std::string_view, 11> token_kind_names {
+        "eof", "lparen", "rparen", "not", "opt", "and", "or", "tag", "wildcard", "metatag", "invalid",
+    };
+
+    static constexpr std::string_view token_kind_name(token_kind kind) {
+        return token_kind_names[static_cast<int>(kind)];
+    }
+
+    struct token {
+        token_kind kind;
+
+        // Byte offsets of the token in the input, excluding surrounding spaces
+        size_t begin;
+        size_t end;
+
+        // Tag or wildcard text, or the metatag name as it appears in the metatag list
+        std::string_view text;
+
+        // Unescaped metatag value
+        std::string value;
+        bool quoted = false;
+    };
+
+    class lexer {
+        private:
+        std::string_view _input;
+        // The built-in registry is used when no list is given
+        std::optional<std::span<const std::string>> _metatags;
+        std::string_view::iterator _cur;
+        std::optional<token> _peeked;
+
+        public:
+        static constexpr std::array<std::string_view, 6> unbalanced_tags {{
+            ":)", ":(", ";)", ";(", ">:)", ">:("
+        }};
+
+        // Input must be null-terminated, see encoding::unicode_space
+        lexer(std::string_view input, std::optional<std::span<const std::string>> metatags)
+            : _input { input }, _metatags { metatags }, _cur { input.begin() } {
+
+        }
+
+        // Trailing ) of a word are only split off while there are at least as many open parens
+        const token& peek(ssize_t unclosed_parens) {
+            if (!_peeked) {
+                _peeked = lex(unclosed_parens);
+            }
+
+            return *_peeked;
+        }
+
+        token next(ssize_t unclosed_parens) {
+            peek(unclosed_parens);
+            token res = std::move(*_peeked);
+            _peeked.reset();
+            return res;
+        }
+
+        bool eof() const {
+            return _cur == _input.end();
+        }
+
+        // Continue lexing at a byte offset, which has to be the end of an earlier token
+        void seek(size_t offset) {
+            _cur = _input.begin() + offset;
+            _peeked.reset();
+        }
+
+        // Input after the last token that was read
+        std::string_view remaining() const {
+            return { _cur, _input.end() };
+        }
+
+        static constexpr bool case_compare(char c1, char c2, bool case_sensitive) {
+            if (case_sensitive) {
+                return c1 == c2;
+            } else {
+                return std::tolower(c1) == std::tolower(c2);
+            }
+        }
+
+        static constexpr bool case_compare(std::string_view s1, std::string_view s2, bool case_sensitive) {
+            if (case_sensitive) {
+                return s1 == s2;
+            } else {
+                return std::ranges::equal(
+                    s1, s2,
+                    [](char c1, char c2) { return case_compare(c1, c2, false); }
+                );
+            }
+        }
+
+        private:
+        size_t offset(std::string_view::iterator it) const {
+            return it - _input.begin();
+        }
+
+        void consume_spaces() {
+            while (!eof()) {
+                if (int size = encoding::unicode_space(_cur); size == 0) {
+                    break;
+                } else {
+                    _cur += size;
+                }
+            }
+        }
+
+        token lex(ssize_t unclosed_parens) {
+            consume_spaces();
+
+            auto start = _cur;
+            auto make = [&](token_kind kind, std::string_view text = {}) {
+                return token { .kind = kind, .begin = offset(start), .end = offset(_cur), .text = text, .value = {} };
+            };
+
+            if (eof()) {
+                return make(token_kind::Eof);
+            }
+
+            switch (*_cur) {
+                case '(': ++_cur; return make(token_kind::LParen);
+                case ')': ++_cur; return make(token_kind::RParen);
+                case '-': ++_cur; return make(token_kind::Not);
+                case '~': ++_cur; return make(token_kind::Opt);
+                default: break;
+            }
+
+            // Keywords need to be followed by at least one space
+            for (auto [keyword, kind] : { std::pair { "and"sv, token_kind::And }, std::pair { "or"sv, token_kind::Or } }) {
+                if (size_t(_input.end() - _cur) > keyword.size()
+                    && case_compare(keyword, std::string_view { _cur, _cur + keyword.size() }, false)
+                    && encoding::unicode_space(_cur + keyword.size())) {
+                    _cur += keyword.size();
+                    token res = make(kind);
+                    consume_spaces();
+                    return res;
+                }
+            }
+
+            std::string_view word = trim_parens(scan_word(), unclosed_parens, true);
+
+            if (case_compare(word, "and", false) || case_compare(word, "or", false)) {
+                _cur += word.size();
+                return make(token_kind::Invalid);
+            }
+
+            if (size_t colon = word.find(':'); colon != std::string_view::npos) {
+                if (auto metatag = find_metatag_name(word.substr(0, colon))) {
+                    // The value may contain escaped spaces, so it's scanned separately
+                    _cur += colon + 1;
+
+                    token res = make(token_kind::Metatag, *metatag);
+                    if (!value(unclosed_parens, res.quoted, res.value)) {
+                        res.kind = token_kind::Invalid;
+                    }
+
+                    res.end = offset(_cur);
+                    return res;
+                }
+            }
+
+            _cur += word.size();
+            return make(word.contains('*') ? token_kind::Wildcard : token_kind::Tag, word);
+        }
+
+        // Returns the metatag name as it's spelled in the metatag list
+        std::optional<std::string_view> find_metatag_name(std::string_view name) const {
+            if (!_metatags) {
+                return find_metatag_key(name);
+            }
+
+            auto metatag = std::ranges::find_if(*_metatags, [name](std::string_view metatag) {
+                return case_compare(metatag, name, false);
+            });
+
+            if (metatag == _metatags->end()) {
+                return std::nullopt;
+            }
+
+            return *metatag;
+        }
+
+        // Everything up to the next space
+        std::string_view scan_word() const {
+            auto it = _cur;
+            while (it != _input.end() && !encoding::unicode_space(it)) {
+                ++it;
+            }
+
+            return { _cur, it };
+        }
+
+        // Remove trailing ) that close any open parens
+        // Words that have balanced parens or are emoticons keep them when skip_balanced_parens is set
+        static std::string_view trim_parens(std::string_view sv, ssize_t unclosed_parens, bool skip_balanced_parens) {
+            // The word is balanced for as long as it's cut before the first ) without a matching (
+            size_t first_unmatched = sv.size();
+            if (skip_balanced_parens) {
+                ssize_t parens = 0;
+                for (size_t i = 0; i < sv.size(); ++i) {
+                    if (sv[i] == '(') {
+                        parens += 1;
+                    } else if (sv[i] == ')' && --parens < 0) {
+                        first_unmatched = i;
+                        break;
+                    }
+                }
+            }
+
+            for (ssize_t n = unclosed_parens; n > 0 && !sv.empty() && sv.back() == ')'; --n) {
+                if (skip_balanced_parens && (first_unmatched >= sv.size() || std::ranges::contains(unbalanced_tags, sv))) {
+                    break;
+                }
+
+                sv.remove_suffix(1);
+            }
+
+            return sv;
+        }
+
+        bool value(ssize_t unclosed_parens, bool& quoted, std::string& res) {
+            char first = eof() ? '\0' : *_cur;
+            if (first == '"' || first == '\'') {
+                // Quoted string, consume any character that isn't a quote or part of an escape,
+                // or an escaped quote exactly
+                ++_cur;
+
+                quoted = true;
+
+                bool escape_next = false;
+
+                for (;;) {
+                    // No EOF allowed since we require a closing quote
+                    if (eof()) {
+                        return false;
+                    }
+
+                    char ch = *_cur++;
+
+                    // Escaped quote
+                    if (escape_next) {
+                        if (ch == first) {
+                            escape_next = false;
+                            res.push_back(first);
+                        } else {
+                            // Not an escaped quote, parse error!
+                            return false;
+                        }
+                    } else if (ch == '\\') {
+                        escape_next = true;
+                    } else if (ch == first) {
+                        // End of string, consume closing quote
+                        return true;
+                    } else {
+                        // Just pass through
+                        res.push_back(ch);
+                    }
+                }
+            }
+
+            // Unquoted string, only escape spaces
+            quoted = false;
+
+            // XXX: Danbooru's parser lets you "escape" any character in a non-quoted string:
+            // order:a\bc -> order:a\bc
+            // order:"a\bc" -> none
+            auto it = _cur;
+            for (bool escape_next = false; it != _input.end(); ++it) {
+                if (escape_next) {
+                    escape_next = false;
+                } else if (*it == '\\') {
+                    escape_next = true;
+                } else if (encoding::unicode_space(it)) {
+                    break;
+                }
+            }
+
+            std::string_view sv = trim_parens({ _cur, it }, unclosed_parens, false);
+            _cur += sv.size();
+
+            // Unescape any escaped spaces, leave escaped non-spaces intact
+            res.reserve(res.size() + sv.size());
+            bool escape_next = false;
+            for (auto it = sv.begin(); it != sv.end(); ++it) {
+                if (escape_next) {
+                    escape_next = false;
+                    if (int size = encoding::unicode_space(it)) {
+                        // Escaped space
+                        res.push_back(*it);
+
+                        std::advance(it, size - 1);
+                    } else {
+                        // Escaped non-space, retain escape character
+                        res.push_back('\\');
+                        res.push_back(*it);
+                    }
+                } else if (*it == '\\') {
+                    escape_next = true;
+                } else {
+                    res.push_back(*it);
+                }
+            }
+
+            return true;
+        }
+    };
+}
+
+#endif /* LEXER_H */
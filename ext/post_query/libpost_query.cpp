@@ -0,0 +1,233 @@
+// Implementation of the C interface, see libpost_query.h
+// Built into libpost_query through `rake lib`, the Ruby extension uses the same headers directly
+
+#include "libpost_query.h"
+
+#include "parser.h"
+#include "encoding.h"
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <format>
+#include <cstring>
+#include <new>
+
+struct pq_parser {
+    post_query::parser parser;
+};
+
+struct pq_query {
+    post_query::ast_ptr root;
+};
+
+namespace {
+    thread_local pq_status last_status = PQ_OK;
+    thread_local std::string last_error;
+
+    pq_status fail(pq_status status, std::string message = {}) {
+        last_status = status;
+        last_error = std::move(message);
+        return status;
+    }
+
+    // Exceptions can't cross the C boundary, so every entry point runs through this
+    template <typename Func>
+    pq_status guarded(Func func) noexcept {
+        try {
+            return func();
+        } catch (const std::bad_alloc&) {
+            // Allocating a message could throw again
+            last_status = PQ_ERROR_OUT_OF_MEMORY;
+            last_error.clear();
+            return PQ_ERROR_OUT_OF_MEMORY;
+        } catch (const std::exception& e) {
+            return fail(PQ_ERROR_INTERNAL, e.what());
+        }
+    }
+
+    pq_status checked_string(const char* data, size_t length, std::string_view& out) {
+        if (!data && length > 0) {
+            return fail(PQ_ERROR_INVALID_ARGUMENT, "string is null");
+        }
+
+        out = data ? std::string_view { data, length } : std::string_view {};
+        if (auto valid = encoding::validate(out); !valid) {
+            return fail(PQ_ERROR_INVALID_ARGUMENT, std::format("input contains invalid UTF-8: {}", encoding::error_message(valid.error())));
+        }
+
+        return PQ_OK;
+    }
+
+    pq_status parse(const pq_parser* parser, std::string_view query, post_query::ast_ptr& out) {
+        post_query::parse_result res = parser->parser.parse(query);
+        if (!res) {
+            switch (res.error().code) {
+                case post_query::parse_errc::UnclosedParens:
+                    return fail(PQ_ERROR_UNCLOSED_PARENS, std::move(res.error().message));
+
+                case post_query::parse_errc::TrailingInput:
+                    return fail(PQ_ERROR_TRAILING_INPUT, std::move(res.error().message));
+            }
+        }
+
+        out = std::move(*res);
+        return PQ_OK;
+    }
+
+    pq_status write_string(std::string_view str, char* buffer, size_t capacity, size_t* length) {
+        if (!length || (!buffer && capacity > 0)) {
+            return fail(PQ_ERROR_INVALID_ARGUMENT, "output buffer is null");
+        }
+
+        *length = str.size();
+        if (capacity <= str.size()) {
+            return fail(PQ_ERROR_BUFFER_TOO_SMALL, std::format("{} bytes required, buffer has {}", str.size() + 1, capacity));
+        }
+
+        std::memcpy(buffer, str.data(), str.size());
+        buffer[str.size()] = '\0';
+        return PQ_OK;
+    }
+}
+
+extern "C" {
+    uint32_t pq_abi_version(void) {
+        return PQ_ABI_VERSION;
+    }
+
+    const char* pq_status_string(pq_status status) {
+        switch (status) {
+            case PQ_OK: return "ok";
+            case PQ_ERROR_INVALID_ARGUMENT: return "invalid argument";
+            case PQ_ERROR_UNCLOSED_PARENS: return "unclosed parentheses";
+            case PQ_ERROR_TRAILING_INPUT: return "trailing input";
+            case PQ_ERROR_BUFFER_TOO_SMALL: return "buffer too small";
+            case PQ_ERROR_OUT_OF_MEMORY: return "out of memory";
+            case PQ_ERROR_INTERNAL: return "internal error";
+        }
+
+        return "unknown status";
+    }
+
+    const char* pq_last_error(void) {
+        return last_error.empty() ? pq_status_string(last_status) : last_error.c_str();
+    }
+
+    pq_status pq_parser_new(const char* const* metatags, size_t count, uint32_t flags, pq_parser** out) {
+        return guarded([&] {
+            if (!out || (!metatags && count > 0)) {
+                return fail(PQ_ERROR_INVALID_ARGUMENT, "parser output or metatags are null");
+            }
+
+            bool typed = flags & PQ_PARSER_TYPED_VALUES;
+            if (!metatags) {
+                *out = new pq_parser { post_query::parser { typed } };
+                return PQ_OK;
+            }
+
+            std::vector<std::string> names;
+            names.reserve(count);
+
+            for (size_t i = 0; i < count; ++i) {
+                std::string_view name;
+                if (pq_status status = checked_string(metatags[i], metatags[i] ? std::strlen(metatags[i]) : 0, name); status != PQ_OK) {
+                    return status;
+                }
+
+                names.emplace_back(name);
+            }
+
+            *out = new pq_parser { post_query::parser { std::move(names), typed } };
+            return PQ_OK;
+        });
+    }
+
+    void pq_parser_free(pq_parser* parser) {
+        delete parser;
+    }
+
+    pq_status pq_parse(const pq_parser* parser, const char* query, size_t length, pq_query** out) {
+        return guarded([&] {
+            if (!parser || !out) {
+                return fail(PQ_ERROR_INVALID_ARGUMENT, "parser or query output is null");
+            }
+
+            std::string_view input;
+            post_query::ast_ptr root;
+            if (pq_status status = checked_string(query, length, input); status != PQ_OK) {
+                return status;
+            } else if (status = parse(parser, input, root); status != PQ_OK) {
+                return status;
+            }
+
+            *out = new pq_query { std::move(root) };
+            return PQ_OK;
+        });
+    }
+
+    pq_status pq_query_copy(const pq_query* query, pq_query** out) {
+        return guarded([&] {
+            if (!query || !out) {
+                return fail(PQ_ERROR_INVALID_ARGUMENT, "query or copy output is null");
+            }
+
+            *out = new pq_query { query->root->copy() };
+            return PQ_OK;
+        });
+    }
+
+    void pq_query_free(pq_query* query) {
+        delete query;
+    }
+
+    pq_status pq_query_to_cnf(pq_query* query) {
+        return guarded([&] {
+            if (!query) {
+                return fail(PQ_ERROR_INVALID_ARGUMENT, "query is null");
+            }
+
+            query->root->to_cnf();
+            return PQ_OK;
+        });
+    }
+
+    pq_status pq_query_to_infix(const pq_query* query, char* buffer, size_t capacity, size_t* length) {
+        return guarded([&] {
+            if (!query) {
+                return fail(PQ_ERROR_INVALID_ARGUMENT, "query is null");
+            }
+
+            return write_string(query->root->to_infix(), buffer, capacity, length);
+        });
+    }
+
+    pq_status pq_query_to_sexp(const pq_query* query, char* buffer, size_t capacity, size_t* length) {
+        return guarded([&] {
+            if (!query) {
+                return fail(PQ_ERROR_INVALID_ARGUMENT, "query is null");
+            }
+
+            return write_string(query->root->to_sexp(), buffer, capacity, length);
+        });
+    }
+
+    pq_status pq_normalize(const pq_parser* parser, const char* query, size_t query_length, char* buffer, size_t capacity, size_t* length) {
+        return guarded([&] {
+            if (!parser) {
+                return fail(PQ_ERROR_INVALID_ARGUMENT, "parser is null");
+            }
+
+            std::string_view input;
+            post_query::ast_ptr root;
+            if (pq_status status = checked_string(query, query_length, input); status != PQ_OK) {
+                return status;
+            } else if (status = parse(parser, input, root); status != PQ_OK) {
+                return status;
+            }
+
+            root->to_cnf();
+            return write_string(root->to_infix(), buffer, capacity, length);
+        });
+    }
+}
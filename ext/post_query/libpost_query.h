@@ -0,0 +1,96 @@
+#ifndef LIBPOST_QUERY_H
+#define LIBPOST_QUERY_H
+
+// C interface to the query parser, independent of Ruby
+// Build the shared library through `rake lib`, `rake test:lib` runs test/libpost_query_test.c against it
+//
+// The Ruby extension doesn't go through this interface, it includes the same header-only core directly
+// Both share every parsing and normalization routine, only argument checking and error reporting are separate
+//
+// Every function returns a status code and reports its results through out-parameters
+// Strings are UTF-8 with an explicit length and don't have to be null-terminated
+// Serialized output is written to caller-provided buffers, see pq_query_to_infix
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// The library is built with hidden visibility, only these functions are exported
+#if defined(_WIN32)
+#define PQ_API __declspec(dllexport)
+#else
+#define PQ_API __attribute__((visibility("default")))
+#endif
+
+// Incremented whenever an existing declaration changes incompatibly
+#define PQ_ABI_VERSION 1
+
+typedef enum pq_status {
+    PQ_OK = 0,
+
+    // A required pointer was null or a string was not valid UTF-8
+    PQ_ERROR_INVALID_ARGUMENT = 1,
+
+    // Reserved for parser errors, the current parser turns unbalanced parentheses and
+    // leftover input into `none` like the Ruby extension does, so neither is returned
+    PQ_ERROR_UNCLOSED_PARENS = 2,
+    PQ_ERROR_TRAILING_INPUT = 3,
+
+    // The output buffer was too small, the required length was still stored
+    PQ_ERROR_BUFFER_TOO_SMALL = 4,
+
+    PQ_ERROR_OUT_OF_MEMORY = 5,
+    PQ_ERROR_INTERNAL = 6,
+} pq_status;
+
+typedef enum pq_parser_flags {
+    PQ_PARSER_DEFAULT = 0,
+
+    // Parse metatag values into typed ranges, see `PostQuery.parse(typed: true)`
+    PQ_PARSER_TYPED_VALUES = 1 << 0,
+} pq_parser_flags;
+
+// Immutable once created, a single parser may be used from any number of threads at once
+typedef struct pq_parser pq_parser;
+
+// A parsed query, must not be used from multiple threads at once if one of them modifies it
+typedef struct pq_query pq_query;
+
+// PQ_ABI_VERSION of the loaded library
+PQ_API uint32_t pq_abi_version(void);
+
+// Static description of a status code
+PQ_API const char* pq_status_string(pq_status status);
+
+// Details of the last error on the calling thread, valid until the next call on the same thread
+PQ_API const char* pq_last_error(void);
+
+// A null `metatags` uses the built-in metatag registry, otherwise `count` null-terminated names
+PQ_API pq_status pq_parser_new(const char* const* metatags, size_t count, uint32_t flags, pq_parser** out);
+PQ_API void pq_parser_free(pq_parser* parser);
+
+// Queries that are not valid syntax parse successfully into `none`, the same as in Ruby
+PQ_API pq_status pq_parse(const pq_parser* parser, const char* query, size_t length, pq_query** out);
+PQ_API pq_status pq_query_copy(const pq_query* query, pq_query** out);
+PQ_API void pq_query_free(pq_query* query);
+
+// Normalizes the query in place
+PQ_API pq_status pq_query_to_cnf(pq_query* query);
+
+// Writes the serialized query followed by a null byte if it fits in `capacity` bytes
+// The length without the null byte is always stored in `length`,
+// so a call with a null buffer and zero capacity returns the size to allocate
+PQ_API pq_status pq_query_to_infix(const pq_query* query, char* buffer, size_t capacity, size_t* length);
+PQ_API pq_status pq_query_to_sexp(const pq_query* query, char* buffer, size_t capacity, size_t* length);
+
+// Parse, convert to CNF and serialize to infix in a single call
+PQ_API pq_status pq_normalize(const pq_parser* parser, const char* query, size_t query_length, char* buffer, size_t capacity, size_t* length);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIBPOST_QUERY_H */
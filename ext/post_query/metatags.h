@@ -0,0 +1,312 @@
+#ifndef METATAGS_H
+#define METATAGS_H
+
+// Built-in description of every metatag Danbooru knows about
+// Lookups by name or synonym go through a perfect hash that is computed at compile time
+
+#include "values.h"
+
+#include <string_view>
+#include <array>
+#include <span>
+#include <string>
+#include <optional>
+#include <algorithm>
+#include <cstdint>
+#include <bit>
+
+namespace post_query {
+    struct metatag_info {
+        // Canonical name, synonyms are normalized to it
+        std::string_view name;
+        std::string_view synonym = {};
+
+        // Only metatags with a value type can be parsed into ranges
+        std::optional<value_type> type = std::nullopt;
+
+        // Settings for the whole search that are only used once, e.g. `order:score`
+        bool single_valued = false;
+
+        // Can be used as an `order:` value
+        bool orderable = false;
+    };
+
+    static constexpr std::array<metatag_info, 80> builtin_metatags {{
+        { .name = "user" },
+        { .name = "approver" },
+        { .name = "commenter" },
+        { .name = "comm" },
+        { .name = "noter" },
+        { .name = "noteupdater" },
+        { .name = "artcomm", .orderable = true },
+        { .name = "commentaryupdater" },
+        { .name = "flagger" },
+        { .name = "appealer" },
+        { .name = "upvote" },
+        { .name = "downvote" },
+        { .name = "fav" },
+        { .name = "ordfav", .single_valued = true },
+        { .name = "favgroup" },
+        { .name = "ordfavgroup", .single_valued = true },
+        { .name = "reacted" },
+        { .name = "pool" },
+        { .name = "ordpool", .single_valued = true },
+        { .name = "note", .orderable = true },
+        { .name = "comment", .orderable = true },
+        { .name = "commentary" },
+        { .name = "id", .type = value_type::Integer, .orderable = true },
+        { .name = "rating" },
+        { .name = "source" },
+        { .name = "status" },
+        { .name = "filetype" },
+        { .name = "disapproved" },
+        { .name = "parent" },
+        { .name = "child" },
+        { .name = "search" },
+        { .name = "embedded" },
+        { .name = "md5", .orderable = true },
+        { .name = "pixelhash" },
+        { .name = "width", .type = value_type::Integer, .orderable = true },
+        { .name = "height", .type = value_type::Integer, .orderable = true },
+        { .name = "mpixels", .type = value_type::Float, .orderable = true },
+        { .name = "ratio", .type = value_type::Ratio, .orderable = true },
+        { .name = "score", .type = value_type::Integer, .orderable = true },
+        { .name = "upvotes", .type = value_type::Integer, .orderable = true },
+        { .name = "downvotes", .type = value_type::Integer, .orderable = true },
+        { .name = "favcount", .type = value_type::Integer, .orderable = true },
+        { .name = "filesize", .type = value_type::Size, .orderable = true },
+        { .name = "date", .type = value_type::Date },
+        { .name = "age" },
+        { .name = "order", .single_valued = true },
+        { .name = "limit", .type = value_type::Integer, .single_valued = true },
+        { .name = "tagcount", .type = value_type::Integer, .orderable = true },
+        { .name = "pixiv_id", .type = value_type::Integer },
+        { .name = "pixiv", .type = value_type::Integer },
+        { .name = "unaliased" },
+        { .name = "exif" },
+        { .name = "duration", .type = value_type::Float, .orderable = true },
+        { .name = "random", .type = value_type::Integer, .single_valued = true, .orderable = true },
+        { .name = "is" },
+        { .name = "has" },
+        { .name = "ai" },
+        { .name = "comment_count", .synonym = "comments", .type = value_type::Integer, .orderable = true },
+        { .name = "deleted_comment_count", .synonym = "deleted_comments", .type = value_type::Integer, .orderable = true },
+        { .name = "active_comment_count", .synonym = "active_comments", .type = value_type::Integer, .orderable = true },
+        { .name = "note_count", .synonym = "notes", .type = value_type::Integer, .orderable = true },
+        { .name = "deleted_note_count", .synonym = "deleted_notes", .type = value_type::Integer, .orderable = true },
+        { .name = "active_note_count", .synonym = "active_notes", .type = value_type::Integer, .orderable = true },
+        { .name = "flag_count", .synonym = "flags", .type = value_type::Integer, .orderable = true },
+        { .name = "child_count", .synonym = "children", .type = value_type::Integer, .orderable = true },
+        { .name = "deleted_child_count", .synonym = "deleted_children", .type = value_type::Integer, .orderable = true },
+        { .name = "active_child_count", .synonym = "active_children", .type = value_type::Integer, .orderable = true },
+        { .name = "pool_count", .synonym = "pools", .type = value_type::Integer, .orderable = true },
+        { .name = "deleted_pool_count", .synonym = "deleted_pools", .type = value_type::Integer, .orderable = true },
+        { .name = "active_pool_count", .synonym = "active_pools", .type = value_type::Integer, .orderable = true },
+        { .name = "series_pool_count", .synonym = "series_pools", .type = value_type::Integer, .orderable = true },
+        { .name = "collection_pool_count", .synonym = "collection_pools", .type = value_type::Integer, .orderable = true },
+        { .name = "appeal_count", .synonym = "appeals", .type = value_type::Integer, .orderable = true },
+        { .name = "approval_count", .synonym = "approvals", .type = value_type::Integer, .orderable = true },
+        { .name = "replacement_count", .synonym = "replacements", .type = value_type::Integer, .orderable = true },
+        { .name = "arttags", .type = value_type::Integer, .orderable = true },
+        { .name = "copytags", .type = value_type::Integer, .orderable = true },
+        { .name = "chartags", .type = value_type::Integer, .orderable = true },
+        { .name = "gentags", .type = value_type::Integer, .orderable = true },
+        { .name = "metatags", .type = value_type::Integer, .orderable = true },
+    }};
+
+    namespace detail {
+        struct metatag_key {
+            std::string_view key;
+            uint8_t index;
+        };
+
+        static constexpr size_t metatag_key_count() {
+            return builtin_metatags.size()
+                + std::ranges::count_if(builtin_metatags, [](const metatag_info& info) { return !info.synonym.empty(); });
+        }
+
+        // Canonical names and synonyms both point to their metatag
+        static constexpr std::array<metatag_key, metatag_key_count()> metatag_keys = [] {
+            std::array<metatag_key, metatag_key_count()> res {};
+            size_t i = 0;
+            for (size_t index = 0; index < builtin_metatags.size(); ++index) {
+                res[i++] = { builtin_metatags[index].name, uint8_t(index) };
+                if (!builtin_metatags[index].synonym.empty()) {
+                    res[i++] = { builtin_metatags[index].synonym, uint8_t(index) };
+                }
+            }
+            return res;
+        }();
+
+        static constexpr size_t metatag_max_length = std::ranges::max(metatag_keys, {}, [](const metatag_key& key) {
+            return key.key.size();
+        }).key.size();
+
+        // Hash and displace: every bucket of keys gets the displacement that puts all of them into free slots
+        class metatag_perfect_hash {
+            private:
+            static constexpr size_t slot_count = std::bit_ceil(metatag_keys.size());
+            static constexpr size_t bucket_count = slot_count / 2;
+            static constexpr uint8_t empty_slot = 0xff;
+
+            static_assert(metatag_keys.size() < empty_slot);
+
+            std::array<uint32_t, bucket_count> _displacements {};
+            std::array<uint8_t, slot_count> _slots {};
+
+            static constexpr uint32_t mix(uint32_t h) {
+                h ^= h >> 16;
+                h *= 0x85ebca6b;
+                h ^= h >> 13;
+                h *= 0xc2b2ae35;
+                h ^= h >> 16;
+                return h;
+            }
+
+            static constexpr size_t bucket(uint32_t h) {
+                return mix(h) & (bucket_count - 1);
+            }
+
+            static constexpr size_t slot(uint32_t h, uint32_t displacement) {
+                return mix(h ^ (displacement * 0x9e3779b9)) & (slot_count - 1);
+            }
+
+            public:
+            static constexpr uint32_t hash(std::string_view sv) {
+                // FNV-1a
+                uint32_t res = 0x811c9dc5;
+                for (char ch : sv) {
+                    res ^= uint8_t(ch);
+                    res *= 0x01000193;
+                }
+                return res;
+            }
+
+            constexpr metatag_perfect_hash() {
+                std::array<uint32_t, metatag_keys.size()> hashes {};
+                std::array<size_t, bucket_count> sizes {};
+                for (size_t i = 0; i < metatag_keys.size(); ++i) {
+                    hashes[i] = hash(metatag_keys[i].key);
+                    sizes[bucket(hashes[i])] += 1;
+                }
+
+                // Place the largest buckets first, while there are still many free slots
+                std::array<size_t, bucket_count> order {};
+                for (size_t i = 0; i < bucket_count; ++i) {
+                    order[i] = i;
+                }
+                std::ranges::sort(order, [&](size_t lhs, size_t rhs) {
+                    return (sizes[lhs] != sizes[rhs]) ? sizes[lhs] > sizes[rhs] : lhs < rhs;
+                });
+
+                _slots.fill(empty_slot);
+
+                for (size_t b : order) {
+                    if (sizes[b] == 0) {
+                        break;
+                    }
+
+                    for (uint32_t displacement = 1;; ++displacement) {
+                        std::array<size_t, metatag_keys.size()> taken {};
+                        size_t count = 0;
+                        bool fits = true;
+
+                        for (size_t i = 0; i < metatag_keys.size() && fits; ++i) {
+                            if (bucket(hashes[i]) != b) {
+                                continue;
+                            }
+
+                            size_t s = slot(hashes[i], displacement);
+                            fits = _slots[s] == empty_slot && std::ranges::find(taken.begin(), taken.begin() + count, s) == taken.begin() + count;
+                            taken[count++] = s;
+                        }
+
+                        if (!fits) {
+                            continue;
+                        }
+
+                        count = 0;
+                        for (size_t i = 0; i < metatag_keys.size(); ++i) {
+                            if (bucket(hashes[i]) == b) {
+                                _slots[taken[count++]] = uint8_t(i);
+                            }
+                        }
+
+                        _displacements[b] = displacement;
+                        break;
+                    }
+                }
+            }
+
+            // Index into metatag_keys, names are case sensitive
+            constexpr std::optional<size_t> find(std::string_view name) const {
+                uint32_t h = hash(name);
+                uint8_t key = _slots[slot(h, _displacements[bucket(h)])];
+                if (key == empty_slot || metatag_keys[key].key != name) {
+                    return std::nullopt;
+                }
+
+                return key;
+            }
+        };
+
+        static constexpr metatag_perfect_hash metatag_lookup {};
+    }
+
+    // Find a metatag by its canonical name or synonym
+    static constexpr const metatag_info* find_metatag(std::string_view name) {
+        if (auto key = detail::metatag_lookup.find(name)) {
+            return &builtin_metatags[detail::metatag_keys[*key].index];
+        }
+
+        return nullptr;
+    }
+
+    // Returns the name as it appears in the registry, the lookup ignores case
+    static constexpr std::optional<std::string_view> find_metatag_key(std::string_view name) {
+        if (name.size() > detail::metatag_max_length) {
+            return std::nullopt;
+        }
+
+        std::array<char, detail::metatag_max_length> lower {};
+        std::ranges::transform(name, lower.begin(), [](char ch) { return (ch >= 'A' && ch <= 'Z') ? char(ch - 'A' + 'a') : ch; });
+
+        if (auto key = detail::metatag_lookup.find({ lower.data(), name.size() })) {
+            return detail::metatag_keys[*key].key;
+        }
+
+        return std::nullopt;
+    }
+
+    // Every canonical name and synonym
+    static constexpr std::span<const detail::metatag_key> builtin_metatag_keys() {
+        return detail::metatag_keys;
+    }
+
+    // Synonyms are replaced by their canonical name, anything else is left as-is
+    static constexpr void normalize_metatag(std::string& name) {
+        if (const metatag_info* info = find_metatag(name)) {
+            name = info->name;
+        }
+    }
+
+    static constexpr std::optional<value_type> metatag_value_type(std::string_view name) {
+        const metatag_info* info = find_metatag(name);
+        return info ? info->type : std::nullopt;
+    }
+
+    // Single-valued typed metatags are settings rather than constraints on a post
+    static constexpr bool is_range_metatag(std::string_view name) {
+        const metatag_info* info = find_metatag(name);
+        return info && info->type && !info->single_valued;
+    }
+
+    static_assert(find_metatag("comments") == find_metatag("comment_count"));
+    static_assert(find_metatag("Comments") == nullptr && find_metatag_key("Comments") == "comments");
+    static_assert(!find_metatag("comment_counts"));
+    static_assert(std::ranges::all_of(detail::metatag_keys, [](const detail::metatag_key& key) {
+        return find_metatag(key.key) == &builtin_metatags[key.index];
+    }));
+}
+
+#endif /* METATAGS_H */
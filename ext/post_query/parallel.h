@@ -0,0 +1,221 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+// Work-stealing thread pool for splitting large loops over an index range
+// Every worker owns a deque of ranges: it splits its range in half, keeps working on the first half and
+// pushes the second onto the back of its deque, idle threads steal the oldest (largest) range from the front of another deque
+// The thread calling parallel_for steals along with the workers until the whole range ran
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <thread>
+#include <functional>
+#include <exception>
+#include <optional>
+
+#include <unistd.h>
+
+namespace post_query {
+    class work_pool {
+        private:
+        // A single parallel_for call, shared by all of its ranges
+        struct job {
+            std::function<void(size_t, size_t)> func;
+            size_t grain;
+
+            // Indices that still have to run, the caller returns once this reaches 0
+            std::atomic<size_t> remaining;
+
+            std::mutex mutex;
+            std::condition_variable done;
+            std::exception_ptr error;
+        };
+
+        struct range {
+            job* owner;
+            size_t begin;
+            size_t end;
+        };
+
+        struct queue {
+            std::mutex mutex;
+            std::deque<range> ranges;
+        };
+
+        std::vector<std::unique_ptr<queue>> _queues;
+        std::vector<std::jthread> _threads;
+
+        // Ranges in all queues, idle workers sleep while it's 0
+        std::atomic<size_t> _queued = 0;
+        std::mutex _mutex;
+        std::condition_variable _wake;
+        bool _stopping = false;
+
+        void push(size_t index, range r) {
+            {
+                std::lock_guard lock { _queues[index]->mutex };
+                _queues[index]->ranges.push_back(r);
+            }
+
+            _queued.fetch_add(1, std::memory_order_release);
+            {
+                std::lock_guard lock { _mutex };
+            }
+            _wake.notify_one();
+        }
+
+        // Newest range of its own queue, otherwise the oldest one of any other
+        std::optional<std::pair<size_t, range>> pop(size_t index) {
+            for (size_t i = 0; i < _queues.size(); ++i) {
+                size_t victim = (index + i) % _queues.size();
+
+                std::lock_guard lock { _queues[victim]->mutex };
+                std::deque<range>& ranges = _queues[victim]->ranges;
+                if (ranges.empty()) {
+                    continue;
+                }
+
+                range res = (i == 0) ? ranges.back() : ranges.front();
+                (i == 0) ? ranges.pop_back() : ranges.pop_front();
+
+                _queued.fetch_sub(1, std::memory_order_relaxed);
+                return std::pair { victim, res };
+            }
+
+            return std::nullopt;
+        }
+
+        // Splits off halves for other threads to steal until the range is small enough, then runs it
+        void run(size_t index, range r) {
+            job& j = *r.owner;
+
+            while (r.end - r.begin > j.grain) {
+                size_t mid = r.begin + (r.end - r.begin) / 2;
+                push(index, range { .owner = r.owner, .begin = mid, .end = r.end });
+                r.end = mid;
+            }
+
+            std::exception_ptr error;
+            try {
+                j.func(r.begin, r.end);
+            } catch (...) {
+                error = std::current_exception();
+            }
+
+            // Under the lock, so the caller can't return and destroy the job before this thread is done with it
+            std::lock_guard lock { j.mutex };
+            if (error && !j.error) {
+                j.error = error;
+            }
+
+            if (j.remaining.fetch_sub(r.end - r.begin, std::memory_order_acq_rel) == r.end - r.begin) {
+                j.done.notify_all();
+            }
+        }
+
+        void work(size_t index) {
+            while (true) {
+                if (auto next = pop(index)) {
+                    run(next->first, next->second);
+                    continue;
+                }
+
+                std::unique_lock lock { _mutex };
+                _wake.wait(lock, [this] { return _stopping || _queued.load(std::memory_order_acquire) > 0; });
+                if (_stopping) {
+                    return;
+                }
+            }
+        }
+
+        public:
+        // Threads in addition to the calling one, with 0 every loop runs serially
+        explicit work_pool(size_t threads) {
+            for (size_t i = 0; i < threads; ++i) {
+                _queues.emplace_back(std::make_unique<queue>());
+            }
+
+            for (size_t i = 0; i < threads; ++i) {
+                _threads.emplace_back([this, i] { work(i); });
+            }
+        }
+
+        work_pool(const work_pool&) = delete;
+        work_pool& operator=(const work_pool&) = delete;
+
+        ~work_pool() {
+            {
+                std::lock_guard lock { _mutex };
+                _stopping = true;
+            }
+
+            _wake.notify_all();
+            _threads.clear();
+        }
+
+        size_t threads() const {
+            return _threads.size();
+        }
+
+        // Calls func(begin, end) for disjoint ranges covering [0, size), none of them longer than grain
+        // Returns once all of them returned, the first exception thrown by any of them is rethrown
+        void parallel_for(size_t size, size_t grain, std::function<void(size_t, size_t)> func) {
+            if (size == 0) {
+                return;
+            } else if (_threads.empty() || size <= grain) {
+                func(0, size);
+                return;
+            }
+
+            job j { .func = std::move(func), .grain = std::max<size_t>(grain, 1), .remaining = size, .mutex = {}, .done = {}, .error = {} };
+
+            // Start with one range per worker so they don't all steal from the same queue
+            size_t parts = _queues.size();
+            for (size_t i = 0; i < parts; ++i) {
+                push(i, range { .owner = &j, .begin = size * i / parts, .end = size * (i + 1) / parts });
+            }
+
+            // Help out instead of blocking, ranges of other jobs are fine to run as well
+            size_t index = std::hash<std::thread::id>{}(std::this_thread::get_id()) % _queues.size();
+            while (j.remaining.load(std::memory_order_acquire) > 0) {
+                if (auto next = pop(index)) {
+                    run(next->first, next->second);
+                    continue;
+                }
+
+                // Everything left is already running on a worker
+                std::unique_lock lock { j.mutex };
+                j.done.wait(lock, [&j] { return j.remaining.load(std::memory_order_acquire) == 0; });
+            }
+
+            // The last range may still be finishing up, see run
+            std::lock_guard lock { j.mutex };
+            if (j.error) {
+                std::rethrow_exception(j.error);
+            }
+        }
+
+        // One thread per core, the caller counts as one of them
+        // A forked child has none of its parent's threads, so it starts a pool of its own
+        static work_pool& global() {
+            static std::mutex mutex;
+            static work_pool* pool = nullptr;
+            static pid_t owner = 0;
+
+            std::lock_guard lock { mutex };
+            if (!pool || owner != getpid()) {
+                // The parent's pool is leaked on purpose, its threads don't exist here and couldn't be joined
+                pool = new work_pool { std::max(std::thread::hardware_concurrency(), 1u) - 1 };
+                owner = getpid();
+            }
+
+            return *pool;
+        }
+    };
+}
+
+#endif /* PARALLEL_H */
@@ -0,0 +1,204 @@
+#ifndef PLANNER_H
+#define PLANNER_H
+
+// Cost-based ordering of CNF clauses, the canonical sorted form is left untouched
+
+#include "ast.h"
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <optional>
+
+namespace post_query {
+    struct plan_statistics {
+        // Post count per tag, tags that are missing are assumed to have no posts
+        std::unordered_map<std::string, double> tag_counts;
+
+        // Relative evaluation cost per metatag name, 1.0 is the cost of a tag lookup
+        std::unordered_map<std::string, double> metatag_costs;
+
+        double total_posts = 0;
+
+        // Fraction of posts matched by a metatag or wildcard without more information
+        double default_selectivity = 0.5;
+
+        double default_metatag_cost = 1.0;
+        double wildcard_cost = 4.0;
+    };
+
+    struct plan_clause {
+        ast_ptr clause;
+        double cardinality;
+        double cost;
+    };
+
+    struct execution_plan {
+        std::vector<plan_clause> clauses;
+
+        // The first clause that can drive an index scan, if any
+        std::optional<size_t> driving;
+    };
+
+    class planner {
+        private:
+        const plan_statistics& _stats;
+
+        // Clauses are ordered by tier first, then estimated cardinality
+        enum class tier {
+            Positive,
+            Negative,
+            Expensive,
+        };
+
+        public:
+        explicit planner(const plan_statistics& stats) : _stats { stats } { }
+
+        double cardinality(const ast& node) const {
+            switch (node.type()) {
+                case node_type::All:
+                    return _stats.total_posts;
+
+                case node_type::None:
+                    return 0;
+
+                case node_type::Tag: {
+                    auto it = _stats.tag_counts.find(node.name());
+                    return std::min(it == _stats.tag_counts.end() ? 0 : it->second, _stats.total_posts);
+                }
+
+                case node_type::Wildcard:
+                case node_type::Metatag:
+                    return _stats.total_posts * _stats.default_selectivity;
+
+                case node_type::Not:
+                    return std::max(_stats.total_posts - cardinality(*node.children().front()), 0.0);
+
+                case node_type::Opt:
+                    return cardinality(*node.children().front());
+
+                case node_type::And: {
+                    double res = _stats.total_posts;
+                    for (const ast_ptr& child : node.children()) {
+                        res = std::min(res, cardinality(*child));
+                    }
+                    return res;
+                }
+
+                case node_type::Or: {
+                    double res = 0;
+                    for (const ast_ptr& child : node.children()) {
+                        res += cardinality(*child);
+                    }
+                    return std::min(res, _stats.total_posts);
+                }
+
+                default:
+                    return _stats.total_posts;
+            }
+        }
+
+        double cost(const ast& node) const {
+            switch (node.type()) {
+                case node_type::Wildcard:
+                    return _stats.wildcard_cost;
+
+                case node_type::Metatag: {
+                    auto it = _stats.metatag_costs.find(node.metatag().name);
+                    return (it == _stats.metatag_costs.end()) ? _stats.default_metatag_cost : it->second;
+                }
+
+                case node_type::Not:
+                case node_type::Opt:
+                case node_type::And:
+                case node_type::Or: {
+                    double res = 0;
+                    for (const ast_ptr& child : node.children()) {
+                        res += cost(*child);
+                    }
+                    return res;
+                }
+
+                default:
+                    return 1.0;
+            }
+        }
+
+        // Plan a query that is already in CNF
+        execution_plan plan(const ast& cnf) const {
+            execution_plan res;
+
+            std::vector<tier> tiers;
+            auto add_clause = [&](const ast& clause) {
+                double clause_cost = cost(clause);
+                tiers.push_back(clause_tier(clause, clause_cost));
+                res.clauses.emplace_back(plan_clause {
+                    .clause = clause.copy(),
+                    .cardinality = cardinality(clause),
+                    .cost = clause_cost,
+                });
+            };
+
+            if (cnf.type() == node_type::And) {
+                for (const ast_ptr& clause : cnf.children()) {
+                    add_clause(*clause);
+                }
+            } else {
+                add_clause(cnf);
+            }
+
+            // Sort indices so ties keep the canonical order
+            std::vector<size_t> order(res.clauses.size());
+            for (size_t i = 0; i < order.size(); ++i) {
+                order[i] = i;
+            }
+
+            std::ranges::stable_sort(order, [&](size_t lhs, size_t rhs) {
+                if (tiers[lhs] != tiers[rhs]) {
+                    return tiers[lhs] < tiers[rhs];
+                } else if (res.clauses[lhs].cardinality != res.clauses[rhs].cardinality) {
+                    return res.clauses[lhs].cardinality < res.clauses[rhs].cardinality;
+                } else {
+                    return res.clauses[lhs].cost < res.clauses[rhs].cost;
+                }
+            });
+
+            std::vector<plan_clause> sorted;
+            sorted.reserve(order.size());
+            for (size_t i : order) {
+                sorted.emplace_back(std::move(res.clauses[i]));
+            }
+            res.clauses = std::move(sorted);
+
+            if (!order.empty() && tiers[order.front()] == tier::Positive) {
+                res.driving = 0;
+            }
+
+            return res;
+        }
+
+        private:
+        tier clause_tier(const ast& clause, double clause_cost) const {
+            // More expensive than looking up the same number of tags
+            if (clause_cost > clause_literals(clause)) {
+                return tier::Expensive;
+            }
+
+            auto is_negative = [](const ast& node) { return node.type() == node_type::Not; };
+            if (is_negative(clause) || (clause.type() == node_type::Or
+                && std::ranges::all_of(clause.children(), [&](const ast_ptr& child) { return is_negative(*child); }))) {
+                return tier::Negative;
+            }
+
+            return tier::Positive;
+        }
+
+        static double clause_literals(const ast& clause) {
+            return (clause.type() == node_type::Or) ? double(clause.child_count()) : 1.0;
+        }
+    };
+}
+
+#endif /* PLANNER_H */
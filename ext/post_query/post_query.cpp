@@ -1,4 +1,9 @@
 #include "parser.h"
+#include "planner.h"
+#include "containment.h"
+#include "rules.h"
+#include "completion.h"
+#include "query_set.h"
 #include "encoding.h"
 
 #include <ruby.h>
@@ -9,46 +14,205 @@
 #include <iostream>
 #include <format>
 
+// Only assigned in Init_post_query, the classes themselves are shareable between Ractors
 VALUE post_query_cls = Qnil;
 VALUE post_query_err = Qnil;
 VALUE post_query_ast_cls = Qnil;
+VALUE post_query_rule_set_cls = Qnil;
+VALUE post_query_query_set_cls = Qnil;
+VALUE post_query_parser_cls = Qnil;
 
 
 /* Ruby type stuff */
+struct ast_object {
+    post_query::ast_ptr root;
+
+    // Native bytes currently reported to Ruby's malloc accounting
+    size_t memsize;
+};
+
 static void ast_free(void* data) {
-    std::unique_ptr<post_query::ast> ptr(static_cast<post_query::ast*>(data));
+    std::unique_ptr<ast_object> ptr(static_cast<ast_object*>(data));
+    rb_gc_adjust_memory_usage(-static_cast<ssize_t>(ptr->memsize));
 
     // Automatically deconstruct and free
 }
 
+static size_t ast_size(const void* data) {
+    return sizeof(ast_object) + static_cast<const ast_object*>(data)->memsize;
+}
+
+// The tree holds no Ruby objects, so there is nothing to mark or move during compaction
+// Frozen trees can't be mutated through any method, so they can be shared between Ractors
 static const rb_data_type_t ast_type {
     .wrap_struct_name = "post_query_ast",
     .function = {
         .dmark = nullptr,
         .dfree = ast_free,
+        .dsize = ast_size,
+    },
+    .flags = RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED | RUBY_TYPED_FROZEN_SHAREABLE,
+};
+
+static VALUE wrap_ast(post_query::ast_ptr ast) {
+    // Wrap first so nothing leaks if allocating the object raises
+    VALUE res = TypedData_Wrap_Struct(post_query_ast_cls, &ast_type, nullptr);
+
+    size_t memsize = ast->memsize();
+    DATA_PTR(res) = new ast_object { std::move(ast), memsize };
+    rb_gc_adjust_memory_usage(static_cast<ssize_t>(memsize));
+
+    return res;
+}
+
+static ast_object* get_ast_object(VALUE self) {
+    ast_object* obj;
+    TypedData_Get_Struct(self, ast_object, &ast_type, obj);
+    return obj;
+}
+
+// For methods that modify the tree in place
+static ast_object* get_mutable_ast_object(VALUE self) {
+    rb_check_frozen(self);
+    return get_ast_object(self);
+}
+
+static post_query::ast* get_ast(VALUE self) {
+    return get_ast_object(self)->root.get();
+}
+
+// Report how much a mutating operation grew or shrunk the tree
+static void update_memsize(ast_object* obj) {
+    size_t memsize = obj->root->memsize();
+    rb_gc_adjust_memory_usage(static_cast<ssize_t>(memsize) - static_cast<ssize_t>(obj->memsize));
+    obj->memsize = memsize;
+}
+
+
+// Rules are only added while initializing, the hit counters are atomic
+static void rule_set_free(void* data) {
+    delete static_cast<post_query::rule_set*>(data);
+}
+
+static const rb_data_type_t rule_set_type {
+    .wrap_struct_name = "post_query_rule_set",
+    .function = {
+        .dmark = nullptr,
+        .dfree = rule_set_free,
+        .dsize = nullptr,
     },
+    .flags = RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED | RUBY_TYPED_FROZEN_SHAREABLE,
 };
 
+static VALUE rule_set_alloc(VALUE klass) {
+    return TypedData_Wrap_Struct(klass, &rule_set_type, new post_query::rule_set {});
+}
+
+static post_query::rule_set* get_rule_set(VALUE self) {
+    post_query::rule_set* rules;
+    TypedData_Get_Struct(self, post_query::rule_set, &rule_set_type, rules);
+    return rules;
+}
+
+
+// Only modified while initializing, matching doesn't touch any state
+static void query_set_free(void* data) {
+    delete static_cast<post_query::query_set*>(data);
+}
+
+static const rb_data_type_t query_set_type {
+    .wrap_struct_name = "post_query_query_set",
+    .function = {
+        .dmark = nullptr,
+        .dfree = query_set_free,
+        .dsize = nullptr,
+    },
+    .flags = RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED | RUBY_TYPED_FROZEN_SHAREABLE,
+};
+
+static VALUE query_set_alloc(VALUE klass) {
+    return TypedData_Wrap_Struct(klass, &query_set_type, new post_query::query_set {});
+}
+
+static post_query::query_set* get_query_set(VALUE self) {
+    post_query::query_set* queries;
+    TypedData_Get_Struct(self, post_query::query_set, &query_set_type, queries);
+    return queries;
+}
+
+
+// Keeps the tokens of the last lookup, so unlike an AST it can't be shared between Ractors
+static void parser_free(void* data) {
+    delete static_cast<post_query::completion_lexer*>(data);
+}
+
+static const rb_data_type_t parser_type {
+    .wrap_struct_name = "post_query_parser",
+    .function = {
+        .dmark = nullptr,
+        .dfree = parser_free,
+        .dsize = nullptr,
+    },
+    .flags = RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED,
+};
+
+static VALUE parser_alloc(VALUE klass) {
+    return TypedData_Wrap_Struct(klass, &parser_type, new post_query::completion_lexer {});
+}
+
+static post_query::completion_lexer* get_parser(VALUE self) {
+    post_query::completion_lexer* lexer;
+    TypedData_Get_Struct(self, post_query::completion_lexer, &parser_type, lexer);
+    return lexer;
+}
+
 
 /* Some utilities */
-static std::string safe_string(VALUE str) {
-    Check_Type(str, T_STRING);
+// The exception safe_string would raise, for callers that must not raise while C++ objects are alive
+static VALUE string_error(VALUE str) {
+    if (!RB_TYPE_P(str, T_STRING)) {
+        return rb_exc_new_str(rb_eTypeError, rb_sprintf("wrong argument type %" PRIsVALUE " (expected String)", rb_obj_class(str)));
+    }
 
     if (int enc = rb_enc_get_index(str); enc != rb_usascii_encindex() && enc != rb_utf8_encindex()) {
-        rb_raise(post_query_cls, "input must be US-ASCII or UTF-8");
+        return rb_exc_new_cstr(post_query_err, "input must be US-ASCII or UTF-8");
     }
 
     if (rb_enc_str_coderange(str) == RUBY_ENC_CODERANGE_BROKEN ) {
-        rb_raise(post_query_cls, "input contains invalid UTF-8");
+        return rb_exc_new_cstr(post_query_err, "input contains invalid UTF-8");
+    }
+
+    return Qnil;
+}
+
+static std::string safe_string(VALUE str) {
+    if (VALUE error = string_error(str); !NIL_P(error)) {
+        rb_exc_raise(error);
     }
 
     // Throws when it encounters a null byte
     return StringValuePtr(str);
 }
 
+// The core reports parser errors as values, the error is created before the result is released
+static post_query::ast_ptr checked_parse(const post_query::parser& parser, std::string_view query) {
+    VALUE error = Qnil;
+
+    {
+        post_query::parse_result res = parser.parse(query);
+        if (res) {
+            return std::move(*res);
+        }
+
+        error = rb_exc_new(post_query_err, res.error().message.data(), res.error().message.size());
+    }
+
+    rb_exc_raise(error);
+}
+
 
 /* Ruby implementations */
-static VALUE post_query_parse(VALUE self, VALUE _input, VALUE _metatags) {
+static VALUE post_query_parse(VALUE self, VALUE _input, VALUE _metatags, VALUE _typed) {
     // Return nil on nil input, kind of safer
     if (NIL_P(_input)) {
         return Qnil;
@@ -58,6 +222,13 @@ static VALUE post_query_parse(VALUE self, VALUE _input, VALUE _metatags) {
     // Surrogate pairs will never overlap as they live in the surrogate range (\uDxxx)
     std::string parser_input = safe_string(_input);
 
+    // Without a list of metatags the built-in registry is used
+    if (NIL_P(_metatags)) {
+        post_query::parser parser { RTEST(_typed) };
+
+        return wrap_ast(checked_parse(parser, parser_input));
+    }
+
     Check_Type(_metatags, T_ARRAY);
     std::vector<std::string> parser_metatags;
     parser_metatags.reserve(rb_array_len(_metatags));
@@ -69,16 +240,125 @@ static VALUE post_query_parse(VALUE self, VALUE _input, VALUE _metatags) {
         parser_metatags.emplace_back(safe_string(tag));
     }
 
-    post_query::parser parser { std::move(parser_metatags) };
+    post_query::parser parser { std::move(parser_metatags), RTEST(_typed) };
+
+    std::unique_ptr<post_query::ast> ast = checked_parse(parser, parser_input);
+
+    return ast ? wrap_ast(std::move(ast)) : Qnil;
+}
+
+static VALUE post_query_metatags(VALUE self) {
+    std::span<const post_query::detail::metatag_key> keys = post_query::builtin_metatag_keys();
+
+    VALUE res = rb_ary_new_capa(keys.size());
+    for (const post_query::detail::metatag_key& key : keys) {
+        rb_ary_push(res, rb_obj_freeze(rb_utf8_str_new(key.key.data(), key.key.size())));
+    }
+
+    return rb_obj_freeze(res);
+}
+
+static VALUE post_query_metatag_info(VALUE self, VALUE _name) {
+    const post_query::metatag_info* info = post_query::find_metatag(safe_string(_name));
+    if (!info) {
+        return Qnil;
+    }
+
+    VALUE synonyms = rb_ary_new();
+    if (!info->synonym.empty()) {
+        rb_ary_push(synonyms, rb_utf8_str_new(info->synonym.data(), info->synonym.size()));
+    }
+
+    VALUE res = rb_hash_new();
+    rb_hash_aset(res, ID2SYM(rb_intern("name")), rb_utf8_str_new(info->name.data(), info->name.size()));
+    rb_hash_aset(res, ID2SYM(rb_intern("synonyms")), synonyms);
+    rb_hash_aset(res, ID2SYM(rb_intern("type")), info->type ? ID2SYM(rb_intern(post_query::value_type_name(*info->type).data())) : Qnil);
+    rb_hash_aset(res, ID2SYM(rb_intern("single_valued")), info->single_valued ? Qtrue : Qfalse);
+    rb_hash_aset(res, ID2SYM(rb_intern("orderable")), info->orderable ? Qtrue : Qfalse);
+    return res;
+}
+
+static int collect_alias(VALUE key, VALUE value, VALUE arg) {
+    auto& aliases = *reinterpret_cast<std::vector<std::pair<std::string, std::string>>*>(arg);
+
+    // Tags are stored lowercase
+    std::string antecedent = safe_string(key);
+    std::ranges::transform(antecedent, antecedent.begin(), [](unsigned char ch) { return std::tolower(ch); });
+
+    std::string consequent = safe_string(value);
+    std::ranges::transform(consequent, consequent.begin(), [](unsigned char ch) { return std::tolower(ch); });
+
+    aliases.emplace_back(std::move(antecedent), std::move(consequent));
+    return ST_CONTINUE;
+}
+
+static VALUE post_query_load_aliases(VALUE self, VALUE _aliases) {
+    Check_Type(_aliases, T_HASH);
+
+    std::vector<std::pair<std::string, std::string>> aliases;
+    aliases.reserve(RHASH_SIZE(_aliases));
+    rb_hash_foreach(_aliases, collect_alias, reinterpret_cast<VALUE>(&aliases));
+
+    // Build the new table fully before swapping it in, readers keep their current snapshot
+    auto table = std::make_shared<const post_query::alias_table>(aliases);
+    size_t size = table->size();
+    post_query::alias_registry::global().store(std::move(table));
+
+    return SIZET2NUM(size);
+}
+
+static VALUE post_query_stats(VALUE self) {
+    post_query::stats_snapshot stats = post_query::query_stats::global().snapshot();
+
+    VALUE phases = rb_hash_new();
+    for (size_t i = 0; i < stats.phases.size(); ++i) {
+        const post_query::phase_snapshot& phase = stats.phases[i];
+
+        // Keyed by the exclusive upper bound of each bucket, empty buckets are left out
+        VALUE histogram = rb_hash_new();
+        for (size_t j = 0; j < phase.buckets.size(); ++j) {
+            if (phase.buckets[j] != 0) {
+                rb_hash_aset(histogram, ULL2NUM(uint64_t(1) << j), ULL2NUM(phase.buckets[j]));
+            }
+        }
+
+        VALUE entry = rb_hash_new();
+        rb_hash_aset(entry, ID2SYM(rb_intern("count")), ULL2NUM(phase.count));
+        rb_hash_aset(entry, ID2SYM(rb_intern("total_ns")), ULL2NUM(phase.total_ns));
+        rb_hash_aset(entry, ID2SYM(rb_intern("histogram")), histogram);
+        rb_hash_aset(phases, ID2SYM(rb_intern(post_query::phase_names[i].data())), entry);
+    }
+
+    VALUE counters = rb_hash_new();
+    for (size_t i = 0; i < stats.counters.size(); ++i) {
+        rb_hash_aset(counters, ID2SYM(rb_intern(post_query::counter_names[i].data())), ULL2NUM(stats.counters[i]));
+    }
+
+    VALUE res = rb_hash_new();
+    rb_hash_aset(res, ID2SYM(rb_intern("enabled")), stats.enabled ? Qtrue : Qfalse);
+    rb_hash_aset(res, ID2SYM(rb_intern("phases")), phases);
+    rb_hash_aset(res, ID2SYM(rb_intern("counters")), counters);
+    return res;
+}
+
+static VALUE post_query_reset_stats(VALUE self) {
+    post_query::query_stats::global().reset();
 
-    std::unique_ptr<post_query::ast> ast = parser.parse(parser_input);
+    return Qnil;
+}
+
+static VALUE post_query_set_stats_enabled(VALUE self, VALUE _enabled) {
+    post_query::query_stats::global().set_enabled(RTEST(_enabled));
+
+    return _enabled;
+}
 
-    return ast ? TypedData_Wrap_Struct(post_query_ast_cls, &ast_type, ast.release()) : Qnil;
+static VALUE post_query_stats_enabled(VALUE self) {
+    return post_query::query_stats::global().enabled() ? Qtrue : Qfalse;
 }
 
 static VALUE post_query_ast_inspect(VALUE self) {
-    post_query::ast* ast;
-    TypedData_Get_Struct(self, post_query::ast, &ast_type, ast);
+    post_query::ast* ast = get_ast(self);
 
     std::string_view node_type = "Unknown";
     switch (ast->type()) {
@@ -105,40 +385,680 @@ static VALUE post_query_ast_inspect(VALUE self) {
 }
 
 static VALUE post_query_ast_to_s(VALUE self) {
-    post_query::ast* ast;
-    TypedData_Get_Struct(self, post_query::ast, &ast_type, ast);
+    post_query::ast* ast = get_ast(self);
 
     return rb_external_str_new_cstr(ast->to_infix().c_str());
 }
 
 static VALUE post_query_ast_to_sexp(VALUE self) {
-    post_query::ast* ast;
-    TypedData_Get_Struct(self, post_query::ast, &ast_type, ast);
+    post_query::ast* ast = get_ast(self);
 
     return rb_external_str_new_cstr(ast->to_sexp().c_str());
 }
 
 static VALUE post_query_ast_to_infix(VALUE self) {
-    post_query::ast* ast;
-    TypedData_Get_Struct(self, post_query::ast, &ast_type, ast);
+    post_query::ast* ast = get_ast(self);
 
     return rb_external_str_new_cstr(ast->to_infix().c_str());
 }
 
+// Accepts the generator state the json gem passes, so ASTs can be nested in other objects given to JSON.generate
+static VALUE post_query_ast_to_json(int argc, VALUE* argv, VALUE self) {
+    rb_check_arity(argc, 0, 1);
+    post_query::ast* ast = get_ast(self);
+
+    // Written straight into the string's own buffer
+    VALUE res = Qnil;
+    ast->to_json([&res](size_t size) {
+        res = rb_utf8_str_new(nullptr, size);
+        return RSTRING_PTR(res);
+    });
+
+    return res;
+}
+
+// Keys and type names of AST#to_h, interned once so every hash shares the same frozen strings
+enum class ast_hash_key { Type, Name, Value, Quoted, Children };
+static VALUE ast_hash_keys[5];
+static VALUE ast_hash_types[post_query::node_type_names.size()];
+
+static VALUE interned_utf8_str(std::string_view str) {
+    VALUE res = rb_enc_interned_str(str.data(), str.size(), rb_utf8_encoding());
+    rb_gc_register_mark_object(res);
+    return res;
+}
+
+static VALUE post_query_ast_to_h(VALUE self) {
+    post_query::ast* ast = get_ast(self);
+    auto key = [](ast_hash_key k) { return ast_hash_keys[static_cast<int>(k)]; };
+
+    // Every hash is added to its parent's children as soon as it's created, so all of them stay reachable from the root
+    VALUE root = Qnil;
+    std::vector<std::pair<const post_query::ast*, VALUE>> pending { { ast, Qnil } };
+    while (!pending.empty()) {
+        auto [node, parent] = pending.back();
+        pending.pop_back();
+
+        VALUE hash = rb_hash_new_capa(4);
+        rb_hash_aset(hash, key(ast_hash_key::Type), ast_hash_types[static_cast<int>(node->type())]);
+        if (NIL_P(parent)) {
+            root = hash;
+        } else {
+            rb_ary_push(parent, hash);
+        }
+
+        switch (node->type()) {
+            case post_query::node_type::Tag:
+            case post_query::node_type::Wildcard:
+                rb_hash_aset(hash, key(ast_hash_key::Name), rb_utf8_str_new(node->name().data(), node->name().size()));
+                break;
+
+            case post_query::node_type::Metatag: {
+                const post_query::metatag_data& data = node->metatag();
+                rb_hash_aset(hash, key(ast_hash_key::Name), rb_utf8_str_new(data.name.data(), data.name.size()));
+                rb_hash_aset(hash, key(ast_hash_key::Value), rb_utf8_str_new(data.value.data(), data.value.size()));
+                rb_hash_aset(hash, key(ast_hash_key::Quoted), data.quoted ? Qtrue : Qfalse);
+                break;
+            }
+
+            case post_query::node_type::Not:
+            case post_query::node_type::Opt:
+            case post_query::node_type::And:
+            case post_query::node_type::Or: {
+                std::span<const post_query::ast_ptr> children = node->children();
+                VALUE array = rb_ary_new_capa(children.size());
+                rb_hash_aset(hash, key(ast_hash_key::Children), array);
+
+                for (auto it = children.rbegin(); it != children.rend(); ++it) {
+                    pending.emplace_back(it->get(), array);
+                }
+                break;
+            }
+
+            default:
+                break;
+        }
+    }
+
+    RB_GC_GUARD(root);
+    return root;
+}
+
+static VALUE post_query_ast_fingerprint(VALUE self) {
+    post_query::ast* ast = get_ast(self);
+
+    std::string res = ast->fingerprint().to_string();
+    return rb_usascii_str_new(res.data(), res.size());
+}
+
+// Both trees are compared in CNF, neither receiver nor argument is converted
+static VALUE post_query_ast_subsumed_by(VALUE self, VALUE _other) {
+    post_query::ast_ptr lhs = get_ast(self)->copy();
+    post_query::ast_ptr rhs = get_ast(_other)->copy();
+    lhs->to_cnf();
+    rhs->to_cnf();
+
+    return post_query::containment::subsumed_by(lhs, rhs) ? Qtrue : Qfalse;
+}
+
+static VALUE post_query_ast_equivalent(VALUE self, VALUE _other) {
+    post_query::ast_ptr lhs = get_ast(self)->copy();
+    post_query::ast_ptr rhs = get_ast(_other)->copy();
+    lhs->to_cnf();
+    rhs->to_cnf();
+
+    return post_query::containment::equivalent(lhs, rhs) ? Qtrue : Qfalse;
+}
+
 static VALUE post_query_ast_to_cnf(VALUE self) {
-    post_query::ast* ast;
-    TypedData_Get_Struct(self, post_query::ast, &ast_type, ast);
+    ast_object* obj = get_mutable_ast_object(self);
+
+    obj->root->to_cnf();
+    update_memsize(obj);
+
+    return self;
+}
+
+static VALUE post_query_ast_to_dnf(VALUE self) {
+    ast_object* obj = get_mutable_ast_object(self);
+
+    obj->root->to_dnf();
+    update_memsize(obj);
+
+    return self;
+}
+
+static VALUE post_query_ast_to_nnf(VALUE self) {
+    ast_object* obj = get_mutable_ast_object(self);
+
+    obj->root->to_nnf();
+    update_memsize(obj);
+
+    return self;
+}
+
+// Returns the form that was chosen
+static VALUE post_query_ast_to_best_form(VALUE self, VALUE _max_nodes) {
+    size_t max_nodes = NUM2SIZET(_max_nodes);
+    ast_object* obj = get_mutable_ast_object(self);
+
+    post_query::normal_form form = obj->root->to_best_form(max_nodes);
+    update_memsize(obj);
+
+    return ID2SYM(rb_intern(post_query::normal_form_name(form).data()));
+}
+
+static VALUE post_query_ast_normalize_aliases(VALUE self) {
+    ast_object* obj = get_mutable_ast_object(self);
+
+    std::shared_ptr<const post_query::alias_table> aliases = post_query::alias_registry::global().load();
+    obj->root->normalize_aliases(*aliases);
+    update_memsize(obj);
+
+    return self;
+}
+
+static VALUE post_query_ast_prune_ranges(VALUE self) {
+    ast_object* obj = get_mutable_ast_object(self);
+
+    obj->root->prune_ranges();
+    update_memsize(obj);
+
+    return self;
+}
+
+static VALUE post_query_ast_factor(VALUE self) {
+    ast_object* obj = get_mutable_ast_object(self);
+
+    obj->root->factor();
+    update_memsize(obj);
+
+    return self;
+}
+
+// Facts collected by rb_hash_foreach, the first error stops the iteration and is raised by the caller
+// once the fact_set is destroyed, raising from the callback would skip its destructor
+struct fact_args {
+    post_query::fact_set facts;
+    VALUE error = Qnil;
+};
+
+static VALUE add_fact(post_query::fact_set& facts, VALUE key, VALUE value) {
+    if (VALUE error = string_error(key); !NIL_P(error)) {
+        return error;
+    } else if (RB_TYPE_P(value, T_STRING) && !NIL_P(error = string_error(value))) {
+        return error;
+    }
+
+    std::string name = safe_string(key);
+    std::ranges::transform(name, name.begin(), [](unsigned char ch) { return std::tolower(ch); });
+
+    // Metatag names and synonyms, anything else is a tag
+    if (auto metatag = post_query::find_metatag_key(name)) {
+        std::string canonical { post_query::find_metatag(*metatag)->name };
+
+        if (value == Qtrue || value == Qfalse) {
+            facts.set_metatag(std::move(canonical), RTEST(value));
+        } else if (RB_TYPE_P(value, T_STRING)) {
+            facts.set_metatag(std::move(canonical), safe_string(value));
+        } else if (RB_INTEGER_TYPE_P(value) || RB_FLOAT_TYPE_P(value)) {
+            facts.set_metatag(std::move(canonical), NUM2DBL(value));
+        } else {
+            return rb_exc_new_str(rb_eTypeError, rb_sprintf("fact for metatag %s must be true, false, a String or a Numeric", canonical.c_str()));
+        }
+    } else if (value == Qtrue || value == Qfalse) {
+        facts.set_tag(std::move(name), RTEST(value));
+    } else {
+        return rb_exc_new_str(rb_eTypeError, rb_sprintf("fact for tag %s must be true or false", name.c_str()));
+    }
+
+    return Qnil;
+}
+
+static int collect_fact(VALUE key, VALUE value, VALUE arg) {
+    auto& args = *reinterpret_cast<fact_args*>(arg);
+
+    args.error = add_fact(args.facts, key, value);
+    return NIL_P(args.error) ? ST_CONTINUE : ST_STOP;
+}
+
+static VALUE post_query_ast_specialize(VALUE self, VALUE _facts) {
+    ast_object* obj = get_mutable_ast_object(self);
+
+    Check_Type(_facts, T_HASH);
+
+    VALUE error = Qnil;
+    {
+        fact_args args;
+        rb_hash_foreach(_facts, collect_fact, reinterpret_cast<VALUE>(&args));
+
+        if (NIL_P(args.error)) {
+            obj->root->specialize(args.facts);
+            update_memsize(obj);
+        }
+
+        error = args.error;
+    }
+
+    if (!NIL_P(error)) {
+        rb_exc_raise(error);
+    }
+
+    return self;
+}
+
+static VALUE post_query_ast_apply_rules(VALUE self, VALUE _rules, VALUE _max_rewrites) {
+    ast_object* obj = get_mutable_ast_object(self);
+    const post_query::rule_set* rules = get_rule_set(_rules);
+
+    size_t max_rewrites = NUM2SIZET(_max_rewrites);
+
+    // Rewrite a copy so that the tree is left untouched when the rules don't terminate
+    VALUE error = Qnil;
+    {
+        post_query::ast_ptr res = obj->root->copy();
+        if (auto rewrites = rules->apply(*res, max_rewrites); !rewrites) {
+            error = rb_exc_new(post_query_err, rewrites.error().data(), rewrites.error().size());
+        } else {
+            obj->root = std::move(res);
+        }
+    }
+
+    // Raise only after all native memory was released
+    if (!NIL_P(error)) {
+        rb_exc_raise(error);
+    }
+
+    update_memsize(obj);
+
+    return self;
+}
+
+static int collect_double(VALUE key, VALUE value, VALUE arg) {
+    auto& res = *reinterpret_cast<std::unordered_map<std::string, double>*>(arg);
+    res.emplace(safe_string(key), NUM2DBL(value));
+    return ST_CONTINUE;
+}
+
+static VALUE post_query_ast_plan(VALUE self, VALUE _tag_counts, VALUE _metatag_costs, VALUE _total_posts) {
+    post_query::ast* ast = get_ast(self);
+
+    Check_Type(_tag_counts, T_HASH);
+    Check_Type(_metatag_costs, T_HASH);
+
+    post_query::plan_statistics stats;
+    stats.total_posts = NUM2DBL(_total_posts);
+    stats.tag_counts.reserve(RHASH_SIZE(_tag_counts));
+    rb_hash_foreach(_tag_counts, collect_double, reinterpret_cast<VALUE>(&stats.tag_counts));
+    rb_hash_foreach(_metatag_costs, collect_double, reinterpret_cast<VALUE>(&stats.metatag_costs));
+
+    // Plan on a normalized copy, the receiver keeps its canonical form
+    post_query::ast_ptr cnf = ast->copy();
+    cnf->to_cnf();
+
+    post_query::execution_plan plan = post_query::planner { stats }.plan(*cnf);
+
+    VALUE res = rb_ary_new_capa(plan.clauses.size());
+    for (size_t i = 0; i < plan.clauses.size(); ++i) {
+        post_query::plan_clause& clause = plan.clauses[i];
+
+        VALUE entry = rb_hash_new();
+        rb_hash_aset(entry, ID2SYM(rb_intern("clause")), wrap_ast(std::move(clause.clause)));
+        rb_hash_aset(entry, ID2SYM(rb_intern("cardinality")), DBL2NUM(clause.cardinality));
+        rb_hash_aset(entry, ID2SYM(rb_intern("cost")), DBL2NUM(clause.cost));
+        rb_hash_aset(entry, ID2SYM(rb_intern("driving")), (plan.driving == i) ? Qtrue : Qfalse);
+        rb_ary_push(res, entry);
+    }
+
+    return res;
+}
+
+static VALUE post_query_ast_type(VALUE self) {
+    post_query::ast* ast = get_ast(self);
+
+    return ID2SYM(rb_intern(post_query::node_type_name(ast->type()).data()));
+}
+
+static VALUE post_query_ast_children(VALUE self) {
+    post_query::ast* ast = get_ast(self);
+
+    // Children are returned as independent copies, the tree is owned by its root
+    std::span<const post_query::ast_ptr> children = ast->children();
+    VALUE res = rb_ary_new_capa(children.size());
+    for (const post_query::ast_ptr& child : children) {
+        rb_ary_push(res, wrap_ast(child->copy()));
+    }
+
+    return res;
+}
+
+static VALUE post_query_ast_name(VALUE self) {
+    post_query::ast* ast = get_ast(self);
+
+    switch (ast->type()) {
+        case post_query::node_type::Tag:
+        case post_query::node_type::Wildcard:
+            return rb_utf8_str_new(ast->name().data(), ast->name().size());
+
+        case post_query::node_type::Metatag:
+            return rb_utf8_str_new(ast->metatag().name.data(), ast->metatag().name.size());
+
+        default:
+            return Qnil;
+    }
+}
+
+static VALUE post_query_ast_value(VALUE self) {
+    post_query::ast* ast = get_ast(self);
+
+    if (ast->type() != post_query::node_type::Metatag) {
+        return Qnil;
+    }
+
+    return rb_utf8_str_new(ast->metatag().value.data(), ast->metatag().value.size());
+}
+
+static VALUE post_query_ast_quoted(VALUE self) {
+    post_query::ast* ast = get_ast(self);
+
+    return (ast->type() == post_query::node_type::Metatag && ast->metatag().quoted) ? Qtrue : Qfalse;
+}
+
+static VALUE typed_bound_value(post_query::value_type type, double value) {
+    switch (type) {
+        case post_query::value_type::Integer:
+        case post_query::value_type::Size:
+            return LL2NUM(static_cast<long long>(value));
+
+        case post_query::value_type::Date:
+            // Midnight UTC of that day
+            return rb_funcall(rb_time_new(static_cast<time_t>(value) * 86400, 0), rb_intern("utc"), 0);
+
+        default:
+            return DBL2NUM(value);
+    }
+}
+
+static VALUE post_query_ast_typed_value(VALUE self) {
+    post_query::ast* ast = get_ast(self);
+
+    if (ast->type() != post_query::node_type::Metatag || !ast->metatag().typed) {
+        return Qnil;
+    }
+
+    const post_query::typed_value_result& typed = *ast->metatag().typed;
 
-    ast->to_cnf();
+    VALUE res = rb_hash_new();
+    if (!typed) {
+        rb_hash_aset(res, ID2SYM(rb_intern("error")), rb_utf8_str_new(typed.error().data(), typed.error().size()));
+        return res;
+    }
+
+    rb_hash_aset(res, ID2SYM(rb_intern("type")), ID2SYM(rb_intern(post_query::value_type_name(typed->type).data())));
+
+    VALUE ranges = rb_ary_new_capa(typed->ranges.size());
+    for (const post_query::value_range& range : typed->ranges) {
+        VALUE entry = rb_hash_new();
+        rb_hash_aset(entry, ID2SYM(rb_intern("min")), range.min ? typed_bound_value(typed->type, *range.min) : Qnil);
+        rb_hash_aset(entry, ID2SYM(rb_intern("max")), range.max ? typed_bound_value(typed->type, *range.max) : Qnil);
+        rb_hash_aset(entry, ID2SYM(rb_intern("min_inclusive")), range.min_inclusive ? Qtrue : Qfalse);
+        rb_hash_aset(entry, ID2SYM(rb_intern("max_inclusive")), range.max_inclusive ? Qtrue : Qfalse);
+        rb_ary_push(ranges, entry);
+    }
+
+    rb_hash_aset(res, ID2SYM(rb_intern("ranges")), ranges);
+    return res;
+}
+
+static VALUE post_query_rule_set_initialize(VALUE self, VALUE _rules, VALUE _metatags) {
+    rb_check_frozen(self);
+    post_query::rule_set* rules = get_rule_set(self);
+
+    // Every Ruby argument is checked before any C++ object exists, errors after that are raised once they're destroyed
+    Check_Type(_rules, T_ARRAY);
+    for (long i = 0; i < rb_array_len(_rules); ++i) {
+        VALUE pair = rb_ary_entry(_rules, i);
+        Check_Type(pair, T_ARRAY);
+        if (rb_array_len(pair) != 2) {
+            rb_raise(rb_eArgError, "rules must be pattern and replacement pairs");
+        }
+
+        for (long j = 0; j < 2; ++j) {
+            if (VALUE error = string_error(rb_ary_entry(pair, j)); !NIL_P(error)) {
+                rb_exc_raise(error);
+            }
+        }
+    }
+
+    if (!NIL_P(_metatags)) {
+        Check_Type(_metatags, T_ARRAY);
+        for (long i = 0; i < rb_array_len(_metatags); ++i) {
+            if (VALUE error = string_error(rb_ary_entry(_metatags, i)); !NIL_P(error)) {
+                rb_exc_raise(error);
+            }
+        }
+    }
+
+    VALUE error = Qnil;
+    {
+        std::optional<std::vector<std::string>> metatags;
+        if (!NIL_P(_metatags)) {
+            metatags.emplace();
+            for (long i = 0; i < rb_array_len(_metatags); ++i) {
+                metatags->emplace_back(safe_string(rb_ary_entry(_metatags, i)));
+            }
+        }
+
+        post_query::parser parser = metatags ? post_query::parser { std::move(*metatags) } : post_query::parser {};
+
+        for (long i = 0; i < rb_array_len(_rules) && NIL_P(error); ++i) {
+            VALUE pair = rb_ary_entry(_rules, i);
+
+            std::string pattern = safe_string(rb_ary_entry(pair, 0));
+            post_query::parse_result pattern_ast = parser.parse(pattern);
+            post_query::parse_result replacement_ast = parser.parse(safe_string(rb_ary_entry(pair, 1)));
+
+            if (!pattern_ast || !replacement_ast) {
+                const std::string& message = (pattern_ast ? replacement_ast : pattern_ast).error().message;
+                error = rb_exc_new(post_query_err, message.data(), message.size());
+            } else if (auto added = rules->add(std::move(pattern), **pattern_ast, **replacement_ast); !added) {
+                error = rb_exc_new(post_query_err, added.error().data(), added.error().size());
+            }
+        }
+    }
+
+    if (!NIL_P(error)) {
+        rb_exc_raise(error);
+    }
+
+    return self;
+}
+
+static VALUE post_query_rule_set_size(VALUE self) {
+    return SIZET2NUM(get_rule_set(self)->size());
+}
+
+static VALUE post_query_rule_set_hits(VALUE self) {
+    const post_query::rule_set* rules = get_rule_set(self);
+
+    VALUE res = rb_hash_new();
+    for (size_t i = 0; i < rules->size(); ++i) {
+        const std::string& pattern = rules->pattern(i);
+        rb_hash_aset(res, rb_utf8_str_new(pattern.data(), pattern.size()), ULL2NUM(rules->hits(i)));
+    }
+
+    return res;
+}
+
+static VALUE post_query_rule_set_reset_hits(VALUE self) {
+    get_rule_set(self)->reset_hits();
+    return Qnil;
+}
+
+// Queries are either strings or already parsed ASTs, which are copied
+static VALUE post_query_query_set_initialize(VALUE self, VALUE _queries, VALUE _metatags) {
+    rb_check_frozen(self);
+    post_query::query_set* queries = get_query_set(self);
+
+    Check_Type(_queries, T_ARRAY);
+
+    std::optional<std::vector<std::string>> metatags;
+    if (!NIL_P(_metatags)) {
+        Check_Type(_metatags, T_ARRAY);
+        metatags.emplace();
+        for (long i = 0; i < rb_array_len(_metatags); ++i) {
+            metatags->emplace_back(safe_string(rb_ary_entry(_metatags, i)));
+        }
+    }
+
+    post_query::parser parser = metatags ? post_query::parser { std::move(*metatags) } : post_query::parser {};
+
+    for (long i = 0; i < rb_array_len(_queries); ++i) {
+        VALUE query = rb_ary_entry(_queries, i);
+
+        post_query::ast_ptr ast = rb_typeddata_is_kind_of(query, &ast_type)
+            ? get_ast(query)->copy()
+            : checked_parse(parser, safe_string(query));
+        queries->add(*ast);
+    }
 
     return self;
 }
 
+static VALUE post_query_query_set_size(VALUE self) {
+    return SIZET2NUM(get_query_set(self)->size());
+}
+
+static VALUE post_query_query_set_literal_count(VALUE self) {
+    return SIZET2NUM(get_query_set(self)->literal_count());
+}
+
+static VALUE post_query_query_set_match(VALUE self, VALUE _tags, VALUE _facts) {
+    const post_query::query_set* queries = get_query_set(self);
+
+    Check_Type(_tags, T_ARRAY);
+    Check_Type(_facts, T_HASH);
+
+    VALUE res = Qnil;
+    VALUE error = Qnil;
+    {
+        // Lowercase like the tags of a query, see ast::make_tag
+        std::vector<std::string> tags;
+        tags.reserve(rb_array_len(_tags));
+        for (long i = 0; i < rb_array_len(_tags) && NIL_P(error); ++i) {
+            VALUE tag = rb_ary_entry(_tags, i);
+            if (error = string_error(tag); NIL_P(error)) {
+                std::string& added = tags.emplace_back(safe_string(tag));
+                std::ranges::transform(added, added.begin(), [](unsigned char ch) { return std::tolower(ch); });
+            }
+        }
+
+        fact_args args;
+        if (NIL_P(error)) {
+            rb_hash_foreach(_facts, collect_fact, reinterpret_cast<VALUE>(&args));
+            error = args.error;
+        }
+
+        if (NIL_P(error)) {
+            // Tag facts add or remove tags of the post
+            for (const auto& [tag, truth] : args.facts.tags()) {
+                std::erase(tags, tag);
+                if (truth) {
+                    tags.push_back(tag);
+                }
+            }
+
+            std::vector<std::string_view> views { tags.begin(), tags.end() };
+            std::vector<size_t> matches = queries->match(views, args.facts);
+
+            res = rb_ary_new_capa(matches.size());
+            for (size_t index : matches) {
+                rb_ary_push(res, SIZET2NUM(index));
+            }
+        }
+    }
+
+    if (!NIL_P(error)) {
+        rb_exc_raise(error);
+    }
+
+    return res;
+}
+
+static VALUE post_query_parser_initialize(VALUE self, VALUE _metatags) {
+    std::optional<std::vector<std::string>> metatags;
+    if (!NIL_P(_metatags)) {
+        Check_Type(_metatags, T_ARRAY);
+        metatags.emplace();
+        for (long i = 0; i < rb_array_len(_metatags); ++i) {
+            metatags->emplace_back(safe_string(rb_ary_entry(_metatags, i)));
+        }
+    }
+
+    *get_parser(self) = post_query::completion_lexer { std::move(metatags) };
+    return self;
+}
+
+static VALUE token_kind_symbol(post_query::token_kind kind) {
+    return ID2SYM(rb_intern(post_query::token_kind_name(kind).data()));
+}
+
+static VALUE post_query_parser_token_at(VALUE self, VALUE _query, VALUE _offset) {
+    post_query::completion_lexer* lexer = get_parser(self);
+    std::string query = safe_string(_query);
+
+    long offset = NUM2LONG(_offset);
+    if (offset < 0 || static_cast<size_t>(offset) > query.size()) {
+        rb_raise(rb_eIndexError, "offset %ld outside of query", offset);
+    }
+
+    std::optional<post_query::cursor_token> res = lexer->token_at(query, offset);
+    if (!res) {
+        return Qnil;
+    }
+
+    const post_query::token& tok = res->tok;
+    VALUE hash = rb_hash_new();
+    rb_hash_aset(hash, ID2SYM(rb_intern("kind")), token_kind_symbol(tok.kind));
+    rb_hash_aset(hash, ID2SYM(rb_intern("begin")), SIZET2NUM(tok.begin));
+    rb_hash_aset(hash, ID2SYM(rb_intern("end")), SIZET2NUM(tok.end));
+    rb_hash_aset(hash, ID2SYM(rb_intern("text")), rb_utf8_str_new(query.data() + tok.begin, tok.end - tok.begin));
+
+    if (tok.kind == post_query::token_kind::Metatag) {
+        // Name and colon are spelled the same as in the metatag list, apart from case
+        bool in_name = static_cast<size_t>(offset) <= tok.begin + tok.text.size();
+        rb_hash_aset(hash, ID2SYM(rb_intern("name")), rb_utf8_str_new(tok.text.data(), tok.text.size()));
+        rb_hash_aset(hash, ID2SYM(rb_intern("value")), rb_utf8_str_new(tok.value.data(), tok.value.size()));
+        rb_hash_aset(hash, ID2SYM(rb_intern("part")), ID2SYM(rb_intern(in_name ? "name" : "value")));
+    }
+
+    rb_hash_aset(hash, ID2SYM(rb_intern("depth")), SSIZET2NUM(res->depth));
+    rb_hash_aset(hash, ID2SYM(rb_intern("prefix")), res->prefix ? token_kind_symbol(*res->prefix) : Qnil);
+    rb_hash_aset(hash, ID2SYM(rb_intern("operator")), ID2SYM(rb_intern(res->in_or ? "or" : "and")));
+    return hash;
+}
+
+static VALUE post_query_parser_reused_tokens(VALUE self) {
+    return SIZET2NUM(get_parser(self)->reused());
+}
+
 /* Module initializer */
 extern "C" void Init_post_query() {
+#ifdef HAVE_RB_EXT_RACTOR_SAFE
+    // All native state is either immutable or behind atomics, see alias_registry and query_stats
+    rb_ext_ractor_safe(true);
+#endif
+
     post_query_cls = rb_define_class("PostQuery", rb_cObject);
     post_query_err = rb_define_class_under(post_query_cls, "Error", rb_eStandardError);
-    rb_define_singleton_method(post_query_cls, "parse_raw", post_query_parse, 2);
+    rb_define_singleton_method(post_query_cls, "parse_raw", post_query_parse, 3);
+    rb_define_singleton_method(post_query_cls, "load_aliases", post_query_load_aliases, 1);
+    rb_define_singleton_method(post_query_cls, "metatags", post_query_metatags, 0);
+    rb_define_singleton_method(post_query_cls, "metatag_info", post_query_metatag_info, 1);
+    rb_define_singleton_method(post_query_cls, "stats", post_query_stats, 0);
+    rb_define_singleton_method(post_query_cls, "reset_stats", post_query_reset_stats, 0);
+    rb_define_singleton_method(post_query_cls, "stats_enabled=", post_query_set_stats_enabled, 1);
+    rb_define_singleton_method(post_query_cls, "stats_enabled?", post_query_stats_enabled, 0);
 
     // No alloc function, only create it internally
     post_query_ast_cls = rb_define_class_under(post_query_cls, "AST", rb_cObject);
@@ -148,5 +1068,55 @@ extern "C" void Init_post_query() {
     rb_define_method(post_query_ast_cls, "to_s", post_query_ast_to_s, 0);
     rb_define_method(post_query_ast_cls, "to_sexp", post_query_ast_to_sexp, 0);
     rb_define_method(post_query_ast_cls, "to_infix", post_query_ast_to_infix, 0);
+    rb_define_method(post_query_ast_cls, "to_json", post_query_ast_to_json, -1);
+    rb_define_method(post_query_ast_cls, "to_h", post_query_ast_to_h, 0);
     rb_define_method(post_query_ast_cls, "to_cnf", post_query_ast_to_cnf, 0);
+    rb_define_method(post_query_ast_cls, "to_dnf", post_query_ast_to_dnf, 0);
+    rb_define_method(post_query_ast_cls, "to_nnf", post_query_ast_to_nnf, 0);
+    rb_define_method(post_query_ast_cls, "to_best_form_raw", post_query_ast_to_best_form, 1);
+    rb_define_method(post_query_ast_cls, "fingerprint", post_query_ast_fingerprint, 0);
+    rb_define_method(post_query_ast_cls, "subsumed_by?", post_query_ast_subsumed_by, 1);
+    rb_define_method(post_query_ast_cls, "equivalent?", post_query_ast_equivalent, 1);
+    rb_define_method(post_query_ast_cls, "normalize_aliases", post_query_ast_normalize_aliases, 0);
+    rb_define_method(post_query_ast_cls, "prune_ranges", post_query_ast_prune_ranges, 0);
+    rb_define_method(post_query_ast_cls, "factor", post_query_ast_factor, 0);
+    rb_define_method(post_query_ast_cls, "specialize", post_query_ast_specialize, 1);
+    rb_define_method(post_query_ast_cls, "apply_rules_raw", post_query_ast_apply_rules, 2);
+    rb_define_method(post_query_ast_cls, "plan_raw", post_query_ast_plan, 3);
+
+    rb_define_method(post_query_ast_cls, "type", post_query_ast_type, 0);
+    rb_define_method(post_query_ast_cls, "children", post_query_ast_children, 0);
+    rb_define_method(post_query_ast_cls, "name", post_query_ast_name, 0);
+    rb_define_method(post_query_ast_cls, "value", post_query_ast_value, 0);
+    rb_define_method(post_query_ast_cls, "quoted?", post_query_ast_quoted, 0);
+    rb_define_method(post_query_ast_cls, "typed_value", post_query_ast_typed_value, 0);
+
+    ast_hash_keys[static_cast<int>(ast_hash_key::Type)] = interned_utf8_str("type");
+    ast_hash_keys[static_cast<int>(ast_hash_key::Name)] = interned_utf8_str("name");
+    ast_hash_keys[static_cast<int>(ast_hash_key::Value)] = interned_utf8_str("value");
+    ast_hash_keys[static_cast<int>(ast_hash_key::Quoted)] = interned_utf8_str("quoted");
+    ast_hash_keys[static_cast<int>(ast_hash_key::Children)] = interned_utf8_str("children");
+    for (size_t i = 0; i < post_query::node_type_names.size(); ++i) {
+        ast_hash_types[i] = interned_utf8_str(post_query::node_type_names[i]);
+    }
+
+    post_query_rule_set_cls = rb_define_class_under(post_query_cls, "RuleSet", rb_cObject);
+    rb_define_alloc_func(post_query_rule_set_cls, rule_set_alloc);
+    rb_define_method(post_query_rule_set_cls, "initialize_raw", post_query_rule_set_initialize, 2);
+    rb_define_method(post_query_rule_set_cls, "size", post_query_rule_set_size, 0);
+    rb_define_method(post_query_rule_set_cls, "hits", post_query_rule_set_hits, 0);
+    rb_define_method(post_query_rule_set_cls, "reset_hits", post_query_rule_set_reset_hits, 0);
+
+    post_query_query_set_cls = rb_define_class_under(post_query_cls, "QuerySet", rb_cObject);
+    rb_define_alloc_func(post_query_query_set_cls, query_set_alloc);
+    rb_define_method(post_query_query_set_cls, "initialize_raw", post_query_query_set_initialize, 2);
+    rb_define_method(post_query_query_set_cls, "size", post_query_query_set_size, 0);
+    rb_define_method(post_query_query_set_cls, "literal_count", post_query_query_set_literal_count, 0);
+    rb_define_method(post_query_query_set_cls, "match_raw", post_query_query_set_match, 2);
+
+    post_query_parser_cls = rb_define_class_under(post_query_cls, "Parser", rb_cObject);
+    rb_define_alloc_func(post_query_parser_cls, parser_alloc);
+    rb_define_method(post_query_parser_cls, "initialize_raw", post_query_parser_initialize, 1);
+    rb_define_method(post_query_parser_cls, "token_at", post_query_parser_token_at, 2);
+    rb_define_method(post_query_parser_cls, "reused_tokens", post_query_parser_reused_tokens, 0);
 }
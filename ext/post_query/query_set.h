@@ -0,0 +1,317 @@
+#ifndef QUERY_SET_H
+#define QUERY_SET_H
+
+// Matches posts against many queries at once, e.g. every line of a user's blacklist
+// The queries are compiled to CNF clauses over one table of their distinct literals, which are evaluated at most once per post
+// into a bitset, a clause holds when its literal bits intersect the post's
+// A Bloom filter of the post's tags rules out queries missing one of their required tags before any literal is evaluated
+
+#include "ast.h"
+#include "facts.h"
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <array>
+#include <span>
+#include <map>
+#include <tuple>
+#include <unordered_map>
+#include <functional>
+#include <algorithm>
+#include <cstdint>
+
+namespace post_query {
+    class query_set {
+        private:
+        struct string_hash {
+            using is_transparent = void;
+
+            size_t operator()(std::string_view sv) const {
+                return std::hash<std::string_view>{}(sv);
+            }
+        };
+
+        // Tags, wildcards and metatags, `not` only changes which mask of a clause they're in
+        struct literal {
+            node_type type;
+            std::string name;
+            std::string value;
+        };
+
+        // One 64-bit word of the literal bitset, the clause holds if either mask intersects the post's literal truth
+        struct clause_word {
+            size_t word;
+            uint64_t positive;
+            uint64_t negative;
+        };
+
+        // 512 bits with 2 bits per tag, about 10% false positives for a post with 100 tags
+        using bloom = std::array<uint64_t, 8>;
+
+        struct query {
+            // Ranges in _clauses and _lazy
+            size_t clauses_begin;
+            size_t clauses_end;
+            size_t lazy_begin;
+            size_t lazy_end;
+
+            // Tags of the unit clauses, every matching post has all of them
+            bloom required;
+        };
+
+        std::vector<literal> _literals;
+        std::unordered_map<std::string, size_t, string_hash, std::equal_to<>> _tags;
+
+        // Each clause is a range in _words
+        std::vector<std::pair<size_t, size_t>> _clauses;
+        std::vector<clause_word> _words;
+
+        // Wildcards and metatags are only evaluated for queries that got past the Bloom filter
+        std::vector<size_t> _lazy;
+        std::vector<query> _queries;
+
+        // Index of every literal by type, name and value, only used while adding queries
+        std::map<std::tuple<node_type, std::string, std::string>, size_t> _literal_index;
+
+        static void bloom_add(bloom& filter, std::string_view tag) {
+            uint64_t hash = std::hash<std::string_view>{}(tag);
+            uint64_t first = hash % 512;
+            uint64_t second = (hash >> 32) % 512;
+
+            filter[first / 64] |= uint64_t(1) << (first % 64);
+            filter[second / 64] |= uint64_t(1) << (second % 64);
+        }
+
+        static bool bloom_covers(const bloom& filter, const bloom& required) {
+            for (size_t i = 0; i < filter.size(); ++i) {
+                if (required[i] & ~filter[i]) {
+                    return false;
+                }
+            }
+
+            return true;
+        }
+
+        // `*` matches any sequence of characters, nothing else is special
+        static bool wildcard_matches(std::string_view pattern, std::string_view tag) {
+            size_t p = 0;
+            size_t t = 0;
+
+            // Position after the last star and the tag position it currently covers up to
+            size_t star = std::string_view::npos;
+            size_t resume = 0;
+
+            while (t < tag.size()) {
+                if (p < pattern.size() && pattern[p] == '*') {
+                    star = ++p;
+                    resume = t;
+                } else if (p < pattern.size() && pattern[p] == tag[t]) {
+                    ++p;
+                    ++t;
+                } else if (star != std::string_view::npos) {
+                    p = star;
+                    t = ++resume;
+                } else {
+                    return false;
+                }
+            }
+
+            return std::ranges::all_of(pattern.substr(p), [](char ch) { return ch == '*'; });
+        }
+
+        size_t literal_index(const ast& node) {
+            literal lit { .type = node.type(), .name = {}, .value = {} };
+            if (node.type() == node_type::Metatag) {
+                lit.name = node.metatag().name;
+                lit.value = node.metatag().value;
+            } else {
+                lit.name = node.name();
+            }
+
+            auto [it, inserted] = _literal_index.try_emplace(std::tuple { lit.type, lit.name, lit.value }, _literals.size());
+            if (inserted) {
+                if (lit.type == node_type::Tag) {
+                    _tags.emplace(lit.name, it->second);
+                }
+
+                _literals.emplace_back(std::move(lit));
+            }
+
+            return it->second;
+        }
+
+        bool evaluate(const literal& lit, std::span<const std::string_view> tags, const fact_set& facts) const {
+            switch (lit.type) {
+                case node_type::Wildcard:
+                    return std::ranges::any_of(tags, [&lit](std::string_view tag) { return wildcard_matches(lit.name, tag); });
+
+                // Attributes the post doesn't have never match
+                case node_type::Metatag:
+                    return facts.metatag(lit.name, lit.value).value_or(false);
+
+                default:
+                    return false;
+            }
+        }
+
+        public:
+        size_t size() const {
+            return _queries.size();
+        }
+
+        size_t literal_count() const {
+            return _literals.size();
+        }
+
+        // Converts the query to CNF, the returned index identifies it in the results of match
+        size_t add(ast& root) {
+            root.to_cnf();
+
+            query q {
+                .clauses_begin = _clauses.size(),
+                .clauses_end = 0,
+                .lazy_begin = _lazy.size(),
+                .lazy_end = 0,
+                .required = {},
+            };
+
+            // `all` has no clauses and always matches, `none` is a single empty clause that never does
+            std::vector<const ast*> clauses;
+            switch (root.type()) {
+                case node_type::All:
+                    break;
+
+                case node_type::And:
+                    for (const ast_ptr& child : root.children()) {
+                        clauses.push_back(child.get());
+                    }
+                    break;
+
+                default:
+                    clauses.push_back(&root);
+                    break;
+            }
+
+            std::vector<size_t> lazy;
+            for (const ast* clause : clauses) {
+                std::span<const ast_ptr> children = clause->children();
+
+                std::vector<const ast*> literals;
+                if (clause->type() == node_type::Or) {
+                    for (const ast_ptr& child : children) {
+                        literals.push_back(child.get());
+                    }
+                } else {
+                    literals.push_back(clause);
+                }
+
+                // Literal index and whether it's negated
+                std::vector<std::pair<size_t, bool>> bits;
+                for (const ast* lit : literals) {
+                    bool negated = lit->type() == node_type::Not;
+                    if (negated) {
+                        lit = lit->children().front().get();
+                    }
+
+                    if (lit->type() != node_type::Tag && lit->type() != node_type::Wildcard && lit->type() != node_type::Metatag) {
+                        continue;
+                    }
+
+                    size_t index = literal_index(*lit);
+                    bits.emplace_back(index, negated);
+
+                    if (lit->type() != node_type::Tag) {
+                        lazy.push_back(index);
+                    } else if (literals.size() == 1 && !negated) {
+                        bloom_add(q.required, lit->name());
+                    }
+                }
+
+                std::ranges::sort(bits);
+
+                size_t words_begin = _words.size();
+                for (auto [index, negated] : bits) {
+                    if (_words.size() == words_begin || _words.back().word != index / 64) {
+                        _words.push_back(clause_word { .word = index / 64, .positive = 0, .negative = 0 });
+                    }
+
+                    (negated ? _words.back().negative : _words.back().positive) |= uint64_t(1) << (index % 64);
+                }
+
+                _clauses.emplace_back(words_begin, _words.size());
+            }
+
+            std::ranges::sort(lazy);
+            auto [first, last] = std::ranges::unique(lazy);
+            lazy.erase(first, last);
+            _lazy.insert(_lazy.end(), lazy.begin(), lazy.end());
+
+            q.clauses_end = _clauses.size();
+            q.lazy_end = _lazy.size();
+            _queries.push_back(q);
+
+            return _queries.size() - 1;
+        }
+
+        // Indices of the queries matching a post with these lowercase tags, in the order they were added
+        // Metatags are looked up in the facts, those the post has no value for never match
+        std::vector<size_t> match(std::span<const std::string_view> tags, const fact_set& facts) const {
+            bloom filter {};
+            for (std::string_view tag : tags) {
+                bloom_add(filter, tag);
+            }
+
+            std::vector<size_t> candidates;
+            for (size_t i = 0; i < _queries.size(); ++i) {
+                if (bloom_covers(filter, _queries[i].required)) {
+                    candidates.push_back(i);
+                }
+            }
+
+            if (candidates.empty()) {
+                return {};
+            }
+
+            // Tags are looked up through the post's own tags, which are usually far fewer than the literals
+            std::vector<uint64_t> truth((_literals.size() + 63) / 64);
+            std::vector<uint64_t> evaluated(truth.size());
+            for (std::string_view tag : tags) {
+                if (auto it = _tags.find(tag); it != _tags.end()) {
+                    truth[it->second / 64] |= uint64_t(1) << (it->second % 64);
+                }
+            }
+
+            std::vector<size_t> res;
+            for (size_t i : candidates) {
+                const query& q = _queries[i];
+
+                for (size_t j = q.lazy_begin; j < q.lazy_end; ++j) {
+                    size_t index = _lazy[j];
+                    uint64_t bit = uint64_t(1) << (index % 64);
+
+                    if (!(evaluated[index / 64] & bit)) {
+                        evaluated[index / 64] |= bit;
+                        if (evaluate(_literals[index], tags, facts)) {
+                            truth[index / 64] |= bit;
+                        }
+                    }
+                }
+
+                bool matches = std::all_of(_clauses.begin() + q.clauses_begin, _clauses.begin() + q.clauses_end, [&](const auto& clause) {
+                    return std::any_of(_words.begin() + clause.first, _words.begin() + clause.second, [&truth](const clause_word& w) {
+                        return ((w.positive & truth[w.word]) | (w.negative & ~truth[w.word])) != 0;
+                    });
+                });
+
+                if (matches) {
+                    res.push_back(i);
+                }
+            }
+
+            return res;
+        }
+    };
+}
+
+#endif /* QUERY_SET_H */
@@ -0,0 +1,343 @@
+#ifndef RULES_H
+#define RULES_H
+
+// Query rewrite rules of the form `pattern => replacement`, e.g. `fav:$user => ordfav:$user`
+// Tags and metatag values starting with `$` capture whatever is at their position and are substituted in the replacement
+// All patterns are compiled into a single decision tree over the pre-order steps of a subtree,
+// so each node is checked against every rule at once
+
+#include "ast.h"
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <optional>
+#include <expected>
+#include <atomic>
+#include <format>
+#include <algorithm>
+#include <cctype>
+
+namespace post_query {
+    class rule_set {
+        private:
+        // One step of a pre-order walk, compound nodes are keyed by their child count and terms by their text
+        // Metatags take two steps so that their value can be captured separately from their name
+        struct step {
+            std::string key;
+            bool capturable = false;
+            std::string_view text = {};
+        };
+
+        // Produces the steps of a subtree lazily, matching usually fails within the first one
+        class cursor {
+            private:
+            std::vector<const ast*> _pending;
+            std::deque<step> _steps;
+            const std::string* _value = nullptr;
+
+            static constexpr char value_step = char(0xff);
+
+            bool produce() {
+                if (_value) {
+                    _steps.push_back({ .key = value_step + *_value, .capturable = true, .text = *_value });
+                    _value = nullptr;
+                    return true;
+                }
+
+                if (_pending.empty()) {
+                    return false;
+                }
+
+                const ast* node = _pending.back();
+                _pending.pop_back();
+
+                std::string key { char(node->type()) };
+                switch (node->type()) {
+                    case node_type::Tag:
+                        _steps.push_back({ .key = key + node->name(), .capturable = true, .text = node->name() });
+                        return true;
+
+                    case node_type::Wildcard:
+                        key.append(node->name());
+                        break;
+
+                    case node_type::Metatag:
+                        key.append(node->metatag().name);
+                        _value = &node->metatag().value;
+                        break;
+
+                    case node_type::Not:
+                    case node_type::Opt:
+                    case node_type::And:
+                    case node_type::Or: {
+                        std::span<const ast_ptr> children = node->children();
+                        key.append(std::to_string(children.size()));
+
+                        for (auto it = children.rbegin(); it != children.rend(); ++it) {
+                            _pending.push_back(it->get());
+                        }
+                        break;
+                    }
+
+                    default:
+                        break;
+                }
+
+                _steps.push_back({ .key = std::move(key) });
+                return true;
+            }
+
+            public:
+            explicit cursor(const ast& root) : _pending { &root } { }
+
+            // Null once the whole subtree was walked
+            const step* at(size_t index) {
+                while (_steps.size() <= index) {
+                    if (!produce()) {
+                        return nullptr;
+                    }
+                }
+
+                return &_steps[index];
+            }
+        };
+
+        struct trie_node {
+            std::unordered_map<std::string, size_t> exact;
+            std::optional<size_t> variable;
+
+            // Rules whose pattern ends here, in the order they were added
+            std::vector<size_t> rules;
+        };
+
+        struct rule {
+            std::string pattern;
+            ast_ptr replacement;
+
+            // Name of every capture of the pattern, in the order they are matched
+            std::vector<std::string> variables;
+        };
+
+        struct match {
+            size_t rule;
+            std::vector<std::string_view> captures;
+        };
+
+        std::vector<rule> _rules;
+        mutable std::deque<std::atomic<uint64_t>> _hits;
+        std::vector<trie_node> _nodes { trie_node{} };
+
+        // `$` followed by letters, digits and underscores, other tags starting with `$` are matched literally
+        static bool is_variable(std::string_view sv) {
+            return sv.size() > 1 && sv.front() == '$' && std::ranges::all_of(sv.substr(1), [](unsigned char ch) {
+                return std::isalnum(ch) || ch == '_';
+            });
+        }
+
+        // Parsed queries are wrapped in a single `and`, which would only ever match the root
+        static const ast& unwrap(const ast& node) {
+            const ast* res = &node;
+            while ((res->type() == node_type::And || res->type() == node_type::Or) && res->child_count() == 1) {
+                res = res->children().front().get();
+            }
+
+            return *res;
+        }
+
+        // Captures bound to the same variable more than once have to agree
+        bool consistent(const rule& r, const std::vector<std::string_view>& captures) const {
+            for (size_t i = 0; i < captures.size(); ++i) {
+                for (size_t j = i + 1; j < captures.size(); ++j) {
+                    if (r.variables[i] == r.variables[j] && captures[i] != captures[j]) {
+                        return false;
+                    }
+                }
+            }
+
+            return true;
+        }
+
+        // Exact steps are tried before captures, so more specific patterns win over general ones
+        bool search(size_t node, size_t index, cursor& steps, std::vector<std::string_view>& captures, std::optional<match>& res) const {
+            const trie_node& current = _nodes[node];
+            const step* next = steps.at(index);
+
+            if (!next) {
+                for (size_t r : current.rules) {
+                    if (consistent(_rules[r], captures)) {
+                        res = match { .rule = r, .captures = captures };
+                        return true;
+                    }
+                }
+
+                return false;
+            }
+
+            if (auto it = current.exact.find(next->key); it != current.exact.end() && search(it->second, index + 1, steps, captures, res)) {
+                return true;
+            }
+
+            if (next->capturable && current.variable) {
+                captures.push_back(next->text);
+                if (search(*current.variable, index + 1, steps, captures, res)) {
+                    return true;
+                }
+                captures.pop_back();
+            }
+
+            return false;
+        }
+
+        std::optional<match> find(const ast& node) const {
+            cursor steps { node };
+            std::vector<std::string_view> captures;
+            std::optional<match> res;
+
+            search(0, 0, steps, captures, res);
+            return res;
+        }
+
+        ast_ptr instantiate(const match& m) const {
+            const rule& r = _rules[m.rule];
+            auto bound = [&](const std::string& variable) {
+                return std::string { m.captures[std::ranges::find(r.variables, variable) - r.variables.begin()] };
+            };
+
+            ast_ptr res = r.replacement->copy();
+            res->rewrite([&](ast& node) {
+                if (node.type() == node_type::Tag && is_variable(node.name())) {
+                    node.replace_with(ast::make_tag(bound(node.name())));
+                } else if (node.type() == node_type::Metatag && is_variable(node.metatag().value)) {
+                    node.replace_with(ast::make_metatag(node.metatag().name, bound(node.metatag().value), false));
+                }
+            });
+
+            return res;
+        }
+
+        public:
+        // Rewrites applied by a single call to apply before giving up, cyclic rules would never stop otherwise
+        static constexpr size_t default_max_rewrites = 1000;
+
+        std::expected<void, std::string> add(std::string pattern_text, const ast& pattern_root, const ast& replacement_root) {
+            const ast& pattern = unwrap(pattern_root);
+            const ast& replacement = unwrap(replacement_root);
+
+            if (pattern.type() == node_type::All || pattern.type() == node_type::None) {
+                return std::unexpected(std::format("invalid pattern \"{}\"", pattern_text));
+            }
+
+            rule r { .pattern = std::move(pattern_text), .replacement = replacement.copy(), .variables = {} };
+
+            size_t node = 0;
+            cursor steps { pattern };
+            for (size_t i = 0; const step* next = steps.at(i); ++i) {
+                std::optional<size_t> target;
+                if (next->capturable && is_variable(next->text)) {
+                    r.variables.emplace_back(next->text);
+                    target = _nodes[node].variable;
+                } else if (auto it = _nodes[node].exact.find(next->key); it != _nodes[node].exact.end()) {
+                    target = it->second;
+                }
+
+                if (!target) {
+                    target = _nodes.size();
+                    if (next->capturable && is_variable(next->text)) {
+                        _nodes[node].variable = target;
+                    } else {
+                        _nodes[node].exact.emplace(next->key, *target);
+                    }
+
+                    _nodes.emplace_back();
+                }
+
+                node = *target;
+            }
+
+            std::optional<std::string> unbound;
+            r.replacement->rewrite([&](ast& n) {
+                std::string_view text = (n.type() == node_type::Tag) ? std::string_view { n.name() }
+                    : (n.type() == node_type::Metatag) ? std::string_view { n.metatag().value } : std::string_view {};
+
+                if (is_variable(text) && !std::ranges::contains(r.variables, text)) {
+                    unbound = std::string { text };
+                }
+            });
+
+            if (unbound) {
+                return std::unexpected(std::format("{} is not captured by \"{}\"", *unbound, r.pattern));
+            }
+
+            _nodes[node].rules.push_back(_rules.size());
+            _rules.emplace_back(std::move(r));
+            _hits.emplace_back(0);
+
+            return {};
+        }
+
+        // Rewrite the tree top-down in a single traversal, mutates the AST
+        // Each node is rewritten until no rule matches it anymore, then its new children are visited
+        // Returns the number of rewrites
+        std::expected<size_t, std::string> apply(ast& root, size_t max_rewrites = default_max_rewrites) const {
+            size_t rewrites = 0;
+            bool exhausted = false;
+            std::vector<uint64_t> hits(_rules.size());
+
+            root.rewrite([&](ast& node) {
+                while (!exhausted) {
+                    std::optional<match> m = find(node);
+                    if (!m) {
+                        break;
+                    } else if (rewrites == max_rewrites) {
+                        exhausted = true;
+                        break;
+                    }
+
+                    node.replace_with(instantiate(*m));
+                    hits[m->rule] += 1;
+                    rewrites += 1;
+                }
+            });
+
+            if (exhausted) {
+                return std::unexpected(std::format("rewrite rules did not reach a fixpoint within {} rewrites", max_rewrites));
+            }
+
+            // Only rewrites that were kept are counted
+            for (size_t i = 0; i < hits.size(); ++i) {
+                if (hits[i] > 0) {
+                    _hits[i].fetch_add(hits[i], std::memory_order_relaxed);
+                }
+            }
+
+            if (rewrites > 0) {
+                root.fold_constants();
+            }
+
+            return rewrites;
+        }
+
+        size_t size() const {
+            return _rules.size();
+        }
+
+        const std::string& pattern(size_t index) const {
+            return _rules[index].pattern;
+        }
+
+        uint64_t hits(size_t index) const {
+            return _hits[index].load(std::memory_order_relaxed);
+        }
+
+        void reset_hits() const {
+            for (auto& hits : _hits) {
+                hits.store(0, std::memory_order_relaxed);
+            }
+        }
+    };
+}
+
+#endif /* RULES_H */
@@ -0,0 +1,186 @@
+#ifndef STATS_H
+#define STATS_H
+
+// Opt-in instrumentation of the parse, CNF and serialization phases
+// Probe points are compiled in whenever <sys/sdt.h> is available and cost a single nop until traced:
+//   bpftrace -e 'usdt:*:post_query:phase__start { @start[tid] = nsecs; }
+//                usdt:*:post_query:phase__end { @[arg0] = hist(nsecs - @start[tid]); }'
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <string_view>
+#include <cstdint>
+#include <bit>
+#include <algorithm>
+
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define POST_QUERY_PROBE1(name, a) DTRACE_PROBE1(post_query, name, a)
+#define POST_QUERY_PROBE2(name, a, b) DTRACE_PROBE2(post_query, name, a, b)
+#else
+#define POST_QUERY_PROBE1(name, a) do { } while (0)
+#define POST_QUERY_PROBE2(name, a, b) do { } while (0)
+#endif
+
+namespace post_query {
+    enum class phase {
+        Parse,
+        RewriteOpts,
+        Simplify,
+        Sort,
+        Serialize,
+    };
+
+    static constexpr std::array<std::string_view, 5> phase_names {
+        "parse", "rewrite_opts", "simplify", "sort", "serialize",
+    };
+
+    static constexpr std::string_view phase_name(phase p) {
+        return phase_names[static_cast<int>(p)];
+    }
+
+    enum class counter {
+        // Conversions to any normal form
+        Conversions,
+
+        // Summed over all conversions
+        NodesBefore,
+        NodesAfter,
+        SimplifyIterations,
+
+        // Nodes distributed over their children of the other kind, and the clauses this produced
+        Distributions,
+        DistributedClauses,
+    };
+
+    static constexpr std::array<std::string_view, 6> counter_names {
+        "conversions", "nodes_before", "nodes_after", "simplify_iterations", "distributions", "distributed_clauses",
+    };
+
+    static constexpr std::string_view counter_name(counter c) {
+        return counter_names[static_cast<int>(c)];
+    }
+
+    // Bucket i counts durations in [2^(i-1), 2^i) nanoseconds, bucket 0 is exactly 0
+    // The last bucket also holds anything longer, which would take centuries
+    static constexpr size_t histogram_buckets = 64;
+
+    struct phase_snapshot {
+        uint64_t count = 0;
+        uint64_t total_ns = 0;
+        std::array<uint64_t, histogram_buckets> buckets {};
+    };
+
+    struct stats_snapshot {
+        bool enabled;
+        std::array<phase_snapshot, phase_names.size()> phases;
+        std::array<uint64_t, counter_names.size()> counters;
+    };
+
+    // Process-wide, all updates are relaxed atomics so recording never blocks
+    class query_stats {
+        private:
+        struct histogram {
+            std::atomic<uint64_t> count;
+            std::atomic<uint64_t> total_ns;
+            std::array<std::atomic<uint64_t>, histogram_buckets> buckets;
+        };
+
+        std::atomic<bool> _enabled = false;
+        std::array<histogram, phase_names.size()> _phases {};
+        std::array<std::atomic<uint64_t>, counter_names.size()> _counters {};
+
+        public:
+        bool enabled() const {
+            return _enabled.load(std::memory_order_relaxed);
+        }
+
+        void set_enabled(bool enabled) {
+            _enabled.store(enabled, std::memory_order_relaxed);
+        }
+
+        void record(phase p, uint64_t ns) {
+            histogram& h = _phases[static_cast<int>(p)];
+            h.count.fetch_add(1, std::memory_order_relaxed);
+            h.total_ns.fetch_add(ns, std::memory_order_relaxed);
+            h.buckets[std::min<size_t>(std::bit_width(ns), histogram_buckets - 1)].fetch_add(1, std::memory_order_relaxed);
+        }
+
+        void add(counter c, uint64_t n = 1) {
+            _counters[static_cast<int>(c)].fetch_add(n, std::memory_order_relaxed);
+        }
+
+        // Concurrent updates may land in between reading two values, totals are never torn
+        stats_snapshot snapshot() const {
+            stats_snapshot res { .enabled = enabled(), .phases = {}, .counters = {} };
+
+            for (size_t i = 0; i < _phases.size(); ++i) {
+                res.phases[i].count = _phases[i].count.load(std::memory_order_relaxed);
+                res.phases[i].total_ns = _phases[i].total_ns.load(std::memory_order_relaxed);
+                for (size_t j = 0; j < histogram_buckets; ++j) {
+                    res.phases[i].buckets[j] = _phases[i].buckets[j].load(std::memory_order_relaxed);
+                }
+            }
+
+            for (size_t i = 0; i < _counters.size(); ++i) {
+                res.counters[i] = _counters[i].load(std::memory_order_relaxed);
+            }
+
+            return res;
+        }
+
+        void reset() {
+            for (histogram& h : _phases) {
+                h.count.store(0, std::memory_order_relaxed);
+                h.total_ns.store(0, std::memory_order_relaxed);
+                for (auto& bucket : h.buckets) {
+                    bucket.store(0, std::memory_order_relaxed);
+                }
+            }
+
+            for (auto& c : _counters) {
+                c.store(0, std::memory_order_relaxed);
+            }
+        }
+
+        static query_stats& global() {
+            static query_stats stats;
+            return stats;
+        }
+    };
+
+    // Fires the phase probes and records the elapsed time when stats are enabled
+    class phase_timer {
+        private:
+        using clock = std::chrono::steady_clock;
+
+        phase _phase;
+        bool _enabled;
+        clock::time_point _start;
+
+        public:
+        explicit phase_timer(phase p) : _phase { p }, _enabled { query_stats::global().enabled() } {
+            POST_QUERY_PROBE1(phase__start, static_cast<int>(_phase));
+
+            if (_enabled) {
+                _start = clock::now();
+            }
+        }
+
+        phase_timer(const phase_timer&) = delete;
+        phase_timer& operator=(const phase_timer&) = delete;
+
+        ~phase_timer() {
+            uint64_t ns = 0;
+            if (_enabled) {
+                ns = std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - _start).count();
+                query_stats::global().record(_phase, ns);
+            }
+
+            POST_QUERY_PROBE2(phase__end, static_cast<int>(_phase), ns);
+        }
+    };
+}
+
+#endif /* STATS_H */
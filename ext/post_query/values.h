@@ -0,0 +1,319 @@
+#ifndef VALUES_H
+#define VALUES_H
+
+// Typed interpretation of metatag values, e.g. `score:>=10`, `date:2024-01-01..2024-02-01`
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <array>
+#include <optional>
+#include <expected>
+#include <charconv>
+#include <chrono>
+#include <algorithm>
+#include <ranges>
+#include <tuple>
+#include <cctype>
+#include <cmath>
+#include <format>
+
+namespace post_query {
+    using namespace std::literals;
+
+    enum class value_type {
+        Integer,
+        Float,
+        Size,
+        Date,
+        Ratio,
+    };
+
+    static constexpr std::array<std::string_view, 5> value_type_names {
+        "integer", "float", "size", "date", "ratio",
+    };
+
+    static constexpr std::string_view value_type_name(value_type type) {
+        return value_type_names[static_cast<int>(type)];
+    }
+
+    // Integer, size and date values are stored exactly as long as they fit in 53 bits
+    // Dates are stored as days since the epoch
+    struct value_range {
+        std::optional<double> min;
+        std::optional<double> max;
+        bool min_inclusive = true;
+        bool max_inclusive = true;
+
+        // Whether any value is contained in this range
+        bool empty() const {
+            if (!min || !max) {
+                return false;
+            } else if (*min == *max) {
+                return !(min_inclusive && max_inclusive);
+            } else {
+                return *min > *max;
+            }
+        }
+
+        // Whether this range's lower bound excludes more values than the other's
+        bool tighter_min(const value_range& other) const {
+            if (!min) {
+                return false;
+            } else if (!other.min) {
+                return true;
+            }
+
+            return *min > *other.min || (*min == *other.min && !min_inclusive && other.min_inclusive);
+        }
+
+        bool tighter_max(const value_range& other) const {
+            if (!max) {
+                return false;
+            } else if (!other.max) {
+                return true;
+            }
+
+            return *max < *other.max || (*max == *other.max && !max_inclusive && other.max_inclusive);
+        }
+
+        bool same_min(const value_range& other) const {
+            return min == other.min && (!min || min_inclusive == other.min_inclusive);
+        }
+
+        bool same_max(const value_range& other) const {
+            return max == other.max && (!max || max_inclusive == other.max_inclusive);
+        }
+
+        // Whether every value in the other range is also in this one
+        bool contains(const value_range& other) const {
+            return !tighter_min(other) && !tighter_max(other);
+        }
+
+        value_range intersect(const value_range& other) const {
+            value_range res = *this;
+            if (other.tighter_min(res)) {
+                res.min = other.min;
+                res.min_inclusive = other.min_inclusive;
+            }
+
+            if (other.tighter_max(res)) {
+                res.max = other.max;
+                res.max_inclusive = other.max_inclusive;
+            }
+
+            return res;
+        }
+
+        bool operator==(const value_range&) const = default;
+    };
+
+    // A comma-separated list is the union of its ranges
+    struct typed_value {
+        value_type type;
+        std::vector<value_range> ranges;
+
+        bool operator==(const typed_value&) const = default;
+    };
+
+    using typed_value_result = std::expected<typed_value, std::string>;
+
+    namespace detail {
+        static std::expected<double, std::string> parse_scalar(value_type type, std::string_view sv) {
+            auto invalid = [&] {
+                return std::unexpected(std::format("invalid {} value \"{}\"", value_type_name(type), sv));
+            };
+
+            // from_chars also accepts nan and inf, which no range can be ordered by
+            auto parse_double = [](std::string_view sv) -> std::optional<double> {
+                double res;
+                auto [ptr, ec] = std::from_chars(sv.data(), sv.data() + sv.size(), res);
+                if (ec != std::errc{} || ptr != sv.data() + sv.size() || !std::isfinite(res)) {
+                    return std::nullopt;
+                }
+
+                return res;
+            };
+
+            switch (type) {
+                case value_type::Integer: {
+                    int64_t res;
+                    auto [ptr, ec] = std::from_chars(sv.data(), sv.data() + sv.size(), res);
+                    if (sv.empty() || ec != std::errc{} || ptr != sv.data() + sv.size()) {
+                        return invalid();
+                    }
+
+                    return double(res);
+                }
+
+                case value_type::Float: {
+                    if (auto res = parse_double(sv)) {
+                        return *res;
+                    }
+
+                    return invalid();
+                }
+
+                case value_type::Size: {
+                    // Number followed by an optional unit: b, kb, mb, gb (or just k, m, g)
+                    auto unit_begin = std::ranges::find_if(sv, [](char ch) { return std::isalpha(uint8_t(ch)); });
+                    std::string_view number { sv.begin(), unit_begin };
+                    std::string unit { unit_begin, sv.end() };
+                    std::ranges::transform(unit, unit.begin(), [](unsigned char ch) { return std::tolower(ch); });
+
+                    double multiplier;
+                    if (unit.empty() || unit == "b") {
+                        multiplier = 1;
+                    } else if (unit == "k" || unit == "kb") {
+                        multiplier = 1024;
+                    } else if (unit == "m" || unit == "mb") {
+                        multiplier = 1024 * 1024;
+                    } else if (unit == "g" || unit == "gb") {
+                        multiplier = 1024 * 1024 * 1024;
+                    } else {
+                        return invalid();
+                    }
+
+                    auto res = parse_double(number);
+                    if (!res || *res < 0 || *res * multiplier >= 0x1p63) {
+                        return invalid();
+                    }
+
+                    // Whole bytes only
+                    return double(int64_t(*res * multiplier));
+                }
+
+                case value_type::Date: {
+                    // YYYY-MM-DD
+                    int y, m, d;
+                    auto end = sv.data() + sv.size();
+                    auto [y_end, y_ec] = std::from_chars(sv.data(), end, y);
+                    if (y_ec != std::errc{} || y_end == end || *y_end != '-') {
+                        return invalid();
+                    }
+
+                    auto [m_end, m_ec] = std::from_chars(y_end + 1, end, m);
+                    if (m_ec != std::errc{} || m_end == end || *m_end != '-') {
+                        return invalid();
+                    }
+
+                    auto [d_end, d_ec] = std::from_chars(m_end + 1, end, d);
+                    if (d_ec != std::errc{} || d_end != end) {
+                        return invalid();
+                    }
+
+                    std::chrono::year_month_day date {
+                        std::chrono::year { y }, std::chrono::month(m), std::chrono::day(d)
+                    };
+
+                    if (!date.ok()) {
+                        return invalid();
+                    }
+
+                    return double(std::chrono::sys_days { date }.time_since_epoch().count());
+                }
+
+                case value_type::Ratio: {
+                    // Either W:H or a plain number
+                    if (size_t colon = sv.find(':'); colon != std::string_view::npos) {
+                        auto w = parse_double(sv.substr(0, colon));
+                        auto h = parse_double(sv.substr(colon + 1));
+                        if (!w || !h || *h == 0 || !std::isfinite(*w / *h)) {
+                            return invalid();
+                        }
+
+                        return *w / *h;
+                    } else if (auto res = parse_double(sv)) {
+                        return *res;
+                    }
+
+                    return invalid();
+                }
+            }
+
+            return invalid();
+        }
+
+        static std::expected<value_range, std::string> parse_range(value_type type, std::string_view sv) {
+            value_range res;
+
+            // Comparison prefixes
+            for (auto [prefix, is_min, inclusive] : {
+                std::tuple { ">="sv, true, true }, std::tuple { "<="sv, false, true },
+                std::tuple { ">"sv, true, false }, std::tuple { "<"sv, false, false },
+            }) {
+                if (sv.starts_with(prefix)) {
+                    auto bound = parse_scalar(type, sv.substr(prefix.size()));
+                    if (!bound) {
+                        return std::unexpected(std::move(bound.error()));
+                    }
+
+                    (is_min ? res.min : res.max) = *bound;
+                    (is_min ? res.min_inclusive : res.max_inclusive) = inclusive;
+                    return res;
+                }
+            }
+
+            // Inclusive ranges: x..y, x.., ..y
+            if (size_t dots = sv.find(".."); dots != std::string_view::npos) {
+                std::string_view lhs = sv.substr(0, dots);
+                std::string_view rhs = sv.substr(dots + 2);
+
+                if (lhs.empty() && rhs.empty()) {
+                    return std::unexpected(std::format("empty {} range", value_type_name(type)));
+                }
+
+                if (!lhs.empty()) {
+                    auto bound = parse_scalar(type, lhs);
+                    if (!bound) {
+                        return std::unexpected(std::move(bound.error()));
+                    }
+
+                    res.min = *bound;
+                }
+
+                if (!rhs.empty()) {
+                    auto bound = parse_scalar(type, rhs);
+                    if (!bound) {
+                        return std::unexpected(std::move(bound.error()));
+                    }
+
+                    res.max = *bound;
+                }
+
+                return res;
+            }
+
+            // Exact value
+            auto bound = parse_scalar(type, sv);
+            if (!bound) {
+                return std::unexpected(std::move(bound.error()));
+            }
+
+            res.min = *bound;
+            res.max = *bound;
+            return res;
+        }
+    }
+
+    static typed_value_result parse_typed_value(value_type type, std::string_view value) {
+        typed_value res { .type = type, .ranges = {} };
+
+        if (value.empty()) {
+            return std::unexpected(std::format("empty {} value", value_type_name(type)));
+        }
+
+        for (auto part : value | std::views::split(',')) {
+            auto range = detail::parse_range(type, std::string_view { part.begin(), part.end() });
+            if (!range) {
+                return std::unexpected(std::move(range.error()));
+            }
+
+            res.ranges.emplace_back(*range);
+        }
+
+        return res;
+    }
+}
+
+#endif /* VALUES_H */
@@ -5,7 +5,62 @@ require "post_query/post_query"
 class PostQuery
   class Error < StandardError; end
 
-  def self.parse(string, metatags: [])
-    parse_raw(string, metatags)
+  # Without a list of metatags, every metatag known to Danbooru is recognized
+  def self.parse(string, metatags: nil, typed: false)
+    parse_raw(string, metatags, typed)
+  end
+
+  # Rewrite rules given as `pattern => replacement` query strings, e.g. `"fav:$user" => "ordfav:$user"`
+  class RuleSet
+    def initialize(rules, metatags: nil)
+      initialize_raw(rules.to_a, metatags)
+    end
+  end
+
+  # Matches posts against many queries at once, e.g. the lines of a blacklist
+  # Queries are strings or parsed ASTs, which are copied and converted to CNF
+  class QuerySet
+    def initialize(queries, metatags: nil)
+      initialize_raw(queries.to_a, metatags)
+    end
+
+    # Indices of the queries matching a post, tags are an Array or a space-separated tag string
+    # Facts give the post's metatag values the same way as for AST#specialize, metatags without a value never match
+    def match(tags, facts = {})
+      tags = tags.split if tags.is_a?(String)
+      match_raw(tags, facts)
+    end
+  end
+
+  # Reusable parser state, token_at keeps the tokens of the last query so that only the edited part is lexed again
+  class Parser
+    attr_reader :metatags
+
+    def initialize(metatags: nil)
+      @metatags = metatags
+      initialize_raw(metatags)
+    end
+
+    def parse(string, typed: false)
+      PostQuery.parse_raw(string, @metatags, typed)
+    end
+  end
+
+  class AST
+    # Returns the CNF clauses ordered by estimated cost, the receiver is not modified
+    def plan(tag_counts, metatag_costs: {}, total_posts: tag_counts.values.max || 0)
+      plan_raw(tag_counts, metatag_costs, total_posts)
+    end
+
+    # Converts the receiver to CNF or DNF, whichever is estimated to be smaller, or to NNF if neither fits in max_nodes
+    # Returns :cnf, :dnf or :nnf
+    def to_best_form(max_nodes:)
+      to_best_form_raw(max_nodes)
+    end
+
+    # Rewrites the receiver with the rules, raises PostQuery::Error if they keep applying
+    def apply_rules(rules, max_rewrites: 1000)
+      apply_rules_raw(rules, max_rewrites)
+    end
   end
 end
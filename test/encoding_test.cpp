@@ -0,0 +1,160 @@
+// Tests of the UTF-8/16/32 conversions in ext/post_query/encoding.h, run by `rake test:encoding`
+// The Ruby extension rejects invalid UTF-8 before it reaches the core, so these paths are only reachable from here
+
+#include "../ext/post_query/encoding.h"
+
+#include <iostream>
+#include <string>
+#include <string_view>
+
+static int failures = 0;
+
+// Variadic so that template argument lists don't need extra parentheses
+#define CHECK(...) do { \
+    if (!(__VA_ARGS__)) { \
+        std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " << #__VA_ARGS__ << "\n"; \
+        ++failures; \
+    } \
+} while (0)
+
+template <typename CharT>
+static std::basic_string<CharT> repeat(std::basic_string_view<CharT> sv, size_t count) {
+    std::basic_string<CharT> res;
+    for (size_t i = 0; i < count; ++i) {
+        res += sv;
+    }
+
+    return res;
+}
+
+// Longer than one 16-byte SSE2 block, so the vectorized ASCII prefix runs before decoding starts
+static const std::string ascii = "the_quick_brown_fox_jumps_over_the_lazy_dog";
+static const std::u16string ascii16 = u"the_quick_brown_fox_jumps_over_the_lazy_dog";
+
+static bool fails_with(std::string_view sv, encoding::error err) {
+    auto res = encoding::validate(sv);
+    return !res && res.error() == err;
+}
+
+static void test_validate() {
+    using encoding::error;
+
+    for (std::string_view valid : { "", "a", "é", "日本", "\U0001D11E", "\xed\x9f\xbf", "\xee\x80\x80", "\xf4\x8f\xbf\xbf" }) {
+        CHECK(encoding::validate(valid));
+    }
+
+    // Input ending in the middle of a sequence
+    CHECK(fails_with("\xc3", error::Truncated));
+    CHECK(fails_with("\xe3\x81", error::Truncated));
+    CHECK(fails_with("\xf0\x9f\x98", error::Truncated));
+
+    // A continuation byte that isn't one is invalid even when the input ends right after it
+    CHECK(fails_with("\xe3" "a", error::InvalidSequence));
+    CHECK(fails_with("\xe3\x41\x81", error::InvalidSequence));
+
+    // Stray continuation bytes and lead bytes that are never valid
+    CHECK(fails_with("\x80", error::InvalidSequence));
+    CHECK(fails_with("\xbf", error::InvalidSequence));
+    CHECK(fails_with("\xf8\x88\x80\x80\x80", error::InvalidSequence));
+    CHECK(fails_with("\xff", error::InvalidSequence));
+
+    // Overlong forms of '/' and of the largest code points of each shorter length
+    CHECK(fails_with("\xc0\xaf", error::InvalidSequence));
+    CHECK(fails_with("\xc1\xbf", error::InvalidSequence));
+    CHECK(fails_with("\xe0\x80\xaf", error::InvalidSequence));
+    CHECK(fails_with("\xe0\x9f\xbf", error::InvalidSequence));
+    CHECK(fails_with("\xf0\x80\x80\xaf", error::InvalidSequence));
+    CHECK(fails_with("\xf0\x8f\xbf\xbf", error::InvalidSequence));
+
+    // Encoded UTF-16 surrogates and code points above U+10FFFF
+    CHECK(fails_with("\xed\xa0\x80", error::InvalidSequence));
+    CHECK(fails_with("\xed\xbf\xbf", error::InvalidSequence));
+    CHECK(fails_with("\xed\xa0\xbd\xed\xb8\x80", error::InvalidSequence));
+    CHECK(fails_with("\xf4\x90\x80\x80", error::InvalidSequence));
+    CHECK(fails_with("\xf5\x80\x80\x80", error::InvalidSequence));
+
+    // Errors after and between ASCII runs longer than a vector block
+    CHECK(encoding::validate(ascii + "é" + ascii + "\U0001D11E" + ascii));
+    CHECK(fails_with(ascii + "\xe3\x81", error::Truncated));
+    CHECK(fails_with(ascii + "é" + ascii + "\xc0\xaf" + ascii, error::InvalidSequence));
+    CHECK(fails_with(ascii + "é" + ascii + "\xed\xa0\x80", error::InvalidSequence));
+
+    // Within a run of multi-byte characters with no ASCII at all
+    std::string accents = repeat<char>("é", 40);
+    CHECK(encoding::validate(accents));
+    CHECK(fails_with(accents + "\xe3", error::Truncated));
+    CHECK(fails_with(accents + "\x80" + accents, error::InvalidSequence));
+}
+
+static void test_transcode() {
+    using encoding::error;
+
+    // Every ASCII prefix length around the block size, then a character of every width
+    for (size_t length = 0; length <= 40; ++length) {
+        std::string prefix = ascii.substr(0, length);
+        std::u16string prefix16 = ascii16.substr(0, length);
+
+        std::string narrow = prefix + "é日\U0001D11E" + prefix;
+        std::u16string wide = prefix16 + u"é日\U0001D11E" + prefix16;
+
+        CHECK(encoding::transcode<enc::narrow, enc::utf16>(narrow) == wide);
+        CHECK(encoding::transcode<enc::utf16, enc::narrow>(wide) == narrow);
+        CHECK(encoding::transcode<enc::utf16, enc::utf32>(wide) == encoding::convert<enc::utf32>(narrow));
+        CHECK(encoding::convert<enc::narrow>(encoding::convert<enc::utf32>(narrow)) == narrow);
+    }
+
+    std::string accents = repeat<char>("é", 40);
+    std::u16string accents16 = repeat<char16_t>(u"é", 40);
+    CHECK(encoding::transcode<enc::narrow, enc::utf16>(accents) == accents16);
+    CHECK(encoding::transcode<enc::utf16, enc::narrow>(accents16) == accents);
+
+    // The validating conversion reports the error instead of replacing it
+    auto truncated = encoding::transcode<enc::narrow, enc::utf16>(ascii + "\xe3\x81");
+    CHECK(!truncated && truncated.error() == error::Truncated);
+
+    std::u16string unpaired = ascii16 + char16_t(0xD800) + ascii16;
+    auto surrogate = encoding::transcode<enc::utf16, enc::narrow>(unpaired);
+    CHECK(!surrogate && surrogate.error() == error::UnpairedSurrogate);
+
+    std::u32string too_large = U"a" + std::u32string(1, char32_t(0x110000));
+    auto invalid = encoding::transcode<enc::utf32, enc::utf16>(too_large);
+    CHECK(!invalid && invalid.error() == error::InvalidCodePoint);
+}
+
+static void test_replacement() {
+    // A truncated sequence is replaced once, bytes that can't start or continue a sequence each once
+    CHECK(encoding::convert<enc::utf16>(std::string_view { "a\xff" "b" }) == u"a�b");
+    CHECK(encoding::convert<enc::utf16>(std::string_view { "\xe3\x81" }) == u"�");
+    CHECK(encoding::convert<enc::utf16>(std::string_view { "\xc0\xaf" }) == u"��");
+    CHECK(encoding::convert<enc::utf16>(std::string_view { "\xed\xa0\x80" }) == u"���");
+    CHECK(encoding::convert<enc::utf32>(std::string_view { "\xf4\x90\x80\x80" "a" }) == U"����a");
+
+    // Replacements in the middle of long inputs keep the text around them intact
+    std::string narrow = ascii + "\xe3\x81" + ascii + "é" + ascii + "\x80";
+    CHECK(encoding::convert<enc::utf16>(narrow) == ascii16 + u"�" + ascii16 + u"é" + ascii16 + u"�");
+
+    std::string accents = repeat<char>("é", 20);
+    std::u16string accents16 = repeat<char16_t>(u"é", 20);
+    CHECK(encoding::convert<enc::utf16>(accents + "\xc3" + accents) == accents16 + u"�" + accents16);
+
+    // Unpaired surrogates and invalid code points are replaced when converting back to UTF-8
+    std::u16string unpaired = ascii16 + char16_t(0xDC00) + ascii16 + char16_t(0xD800);
+    CHECK(encoding::convert<enc::narrow>(unpaired) == ascii + "�" + ascii + "�");
+
+    std::u32string invalid = U"a" + std::u32string(1, char32_t(0xD800)) + std::u32string(1, char32_t(0x110000)) + U"b";
+    CHECK(encoding::convert<enc::narrow>(invalid) == "a��b");
+}
+
+int main() {
+    test_validate();
+    test_transcode();
+    test_replacement();
+
+    if (failures > 0) {
+        std::cerr << failures << " checks failed\n";
+        return 1;
+    }
+
+    std::cout << "encoding: all checks passed\n";
+    return 0;
+}
@@ -0,0 +1,181 @@
+// Tests of the C interface in ext/post_query/libpost_query.h, run by `rake test:lib`
+// Written in plain C so that the header is also checked to compile without C++
+
+#include "libpost_query.h"
+
+#include <stdio.h>
+#include <string.h>
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: check failed: %s (last error: %s)\n", __FILE__, __LINE__, #cond, pq_last_error()); \
+        ++failures; \
+    } \
+} while (0)
+
+#define CHECK_STATUS(expr, expected) CHECK((expr) == (expected))
+
+static const char* const metatags[] = { "rating", "score" };
+
+// Queries and their `PostQuery.parse(query, metatags: ["rating", "score"]).to_cnf.to_infix`
+static const char* const normalized[][2] = {
+    { "a b", "a b" },
+    { "a or b c", "(a or b) (a or c)" },
+    { "(a or b) (c or -d)", "(-d or c) (a or b)" },
+    { "-(a b)", "-a or -b" },
+    { "rating:s score:>5", "rating:s score:>5" },
+    { "~a ~b c", "(a or b) c" },
+    { "", "" },
+};
+
+static void test_version(void) {
+    CHECK(pq_abi_version() == PQ_ABI_VERSION);
+    CHECK(strcmp(pq_status_string(PQ_OK), "ok") == 0);
+    CHECK(strcmp(pq_status_string(PQ_ERROR_BUFFER_TOO_SMALL), "buffer too small") == 0);
+}
+
+static void test_parse_errors(pq_parser* parser) {
+    pq_query* query = NULL;
+
+    // Invalid UTF-8: a bad lead byte, a truncated sequence and an encoded surrogate
+    CHECK_STATUS(pq_parse(parser, "a \xff", 3, &query), PQ_ERROR_INVALID_ARGUMENT);
+    CHECK(strstr(pq_last_error(), "invalid UTF-8") != NULL);
+    CHECK_STATUS(pq_parse(parser, "a \xe3\x81", 4, &query), PQ_ERROR_INVALID_ARGUMENT);
+    CHECK(strstr(pq_last_error(), "truncated") != NULL);
+    CHECK_STATUS(pq_parse(parser, "\xed\xa0\x80", 3, &query), PQ_ERROR_INVALID_ARGUMENT);
+    CHECK(query == NULL);
+
+    // The length is explicit, a null byte is only another invalid tag character
+    CHECK_STATUS(pq_parse(parser, "a\0b", 3, &query), PQ_OK);
+    pq_query_free(query);
+    query = NULL;
+
+    CHECK_STATUS(pq_parse(NULL, "a", 1, &query), PQ_ERROR_INVALID_ARGUMENT);
+    CHECK_STATUS(pq_parse(parser, "a", 1, NULL), PQ_ERROR_INVALID_ARGUMENT);
+    CHECK_STATUS(pq_parse(parser, NULL, 1, &query), PQ_ERROR_INVALID_ARGUMENT);
+    CHECK(query == NULL);
+
+    // A null string of length 0 is the empty query
+    CHECK_STATUS(pq_parse(parser, NULL, 0, &query), PQ_OK);
+    pq_query_free(query);
+    query = NULL;
+
+    // Unbalanced parentheses are reported as `none` like in Ruby, never as PQ_ERROR_UNCLOSED_PARENS
+    static const char* const unbalanced[] = { "(a", "a (b", "((a) b", "-(a or b" };
+    for (size_t i = 0; i < sizeof(unbalanced) / sizeof(unbalanced[0]); ++i) {
+        char buffer[16];
+        size_t length = 0;
+
+        CHECK_STATUS(pq_normalize(parser, unbalanced[i], strlen(unbalanced[i]), buffer, sizeof(buffer), &length), PQ_OK);
+        CHECK(strcmp(buffer, "none") == 0);
+    }
+
+    pq_parser* bad = NULL;
+    const char* const bad_metatags[] = { "rating", "\xc0\xaf" };
+    CHECK_STATUS(pq_parser_new(bad_metatags, 2, PQ_PARSER_DEFAULT, &bad), PQ_ERROR_INVALID_ARGUMENT);
+    CHECK_STATUS(pq_parser_new(NULL, 2, PQ_PARSER_DEFAULT, NULL), PQ_ERROR_INVALID_ARGUMENT);
+    CHECK(bad == NULL);
+}
+
+static void test_buffers(pq_parser* parser) {
+    const char* input = "a or b c";
+    const char* expected = "(a or b) (a or c)";
+    size_t expected_length = strlen(expected);
+
+    pq_query* query = NULL;
+    CHECK_STATUS(pq_parse(parser, input, strlen(input), &query), PQ_OK);
+    CHECK_STATUS(pq_query_to_cnf(query), PQ_OK);
+
+    // A null buffer with zero capacity only queries the length
+    size_t length = 0;
+    CHECK_STATUS(pq_query_to_infix(query, NULL, 0, &length), PQ_ERROR_BUFFER_TOO_SMALL);
+    CHECK(length == expected_length);
+
+    // There has to be room for the null byte, a short buffer is left untouched
+    char buffer[64];
+    memset(buffer, 'x', sizeof(buffer));
+    length = 0;
+    CHECK_STATUS(pq_query_to_infix(query, buffer, expected_length, &length), PQ_ERROR_BUFFER_TOO_SMALL);
+    CHECK(length == expected_length);
+    CHECK(buffer[0] == 'x');
+
+    CHECK_STATUS(pq_query_to_infix(query, buffer, expected_length + 1, &length), PQ_OK);
+    CHECK(length == expected_length);
+    CHECK(strcmp(buffer, expected) == 0);
+
+    CHECK_STATUS(pq_query_to_infix(query, NULL, 16, &length), PQ_ERROR_INVALID_ARGUMENT);
+    CHECK_STATUS(pq_query_to_infix(query, buffer, sizeof(buffer), NULL), PQ_ERROR_INVALID_ARGUMENT);
+    CHECK_STATUS(pq_query_to_infix(NULL, buffer, sizeof(buffer), &length), PQ_ERROR_INVALID_ARGUMENT);
+
+    CHECK_STATUS(pq_query_to_sexp(query, NULL, 0, &length), PQ_ERROR_BUFFER_TOO_SMALL);
+    CHECK(length < sizeof(buffer));
+    CHECK_STATUS(pq_query_to_sexp(query, buffer, length + 1, &length), PQ_OK);
+    CHECK(strcmp(buffer, "(and (or a b) (or a c))") == 0);
+
+    CHECK_STATUS(pq_normalize(parser, input, strlen(input), NULL, 0, &length), PQ_ERROR_BUFFER_TOO_SMALL);
+    CHECK(length == expected_length);
+
+    pq_query_free(query);
+}
+
+static void test_normalize(pq_parser* parser) {
+    for (size_t i = 0; i < sizeof(normalized) / sizeof(normalized[0]); ++i) {
+        const char* input = normalized[i][0];
+        const char* expected = normalized[i][1];
+
+        char buffer[64];
+        size_t length = 0;
+        CHECK_STATUS(pq_normalize(parser, input, strlen(input), buffer, sizeof(buffer), &length), PQ_OK);
+        CHECK(strcmp(buffer, expected) == 0);
+        CHECK(length == strlen(expected));
+
+        // The same as parsing, converting and serializing step by step, the copy isn't affected by the conversion
+        pq_query* query = NULL;
+        pq_query* copy = NULL;
+        CHECK_STATUS(pq_parse(parser, input, strlen(input), &query), PQ_OK);
+        CHECK_STATUS(pq_query_copy(query, &copy), PQ_OK);
+        CHECK_STATUS(pq_query_to_cnf(query), PQ_OK);
+
+        char stepwise[64];
+        CHECK_STATUS(pq_query_to_infix(query, stepwise, sizeof(stepwise), &length), PQ_OK);
+        CHECK(strcmp(stepwise, buffer) == 0);
+
+        CHECK_STATUS(pq_query_to_cnf(copy), PQ_OK);
+        CHECK_STATUS(pq_query_to_infix(copy, stepwise, sizeof(stepwise), &length), PQ_OK);
+        CHECK(strcmp(stepwise, buffer) == 0);
+
+        pq_query_free(copy);
+        pq_query_free(query);
+    }
+
+    CHECK_STATUS(pq_normalize(NULL, "a", 1, NULL, 0, NULL), PQ_ERROR_INVALID_ARGUMENT);
+}
+
+int main(void) {
+    pq_parser* parser = NULL;
+    if (pq_parser_new(metatags, sizeof(metatags) / sizeof(metatags[0]), PQ_PARSER_DEFAULT, &parser) != PQ_OK) {
+        fprintf(stderr, "pq_parser_new: %s\n", pq_last_error());
+        return 1;
+    }
+
+    test_version();
+    test_parse_errors(parser);
+    test_buffers(parser);
+    test_normalize(parser);
+
+    pq_parser_free(parser);
+
+    // Freeing null is a no-op like free()
+    pq_query_free(NULL);
+    pq_parser_free(NULL);
+
+    if (failures > 0) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+
+    printf("libpost_query: all checks passed\n");
+    return 0;
+}
@@ -22,8 +22,11 @@ METATAGS = [
 ]
 
 require "./lib/post_query"
+require "objspace"
+require "json"
 
-if true
+# POST_QUERY_DUMP="a and" prints the raw and CNF trees of a query instead of running the tests
+if ENV["POST_QUERY_DUMP"]
   def dump(title, node)
     puts "#{title}: #{node.inspect}"
     puts "   > infix -> [#{node.to_infix}]"
@@ -37,7 +40,7 @@ if true
     dump("CNF", parsed.to_cnf)
   end
 
-  test "a and"
+  test ENV["POST_QUERY_DUMP"]
 else
   require "minitest/autorun"
 
@@ -419,6 +422,42 @@ else
       assert_parse_equals("(and (or (not a) (not c) (not d)) (or (not a) b))", "-(a -(b -(c d)))")
     end
 
+    def test_wide_distribution
+      # 8^4 clauses, large enough to be distributed in parallel on machines with more than one core
+      query = %w[a b c d].map { |group| "(" + (1..8).map { |i| "#{group}#{i}" }.join(" ") + ")" }.join(" or ")
+      clauses = PostQuery.parse(query).to_cnf.children
+
+      assert_equal(4096, clauses.size)
+      assert_equal("(or a1 b1 c1 d1)", clauses.first.to_sexp)
+      assert_equal("(or a3 b4 c3 d3)", clauses[1234].to_sexp)
+      assert_equal("(or a8 b8 c8 d8)", clauses.last.to_sexp)
+      assert_equal(clauses.map(&:to_sexp).sort, clauses.map(&:to_sexp))
+    end
+
+    def test_normal_forms
+      form = ->(input, method) { PostQuery.parse(input).send(method).to_sexp }
+
+      assert_equal("(or (and a b c) (and d e f))", form.("(a b c) or (d e f)", :to_nnf))
+      assert_equal("(or (and a b c) (and d e f))", form.("(a b c) or (d e f)", :to_dnf))
+      assert_equal("(and (or a d) (or a e) (or a f) (or b d) (or b e) (or b f) (or c d) (or c e) (or c f))", form.("(a b c) or (d e f)", :to_cnf))
+
+      assert_equal("(or (and a c) (and a d) (and b c) (and b d))", form.("(a or b) (c or d)", :to_dnf))
+      assert_equal("(and (or (not a) (not b)) c)", form.("-(a b) c", :to_nnf))
+      assert_equal("(or (and (not a) c) (and (not b) c))", form.("-(a b) c", :to_dnf))
+      assert_equal("(or (and a c) (and b c))", form.("~a ~b c", :to_dnf))
+
+      best = ->(input, max_nodes) do
+        ast = PostQuery.parse(input)
+        [ast.to_best_form(max_nodes: max_nodes), ast.to_sexp]
+      end
+
+      assert_equal([:dnf, "(or (and a b c) (and d e f))"], best.("(a b c) or (d e f)", 100))
+      assert_equal([:cnf, "(and (or a b) (or c d))"], best.("(a or b) (c or d)", 100))
+      assert_equal([:cnf, "a"], best.("a", 1))
+      assert_equal([:nnf, "(and (or (and a b) (and c d)) (or (and e f) (and g h)))"], best.("((a b) or (c d)) ((e f) or (g h))", 20))
+      assert_equal(:dnf, best.("((a b) or (c d)) ((e f) or (g h))", 25).first)
+    end
+
     def test_error
       assert_parse_equals("none", "(")
       assert_parse_equals("none", ")")
@@ -452,5 +491,427 @@ else
       assert_parse_equals("none", 'source:"foo')
       assert_parse_equals("none", 'source:"foo bar')
     end
+
+    def test_deep_nesting
+      depth = 5_000
+
+      assert_parse_equals("a", "(" * depth + "a" + ")" * depth)
+      assert_parse_equals("(not a)", "-(" * (depth + 1) + "a" + ")" * (depth + 1))
+      assert_parse_equals("(or #{(1..depth).map { |i| "t#{i}" }.sort.join(" ")})", (1..depth).map { |i| "t#{i}" }.join(" or "))
+      assert_parse_equals("(and #{(1..depth).map { |i| "t#{i}" }.sort.join(" ")})", (1..depth).map { |i| "t#{i}" }.join(" and "))
+      assert_parse_equals("none", "(" * depth + "a")
+    end
+
+    def test_aliases
+      PostQuery.load_aliases({ "kitty" => "cat", "Doggo" => "dog", "puppy" => "dog" })
+
+      assert_equal("(and cat dog)", PostQuery.parse("kitty doggo", metatags: METATAGS).normalize_aliases.to_cnf.to_sexp)
+      assert_equal("(or (not cat) dog)", PostQuery.parse("-kitty or puppy", metatags: METATAGS).normalize_aliases.to_cnf.to_sexp)
+      assert_equal("(and source:kitty cat)", PostQuery.parse("source:kitty cat", metatags: METATAGS).normalize_aliases.to_cnf.to_sexp)
+
+      # Reloading replaces the whole table
+      assert_equal(1, PostQuery.load_aliases({ "dog" => "canine" }))
+      assert_equal("(and canine kitty)", PostQuery.parse("kitty dog", metatags: METATAGS).normalize_aliases.to_cnf.to_sexp)
+    ensure
+      PostQuery.load_aliases({})
+    end
+
+    def typed_value(input)
+      PostQuery.parse(input, metatags: METATAGS, typed: true).to_cnf.typed_value
+    end
+
+    def test_typed_values
+      assert_equal({ type: :integer, ranges: [{ min: 10, max: nil, min_inclusive: true, max_inclusive: true }] }, typed_value("score:>=10"))
+      assert_equal({ type: :integer, ranges: [{ min: nil, max: 5, min_inclusive: true, max_inclusive: false }] }, typed_value("score:<5"))
+      assert_equal({ type: :integer, ranges: [{ min: 100, max: 200, min_inclusive: true, max_inclusive: true }] }, typed_value("id:100..200"))
+      assert_equal([1, 2, 3], typed_value("id:1,2,3")[:ranges].map { |r| r[:min] })
+      assert_equal({ type: :size, ranges: [{ min: 1024 * 1024, max: nil, min_inclusive: true, max_inclusive: true }] }, typed_value("filesize:1mb.."))
+      assert_equal({ type: :float, ranges: [{ min: nil, max: 2.5, min_inclusive: true, max_inclusive: false }] }, typed_value("mpixels:<2.5"))
+      assert_equal(16.0 / 9, typed_value("ratio:16:9")[:ranges].first[:min])
+      assert_equal(3, typed_value("comments:3")[:ranges].first[:min])
+
+      date = typed_value("date:2024-01-01..2024-02-01")
+      assert_equal(:date, date[:type])
+      assert_equal(Time.utc(2024, 1, 1), date[:ranges].first[:min])
+      assert_equal(Time.utc(2024, 2, 1), date[:ranges].first[:max])
+
+      assert_equal({ error: 'invalid integer value "abc"' }, typed_value("score:abc"))
+      assert_equal({ error: 'invalid date value "2024-13-01"' }, typed_value("date:2024-13-01"))
+
+      # Non-finite bounds can't be ordered, so nan and inf are rejected like any other invalid number
+      assert_equal({ error: 'invalid float value "nan"' }, typed_value("mpixels:nan"))
+      assert_equal({ error: 'invalid float value "inf"' }, typed_value("mpixels:>inf"))
+      assert_equal({ error: 'invalid float value "-infinity"' }, typed_value("mpixels:-infinity..1"))
+      assert_equal({ error: 'invalid ratio value "inf:inf"' }, typed_value("ratio:inf:inf"))
+      assert_equal({ error: 'invalid ratio value "1e308:1e-308"' }, typed_value("ratio:1e308:1e-308"))
+      assert_equal({ error: 'invalid size value "1e300gb"' }, typed_value("filesize:1e300gb"))
+      assert_nil(typed_value("source:foo"))
+      assert_nil(PostQuery.parse("score:5", metatags: METATAGS).to_cnf.typed_value)
+    end
+
+    def prune(input)
+      PostQuery.parse(input, metatags: METATAGS).to_cnf.prune_ranges.to_sexp
+    end
+
+    def test_prune_ranges
+      assert_equal("score:>10", prune("score:>5 score:>10"))
+      assert_equal("id:<500", prune("id:<1000 id:<500"))
+      assert_equal("none", prune("width:>100 width:<50"))
+      assert_equal("none", prune("a width:>100 width:<50 b"))
+      assert_equal("none", prune("score:5 score:>5"))
+      assert_equal("score:5", prune("score:5 score:>=5 score:<=5"))
+      assert_equal("(and id:100..200 id:>150)", prune("id:100..200 id:>150 id:>0"))
+      assert_equal("(and score:>10 width:<5 a)", prune("score:>10 a width:<5 score:>1 width:<50"))
+
+      # Lists, non-range and unparsable values are left alone
+      assert_equal("(and score:1,2 score:>5)", prune("score:1,2 score:>5"))
+      assert_equal("(and limit:10 limit:20)", prune("limit:10 limit:20"))
+      assert_equal("(and score:>5 score:abc)", prune("score:>5 score:abc"))
+      assert_equal("(and mpixels:>1 mpixels:nan)", prune("mpixels:nan mpixels:>1"))
+      assert_equal("(and mpixels:>1 mpixels:inf)", prune("mpixels:inf mpixels:>1"))
+
+      # Only conjunctions are intersected, CNF clauses are disjunctions
+      assert_equal("(and (or score:<1 a) (or score:>5 a))", prune("a or (score:>5 score:<1)"))
+
+      # Outside of CNF an empty conjunction only removes itself
+      assert_equal("a", PostQuery.parse("(score:>5 score:<1) or a", metatags: METATAGS).prune_ranges.to_sexp)
+    end
+
+    def test_factor
+      factor = ->(q) { PostQuery.parse(q, metatags: METATAGS).factor.to_sexp }
+
+      assert_equal("(and (or b c d) a)", factor["(a b) or (a c) or (a d)"])
+      assert_equal("(or (and b c) a)", factor["(a or b) (a or c)"])
+      assert_equal("(and (or c d) a b)", factor["(a b c) or (a b d)"])
+      assert_equal("(and (or a d) (or b c))", factor["(a b) or (a c) or (d b) or (d c)"])
+      assert_equal("(and (not source:x) (or score:>5 b))", factor["(-source:x b) or (score:>5 -source:x)"])
+      assert_equal("a", factor["a or (a b)"])
+
+      # Only applied when the result is smaller
+      assert_equal("(or (and a b c) (and a d e))", factor["(a b c) or (a d e)"])
+
+      # Optional terms stay with their siblings
+      assert_equal("(or (and (opt a) (opt b) c) (and (opt a) d))", factor["(~a ~b c) or (~a d)"])
+
+      # Undoes distribution
+      cnf = PostQuery.parse("(a b) or (c d) or (e f)").to_cnf
+      assert_equal(8, cnf.children.size)
+      assert_equal("(or (and a b) (and c d) (and e f))", cnf.factor.to_sexp)
+
+      assert_raises(FrozenError) { PostQuery.parse("a").freeze.factor }
+    end
+
+    def test_specialize
+      facts = { "rating" => "g", "fav" => false, "score" => 10, "cat_ears" => true }
+      specialize = ->(q) { PostQuery.parse(q, metatags: METATAGS).specialize(facts).to_cnf.to_sexp }
+
+      assert_equal("a", specialize["rating:g a"])
+      assert_equal("all", specialize["rating:G,s"])
+      assert_equal("none", specialize["rating:q a"])
+      assert_equal("a", specialize["-rating:q a"])
+      assert_equal("b", specialize["rating:q or b"])
+      assert_equal("none", specialize["fav:me a"])
+      assert_equal("solo", specialize["cat_ears solo"])
+      assert_equal("(and a c)", specialize["(a or (b -cat_ears)) c"])
+      assert_equal("x", specialize["score:>5 x"])
+      assert_equal("none", specialize["score:<5 x"])
+      assert_equal("(wildcard cat_*)", specialize["cat_*"])
+
+      # Optional terms form a single `or` with their siblings
+      assert_equal("c", specialize["~rating:g ~b c"])
+      assert_equal("(and b c)", specialize["~rating:q ~b c"])
+      assert_equal("none", specialize["~rating:q ~fav:me c"])
+      assert_equal("(and b c)", specialize["~c (~b ~rating:q)"])
+
+      # An optional term alone in parentheses is required, folding must not move it into the outer group
+      assert_equal("(and a b)", specialize["(~a) ~b"])
+      assert_equal("(and a b x)", specialize["x (~a) ~b"])
+
+      assert_raises(TypeError) { PostQuery.parse("a").specialize("a" => "b") }
+      assert_raises(FrozenError) { PostQuery.parse("a").freeze.specialize({}) }
+
+      # A bad fact raises without applying the ones before it
+      ast = PostQuery.parse("a rating:g", metatags: METATAGS)
+      error = assert_raises(TypeError) { ast.specialize("a" => true, "rating" => []) }
+      assert_equal("fact for metatag rating must be true, false, a String or a Numeric", error.message)
+      assert_equal("(and rating:g a)", ast.to_cnf.to_sexp)
+      assert_raises(TypeError) { ast.specialize(1 => true) }
+      assert_raises(PostQuery::Error) { ast.specialize("rating" => "\xff".b.force_encoding("UTF-8")) }
+    end
+
+    def test_rules
+      rules = PostQuery::RuleSet.new({
+        "status:any" => "",
+        "fav:$user" => "ordfav:$user",
+        "old_tag" => "new_tag",
+        "new_tag" => "newest_tag",
+        "$tag $tag" => "$tag",
+        "rating:$r -rating:$r" => "",
+        "a b" => "ab",
+      }, metatags: METATAGS)
+      apply = ->(q) { PostQuery.parse(q, metatags: METATAGS).apply_rules(rules).to_sexp }
+
+      assert_equal(7, rules.size)
+      assert_equal("a", apply["status:any a"])
+      assert_equal("ordfav:me", apply["fav:me"])
+      assert_equal("(and newest_tag b)", apply["old_tag b"])
+      assert_equal("c", apply["c c"])
+      assert_equal("(and c d)", apply["c d"])
+      assert_equal("all", apply["rating:e -rating:e"])
+      assert_equal("(and rating:e (not rating:s))", apply["rating:e -rating:s"])
+      assert_equal("ab", apply["a b"])
+      assert_equal("(and b a)", apply["b a"])
+      assert_equal("(and (opt ordfav:x) (opt y))", apply["~fav:x ~y"])
+      assert_equal({ "status:any" => 1, "fav:$user" => 2, "old_tag" => 1, "new_tag" => 1, "$tag $tag" => 1, "rating:$r -rating:$r" => 1, "a b" => 1 },
+                   rules.hits)
+
+      rules.reset_hits
+      assert_equal([0], rules.hits.values.uniq)
+
+      # Cycles are cut off and leave the query untouched
+      cyclic = PostQuery::RuleSet.new({ "a" => "b", "b" => "a" })
+      ast = PostQuery.parse("a c")
+      assert_raises(PostQuery::Error) { ast.apply_rules(cyclic, max_rewrites: 50) }
+      assert_equal("(and a c)", ast.to_sexp)
+      assert_equal({ "a" => 0, "b" => 0 }, cyclic.hits)
+
+      error = assert_raises(PostQuery::Error) { PostQuery::RuleSet.new({ "$x" => "$y" }) }
+      assert_equal('$y is not captured by "$x"', error.message)
+      assert_raises(PostQuery::Error) { PostQuery::RuleSet.new({ "" => "a" }) }
+      assert_raises(TypeError) { PostQuery::RuleSet.new({ "a" => 1 }) }
+      assert_raises(TypeError) { PostQuery::RuleSet.new({ "a" => "b" }, metatags: [1]) }
+    end
+
+    def test_token_at
+      parser = PostQuery::Parser.new(metatags: METATAGS)
+      query = "cat_ears (solo or -comments:>5) ~order:score_desc"
+
+      assert_equal({ kind: :tag, begin: 0, end: 8, text: "cat_ears", depth: 0, prefix: nil, operator: :and }, parser.token_at(query, 8))
+      assert_equal({ kind: :tag, begin: 10, end: 14, text: "solo", depth: 1, prefix: nil, operator: :or }, parser.token_at(query, 12))
+      assert_equal(:lparen, parser.token_at(query, 9)[:kind])
+      assert_nil(parser.token_at("a  b", 2))
+
+      token = parser.token_at(query, 22)
+      assert_equal([:metatag, "comments", ">5", :name, :not, :or],
+                   token.values_at(:kind, :name, :value, :part, :prefix, :operator))
+      assert_equal(:value, parser.token_at(query, 29)[:part])
+      assert_equal(:opt, parser.token_at(query, 40)[:prefix])
+      assert_raises(IndexError) { parser.token_at(query, query.bytesize + 1) }
+
+      # Typing at the end only lexes the last word again
+      typed = "a b c d e f"
+      typed.size.times { |i| parser.token_at(typed[0..i], i + 1) }
+      assert_equal(5, parser.reused_tokens)
+
+      # Edits anywhere give the same result as a fresh parser
+      ["a (b or c) d", "a (b or cd) d", "a -(b or cd) d", "x -(b or cd) d"].each do |edited|
+        (0..edited.bytesize).each do |offset|
+          assert_equal(PostQuery::Parser.new(metatags: METATAGS).token_at(edited, offset), parser.token_at(edited, offset))
+        end
+      end
+    end
+
+    def test_plan
+      counts = { "rare" => 10, "common" => 100_000, "medium" => 5_000 }
+      ast = PostQuery.parse("common -medium source:*pixiv* rare", metatags: METATAGS)
+      plan = ast.plan(counts, metatag_costs: { "source" => 20 }, total_posts: 1_000_000)
+
+      assert_equal(["rare", "common", "(not medium)", "source:*pixiv*"], plan.map { |c| c[:clause].to_sexp })
+      assert_equal([10.0, 100_000.0, 995_000.0, 500_000.0], plan.map { |c| c[:cardinality] })
+      assert_equal([true, false, false, false], plan.map { |c| c[:driving] })
+
+      # The canonical form is still available
+      assert_equal("(and source:*pixiv* (not medium) common rare)", ast.to_cnf.to_sexp)
+
+      plan = PostQuery.parse("-a -b", metatags: METATAGS).plan({ "a" => 1, "b" => 2 }, total_posts: 10)
+      assert_equal(["(not b)", "(not a)"], plan.map { |c| c[:clause].to_sexp })
+      assert(plan.none? { |c| c[:driving] })
+    end
+
+    def test_query_set
+      queries = ["a b", "a -c", "rating:e", "cat_* -dog", "(x or y) score:>5", "-a", PostQuery.parse("b or y")]
+      set = PostQuery::QuerySet.new(queries, metatags: METATAGS)
+      assert_equal(7, set.size)
+      assert_equal(9, set.literal_count)
+
+      assert_equal([0, 1, 6], set.match(%w[a b]))
+      assert_equal([0, 6], set.match("A B C"))
+      assert_equal([2, 3, 5], set.match(%w[cat_ears], "rating" => "e"))
+      assert_equal([5, 6], set.match(%w[cat_ears dog y], "score" => 3))
+      assert_equal([4, 5, 6], set.match(%w[dog y], "score" => 10))
+      assert_equal([5], set.match([]))
+      assert_equal([0, 6], set.match(%w[a], "b" => true, "c" => true))
+
+      # Metatags without a known value never match
+      assert_equal([5], set.match(%w[x]))
+
+      assert_equal([], PostQuery::QuerySet.new(["("]).match(%w[a]))
+      assert_raises(TypeError) { set.match(%w[a], "b" => "c") }
+      assert_raises(TypeError) { set.match([1], {}) }
+    end
+
+    def test_node_api
+      ast = PostQuery.parse("a -source:foo", metatags: METATAGS).to_cnf
+      assert_equal(:and, ast.type)
+
+      not_node, tag = ast.children
+      assert_equal(:tag, tag.type)
+      assert_equal("a", tag.name)
+
+      metatag = not_node.children.first
+      assert_equal(:metatag, metatag.type)
+      assert_equal("source", metatag.name)
+      assert_equal("foo", metatag.value)
+      refute(metatag.quoted?)
+    end
+
+    def test_json
+      ast = PostQuery.parse("a* -source:\"x \\\"y\\\"\ttab\u0001\" ~b", metatags: METATAGS)
+      expected = {
+        "type" => "and",
+        "children" => [
+          { "type" => "wildcard", "name" => "a*" },
+          { "type" => "not", "children" => [{ "type" => "metatag", "name" => "source", "value" => "x \"y\"\ttab\u0001", "quoted" => true }] },
+          { "type" => "opt", "children" => [{ "type" => "tag", "name" => "b" }] },
+        ],
+      }
+
+      hash = ast.to_h
+      assert_equal(expected, hash)
+      assert(hash.keys.all?(&:frozen?))
+      assert_same(hash.keys.first, hash["children"].first.keys.first)
+
+      json = ast.to_json
+      assert_equal(Encoding::UTF_8, json.encoding)
+      assert_equal(expected, JSON.parse(json))
+      assert_equal(JSON.generate(expected), json)
+      assert_equal(%({"query":#{json}}), JSON.generate({ query: ast }))
+      assert_equal('{"type":"none"}', PostQuery.parse("(", metatags: METATAGS).to_json)
+    end
+
+    def test_metatag_registry
+      assert_equal(METATAGS.sort, PostQuery.metatags.sort)
+      assert_equal("(and comment_count:>5 order:note_count_desc source:foo)",
+                   PostQuery.parse("Comments:>5 order:notes_desc source:foo").to_cnf.to_sexp)
+      assert_equal("(and foo:bar)", PostQuery.parse("foo:bar").to_sexp)
+      assert_equal(:tag, PostQuery.parse("source:foo", metatags: []).to_cnf.type)
+
+      assert_equal({ name: "comment_count", synonyms: ["comments"], type: :integer, single_valued: false, orderable: true },
+                   PostQuery.metatag_info("comments"))
+      assert(PostQuery.metatag_info("order")[:single_valued])
+      assert_nil(PostQuery.metatag_info("foo"))
+    end
+
+    def test_fingerprint
+      fingerprint = ->(q) { PostQuery.parse(q, metatags: METATAGS).fingerprint }
+
+      # Pinned, these are used as persistent cache keys
+      assert_equal("v1:10a4f5cd98995ac532eba2bfe8fa8f78", fingerprint["a b"])
+      assert_equal("v1:ab55dec1d26ade8eeec9bc6a95d21ca7", fingerprint["(a or b) -c score:>5"])
+
+      assert_equal(fingerprint["a b"], fingerprint["  B   A "])
+      assert_equal(fingerprint["(a or b) -c score:>5"], fingerprint["SCORE:>5 -c (b or a)"])
+      assert_equal(fingerprint["order:comment_count_desc"], fingerprint["order:comments_desc"])
+      assert_equal(fingerprint['source:"a b"'], fingerprint['source:a\ b'])
+
+      # Only tag and metatag names are case-insensitive, metatag values are hashed as written
+      assert_equal(fingerprint["rating:g"], fingerprint["RATING:g"])
+      refute_equal(fingerprint["rating:g"], fingerprint["rating:G"])
+      refute_equal(fingerprint["source:a"], fingerprint["source:A"])
+      refute_equal(fingerprint["a b"], fingerprint["a or b"])
+      refute_equal(fingerprint["a"], fingerprint["a*"])
+
+      # The receiver is not converted
+      ast = PostQuery.parse("~a ~b", metatags: METATAGS).freeze
+      assert_equal(PostQuery.parse("~a ~b", metatags: METATAGS).to_cnf.fingerprint, ast.fingerprint)
+      assert_equal("(and (opt a) (opt b))", ast.to_sexp)
+    end
+
+    def test_subsumption
+      subsumed = ->(lhs, rhs) { PostQuery.parse(lhs, metatags: METATAGS).subsumed_by?(PostQuery.parse(rhs, metatags: METATAGS)) }
+
+      assert(subsumed["cat_ears solo", "cat_ears"])
+      refute(subsumed["cat_ears", "cat_ears solo"])
+      assert(subsumed["a", "a or b"])
+      assert(subsumed["a -b", "-b"])
+      assert(subsumed["a", ""])
+      refute(subsumed["", "a"])
+      assert(subsumed["(a", "b"])
+
+      assert(subsumed["score:>10 a", "score:>5"])
+      refute(subsumed["score:>5", "score:>10"])
+      assert(subsumed["-score:>5", "-score:>10"])
+      assert(subsumed["score:12,15", "score:10..20"])
+      refute(subsumed["score:10..20", "score:12,15"])
+      refute(subsumed["score:>10", "favcount:>5"])
+
+      # Non-finite and empty ranges are never shown to be covered
+      refute(PostQuery.parse("mpixels:nan", metatags: METATAGS).to_cnf.subsumed_by?(PostQuery.parse("mpixels:5", metatags: METATAGS).to_cnf))
+      refute(subsumed["mpixels:nan", "mpixels:5"])
+      refute(subsumed["ratio:inf:inf", "ratio:1"])
+      refute(subsumed["score:10..5", "score:100"])
+
+      assert(PostQuery.parse("(a or b) c").equivalent?(PostQuery.parse("(c a) or (b c)")))
+      refute(PostQuery.parse("a").equivalent?(PostQuery.parse("a b")))
+      assert_raises(TypeError) { PostQuery.parse("a").subsumed_by?("a") }
+    end
+
+    def test_memsize
+      ast = PostQuery.parse((1..8).map { |i| "(a#{i} b#{i})" }.join(" or "), metatags: METATAGS)
+      before = ObjectSpace.memsize_of(ast)
+
+      # Distributing the `or` over every `and` produces 2^8 clauses
+      ast.to_cnf
+      assert_operator(ObjectSpace.memsize_of(ast), :>, before * 16)
+      assert_operator(ObjectSpace.memsize_of(PostQuery.parse("a", metatags: METATAGS)), :<, before)
+    end
+
+    def test_ractors
+      queries = ["a b", "(a or b) -c", "~a ~b score:>5", "-(a and (b or c))", "order:comments_desc d*"]
+      expected = queries.map { |q| PostQuery.parse(q, metatags: METATAGS).to_cnf.to_sexp }
+
+      shared = Ractor.make_shareable(PostQuery.parse("(x or y) z", metatags: METATAGS).to_cnf.freeze)
+      assert(Ractor.shareable?(shared))
+      assert_raises(FrozenError) { shared.to_cnf }
+
+      warning, Warning[:experimental] = Warning[:experimental], false
+      metatags = Ractor.make_shareable(METATAGS.dup)
+      ractors = 4.times.map do
+        Ractor.new(queries, metatags, shared) do |queries, metatags, shared|
+          results = 200.times.map do
+            queries.map { |q| PostQuery.parse(q, metatags: metatags).to_cnf.to_sexp }
+          end
+          [results.uniq, shared.to_sexp]
+        end
+      end
+
+      ractors.each do |ractor|
+        results, shared_sexp = ractor.take
+        assert_equal([expected], results)
+        assert_equal("(and (or x y) z)", shared_sexp)
+      end
+    ensure
+      Warning[:experimental] = warning
+    end
+
+    def test_stats
+      PostQuery.reset_stats
+      PostQuery.parse("a b", metatags: METATAGS).to_cnf
+      assert_equal(0, PostQuery.stats[:phases][:parse][:count])
+
+      PostQuery.stats_enabled = true
+      PostQuery.parse("(a and b) or c", metatags: METATAGS).to_cnf.to_sexp
+      PostQuery.stats_enabled = false
+
+      stats = PostQuery.stats
+      assert_equal(1, stats[:phases][:parse][:count])
+      assert_equal(1, stats[:phases][:serialize][:count])
+      assert_equal(1, stats[:phases][:parse][:histogram].values.sum)
+      assert_equal({ conversions: 1, nodes_before: 9, nodes_after: 7, simplify_iterations: 4, distributions: 1, distributed_clauses: 2 },
+                   stats[:counters])
+    ensure
+      PostQuery.stats_enabled = false
+      PostQuery.reset_stats
+    end
   end
 end
@@ -0,0 +1,397 @@
+// Normalizes a newline-delimited query log to CNF
+// Build through `rake tools`, run as `tmp/tools/normalize [options] LOG > normalized.tsv`
+//
+// Writes one TSV row per input line, in input order: original query, CNF s-expression, fingerprint, error
+// The log is memory-mapped and split into chunks of whole lines that worker threads normalize independently,
+// only a bounded window of chunks is ever held in memory while they wait to be written in order
+
+#include "../ext/post_query/parser.h"
+#include "../ext/post_query/encoding.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <charconv>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <format>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+namespace {
+    struct options {
+        std::string input;
+        std::string output;
+        std::string metatags;
+        size_t threads = std::max(1u, std::thread::hardware_concurrency());
+        size_t chunk_size = size_t(1) << 20;
+
+        // Chunks that may be normalized ahead of the one being written
+        size_t window = 0;
+    };
+
+    options parse_options(int argc, char** argv) {
+        options res;
+        auto usage = [&](int code) {
+            std::cerr << "usage: " << argv[0]
+                << " [--metatags FILE] [--output FILE.tsv] [--threads N] [--chunk-size BYTES] [--window CHUNKS] LOG\n";
+            std::exit(code);
+        };
+
+        for (int i = 1; i < argc; ++i) {
+            std::string_view arg = argv[i];
+            auto next = [&]() -> std::string {
+                if (i + 1 >= argc) {
+                    std::cerr << "missing value for " << arg << '\n';
+                    std::exit(1);
+                }
+                return argv[++i];
+            };
+            // The whole value has to be a positive number, `-3` or `4x` would otherwise be misread
+            auto count = [&]() -> size_t {
+                std::string value = next();
+
+                size_t res = 0;
+                auto [end, error] = std::from_chars(value.data(), value.data() + value.size(), res);
+                if (error != std::errc {} || end != value.data() + value.size() || res == 0) {
+                    std::cerr << "invalid value for " << arg << ": " << value << '\n';
+                    usage(1);
+                }
+
+                return res;
+            };
+
+            if (arg == "--metatags") {
+                res.metatags = next();
+            } else if (arg == "--output") {
+                res.output = next();
+            } else if (arg == "--threads") {
+                res.threads = count();
+            } else if (arg == "--chunk-size") {
+                res.chunk_size = count();
+            } else if (arg == "--window") {
+                res.window = count();
+            } else if (arg == "--help") {
+                usage(0);
+            } else if (res.input.empty() && !arg.starts_with("--")) {
+                res.input = arg;
+            } else {
+                usage(1);
+            }
+        }
+
+        if (res.input.empty()) {
+            usage(1);
+        }
+
+        if (res.window == 0) {
+            res.window = 4 * res.threads;
+        }
+
+        return res;
+    }
+
+    std::vector<std::string> read_lines(const std::string& path) {
+        std::ifstream file { path };
+        if (!file) {
+            std::cerr << "failed to open " << path << '\n';
+            std::exit(1);
+        }
+
+        std::vector<std::string> res;
+        for (std::string line; std::getline(file, line);) {
+            if (!line.empty()) {
+                res.emplace_back(std::move(line));
+            }
+        }
+
+        return res;
+    }
+
+    // Read-only view of a whole file
+    class mapped_file {
+        private:
+        const char* _data = nullptr;
+        size_t _size = 0;
+
+        public:
+        explicit mapped_file(const std::string& path) {
+            int fd = open(path.c_str(), O_RDONLY);
+            if (fd < 0) {
+                std::cerr << "failed to open " << path << ": " << std::strerror(errno) << '\n';
+                std::exit(1);
+            }
+
+            struct stat st;
+            if (fstat(fd, &st) != 0) {
+                std::cerr << "failed to stat " << path << ": " << std::strerror(errno) << '\n';
+                std::exit(1);
+            }
+
+            // Empty files can't be mapped
+            _size = size_t(st.st_size);
+            if (_size > 0) {
+                void* data = mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (data == MAP_FAILED) {
+                    std::cerr << "failed to map " << path << ": " << std::strerror(errno) << '\n';
+                    std::exit(1);
+                }
+
+                madvise(data, _size, MADV_SEQUENTIAL);
+                _data = static_cast<const char*>(data);
+            }
+
+            close(fd);
+        }
+
+        mapped_file(const mapped_file&) = delete;
+        mapped_file& operator=(const mapped_file&) = delete;
+
+        ~mapped_file() {
+            if (_data) {
+                munmap(const_cast<char*>(_data), _size);
+            }
+        }
+
+        std::string_view view() const {
+            return { _data, _size };
+        }
+    };
+
+    // Chunk `i` holds every line that starts within [i * size, (i + 1) * size),
+    // so chunk boundaries can be found by any thread without a pass over the whole file
+    class chunker {
+        private:
+        std::string_view _data;
+        size_t _size;
+
+        size_t line_start(size_t offset) const {
+            if (offset == 0 || offset >= _data.size()) {
+                return std::min(offset, _data.size());
+            }
+
+            size_t newline = _data.find('\n', offset - 1);
+            return newline == std::string_view::npos ? _data.size() : newline + 1;
+        }
+
+        public:
+        chunker(std::string_view data, size_t size) : _data { data }, _size { size } { }
+
+        size_t count() const {
+            return (_data.size() + _size - 1) / _size;
+        }
+
+        std::string_view chunk(size_t index) const {
+            size_t begin = line_start(index * _size);
+            size_t end = line_start((index + 1) * _size);
+            return _data.substr(begin, end - begin);
+        }
+    };
+
+    // TSV fields can't contain tabs or newlines
+    void append_field(std::string& out, std::string_view field) {
+        for (char ch : field) {
+            switch (ch) {
+                case '\t': out.append("\\t"); break;
+                case '\n': out.append("\\n"); break;
+                case '\r': out.append("\\r"); break;
+                case '\\': out.append("\\\\"); break;
+                default: out.push_back(ch); break;
+            }
+        }
+    }
+
+    void normalize_line(const post_query::parser& parser, std::string_view line, std::string& out) {
+        append_field(out, line);
+        out.push_back('\t');
+
+        if (auto valid = encoding::validate(line); !valid) {
+            out.append("\t\t");
+            out.append(encoding::error_message(valid.error()));
+            out.push_back('\n');
+            return;
+        }
+
+        post_query::parse_result res = parser.parse(line);
+        if (!res) {
+            out.append("\t\t");
+            append_field(out, res.error().message);
+            out.push_back('\n');
+            return;
+        }
+
+        post_query::ast_ptr& root = *res;
+        root->to_cnf();
+
+        append_field(out, root->to_sexp());
+        out.push_back('\t');
+        out.append(root->cnf_fingerprint().to_string());
+        out.append("\t\n");
+    }
+
+    size_t normalize_chunk(const post_query::parser& parser, std::string_view chunk, std::string& out) {
+        size_t lines = 0;
+        while (!chunk.empty()) {
+            size_t newline = chunk.find('\n');
+            std::string_view line = chunk.substr(0, newline);
+            chunk.remove_prefix(newline == std::string_view::npos ? chunk.size() : newline + 1);
+
+            if (line.ends_with('\r')) {
+                line.remove_suffix(1);
+            }
+
+            normalize_line(parser, line, out);
+            lines += 1;
+        }
+
+        return lines;
+    }
+
+    // Workers claim chunks in order and hand them to the writer through a ring of slots,
+    // a chunk can only be claimed once its slot was written out
+    class pipeline {
+        private:
+        std::mutex _mutex;
+        std::condition_variable _claimable;
+        std::condition_variable _completed;
+
+        std::vector<std::optional<std::string>> _slots;
+        size_t _claimed = 0;
+        size_t _written = 0;
+        size_t _count;
+
+        // Set when the output failed, no more chunks are handed out
+        bool _stopped = false;
+
+        public:
+        pipeline(size_t count, size_t window) : _slots(window), _count { count } { }
+
+        std::optional<size_t> claim() {
+            std::unique_lock lock { _mutex };
+            _claimable.wait(lock, [this] { return _stopped || _claimed == _count || _claimed < _written + _slots.size(); });
+
+            if (_stopped || _claimed == _count) {
+                return std::nullopt;
+            }
+
+            return _claimed++;
+        }
+
+        void complete(size_t index, std::string out) {
+            {
+                std::lock_guard lock { _mutex };
+                _slots[index % _slots.size()] = std::move(out);
+            }
+
+            _completed.notify_one();
+        }
+
+        // Workers finish the chunk they're on and stop claiming new ones
+        void stop() {
+            {
+                std::lock_guard lock { _mutex };
+                _stopped = true;
+            }
+
+            _claimable.notify_all();
+        }
+
+        // Next chunk in input order, blocks until it was normalized
+        std::optional<std::string> next() {
+            std::unique_lock lock { _mutex };
+            if (_written == _count) {
+                return std::nullopt;
+            }
+
+            std::optional<std::string>& slot = _slots[_written % _slots.size()];
+            _completed.wait(lock, [&slot] { return slot.has_value(); });
+
+            std::string res = std::move(*slot);
+            slot.reset();
+            _written += 1;
+
+            lock.unlock();
+            _claimable.notify_all();
+            return res;
+        }
+    };
+}
+
+int main(int argc, char** argv) {
+    options opts = parse_options(argc, argv);
+
+    std::optional<post_query::parser> parser;
+    if (opts.metatags.empty()) {
+        parser.emplace();
+    } else {
+        parser.emplace(read_lines(opts.metatags));
+    }
+
+    FILE* out = stdout;
+    if (!opts.output.empty() && !(out = std::fopen(opts.output.c_str(), "wb"))) {
+        std::cerr << "failed to open " << opts.output << ": " << std::strerror(errno) << '\n';
+        return 1;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+
+    mapped_file input { opts.input };
+    chunker chunks { input.view(), opts.chunk_size };
+    pipeline queue { chunks.count(), opts.window };
+
+    // No point in more threads than chunks
+    size_t threads = std::min(opts.threads, std::max<size_t>(chunks.count(), 1));
+
+    std::atomic<size_t> lines = 0;
+    std::vector<std::jthread> workers;
+    for (size_t i = 0; i < threads; ++i) {
+        workers.emplace_back([&] {
+            while (std::optional<size_t> index = queue.claim()) {
+                std::string res;
+                lines.fetch_add(normalize_chunk(*parser, chunks.chunk(*index), res), std::memory_order_relaxed);
+                queue.complete(*index, std::move(res));
+            }
+        });
+    }
+
+    // Workers are still running, so errors only stop the pipeline and are reported once they were joined
+    bool failed = false;
+    while (std::optional<std::string> res = queue.next()) {
+        if (std::fwrite(res->data(), 1, res->size(), out) != res->size()) {
+            std::cerr << "failed to write output: " << std::strerror(errno) << '\n';
+            failed = true;
+            queue.stop();
+            break;
+        }
+    }
+
+    workers.clear();
+    if (failed) {
+        return 1;
+    }
+
+    if (std::fflush(out) != 0 || (out != stdout && std::fclose(out) != 0)) {
+        std::cerr << "failed to write output: " << std::strerror(errno) << '\n';
+        return 1;
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cerr << std::format("{} lines in {:.2f}s, {:.0f} lines/s on {} threads\n",
+        lines.load(), seconds, seconds > 0 ? double(lines.load()) / seconds : 0.0, threads);
+
+    return 0;
+}